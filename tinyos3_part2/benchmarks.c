@@ -0,0 +1,1334 @@
+
+#include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "tinyoslib.h"
+#include "symposium.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   These are not tests of correctness, but measurements of the kernel's
+ *   performance. Each benchmark prints its results through MSG(...), so
+ *   they are best run in verbose mode, across a number of cores, e.g.,
+ *      ./benchmarks -v -c 1,2,4,8
+ *
+ */
+
+
+/* Wall-clock time in seconds, with a resolution much better than bios_clock() */
+static double wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+
+/* Resident set size of this process, in kbytes */
+static long rss_kbytes()
+{
+	long size, resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f==NULL) return 0;
+	if(fscanf(f, "%ld %ld", &size, &resident)!=2) resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE)/1024);
+}
+
+
+/* Host CPU time used by this process so far, in seconds */
+static double cpu_time()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + 1E-6*ru.ru_utime.tv_usec 
+		+ ru.ru_stime.tv_sec + 1E-6*ru.ru_stime.tv_usec;
+}
+
+
+/*
+	bench_context_switch
+
+	Two contexts switch to each other repeatedly, outside the VM. This 
+	measures the raw cost of cpu_swap_context().
+ */
+
+#define SWITCH_ROUNDS 1000000
+
+static cpu_context_t pingpong_main, pingpong_ctx[2];
+
+static void pingpong_func()
+{
+	/* Context 0 switches to context 1 and vice versa, SWITCH_ROUNDS times each */
+	static int me = 0;
+	int self = me++;
+	for(int i=0; i<SWITCH_ROUNDS; i++)
+		cpu_swap_context(&pingpong_ctx[self], &pingpong_ctx[1-self]);
+	cpu_swap_context(&pingpong_ctx[self], &pingpong_main);
+}
+
+BARE_TEST(bench_context_switch,
+	"Measure the cost of a context switch, outside the VM."
+	)
+{
+	static char stack[2][64*1024];
+	for(int i=0; i<2; i++)
+		cpu_initialize_context(&pingpong_ctx[i], stack[i], sizeof(stack[i]), pingpong_func);
+
+	double t0 = wall_time();
+	cpu_swap_context(&pingpong_main, &pingpong_ctx[0]);
+	double dt = wall_time() - t0;
+
+	MSG("switches/sec=%.0f  (%.1f nsec/switch)\n", 2*SWITCH_ROUNDS/dt, 1E9*dt/(2*SWITCH_ROUNDS));
+}
+
+
+/*
+	bench_syscalls
+
+	Each system call is called repeatedly from a single thread, with 
+	arguments that make it do its usual work without blocking. This
+	measures the overhead of the system call path.
+ */
+
+#define SYSCALL_ROUNDS 200000
+
+static Fid_t null_fid;
+static char null_buf[16];
+static unsigned int affinity_mask;
+
+static void call_GetPid() { GetPid(); }
+static void call_GetPPid() { GetPPid(); }
+static void call_ThreadSelf() { ThreadSelf(); }
+static void call_GetTerminalDevices() { GetTerminalDevices(); }
+static void call_GetAffinity() { GetAffinity(ThreadSelf(), &affinity_mask); }
+static void call_SetProcessWeight() { SetProcessWeight(GetPid(), DEFAULT_PROCESS_WEIGHT); }
+static void call_Read() { Read(null_fid, null_buf, sizeof(null_buf)); }
+static void call_Write() { Write(null_fid, null_buf, sizeof(null_buf)); }
+static void call_Dup2() { Dup2(null_fid, null_fid+1); }
+
+static struct { const char* name; void (*call)(); } syscall_calls[] = {
+	{ "GetPid", call_GetPid },
+	{ "GetPPid", call_GetPPid },
+	{ "ThreadSelf", call_ThreadSelf },
+	{ "GetTerminalDevices", call_GetTerminalDevices },
+	{ "GetAffinity", call_GetAffinity },
+	{ "SetProcessWeight", call_SetProcessWeight },
+	{ "Read", call_Read },
+	{ "Write", call_Write },
+	{ "Dup2", call_Dup2 },
+};
+
+BOOT_TEST(bench_syscalls,
+	"Measure the time per call of a number of system calls."
+	)
+{
+	null_fid = OpenNull();
+	ASSERT(null_fid != NOFILE);
+
+	for(size_t s=0; s<sizeof(syscall_calls)/sizeof(syscall_calls[0]); s++) {
+		double t0 = wall_time();
+		for(int i=0; i<SYSCALL_ROUNDS; i++)
+			syscall_calls[s].call();
+		double dt = wall_time() - t0;
+		MSG("cores=%u %-20s %8.1f nsec/call\n", cpu_cores(), syscall_calls[s].name, 
+			1E9*dt/SYSCALL_ROUNDS);
+	}
+	return 0;
+}
+
+
+/*
+	bench_yield
+
+	A number of threads (twice the number of cores) call yield() repeatedly.
+ */
+
+#define YIELD_ROUNDS 20000
+
+static int yield_loop(int argl, void* args)
+{
+	for(int i=0; i<YIELD_ROUNDS; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+BOOT_TEST(bench_yield,
+	"Measure the throughput of yield(), with two threads per core."
+	)
+{
+	uint nthreads = 2*cpu_cores();
+	Tid_t tids[nthreads];
+
+	double t0 = wall_time();
+	for(uint i=0; i<nthreads; i++)
+		tids[i] = CreateThread(yield_loop, 0, NULL);
+	for(uint i=0; i<nthreads; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double dt = wall_time() - t0;
+
+	MSG("cores=%u threads=%u  yields/sec=%.0f\n", cpu_cores(), nthreads,
+		nthreads*(double)YIELD_ROUNDS/dt);
+	return 0;
+}
+
+
+/*
+	bench_wakeup
+
+	Pairs of threads (one pair per core) pass a token back and forth,
+	by sleeping and waking each other up (ping-pong).
+ */
+
+#define WAKEUP_ROUNDS 10000
+
+struct token_pair {
+	Mutex lock;
+	int turn;
+	int rounds[2];
+	TCB* thread[2];
+	barrier barrier;
+};
+
+static void token_pass(struct token_pair* pair, int me)
+{
+	Mutex_Lock(& pair->lock);
+	while(pair->turn != me) {
+		sleep_releasing(STOPPED, & pair->lock, SCHED_USER, NO_TIMEOUT);
+		Mutex_Lock(& pair->lock);
+	}
+	pair->turn = 1-me;
+	pair->rounds[me]--;
+	/* A thread that has finished its rounds may have exited already */
+	if(pair->rounds[1-me] > 0)
+		wakeup(pair->thread[1-me]);
+	Mutex_Unlock(& pair->lock);
+}
+
+static int token_loop(int argl, void* args)
+{
+	struct token_pair* pair = args;
+	int me = argl;
+
+	pair->thread[me] = cur_thread();
+	BarrierSync(& pair->barrier, 2);
+
+	while(pair->rounds[me] > 0)
+		token_pass(pair, me);
+	return 0;
+}
+
+BOOT_TEST(bench_wakeup,
+	"Measure the throughput of wakeup(), with one pair of threads per core."
+	)
+{
+	uint npairs = cpu_cores();
+	struct token_pair pairs[npairs];
+	Tid_t tids[2*npairs];
+
+	double t0 = wall_time();
+	for(uint p=0; p<npairs; p++) {
+		pairs[p] = (struct token_pair){ .lock = MUTEX_INIT, .turn = 0, 
+			.rounds = { WAKEUP_ROUNDS, WAKEUP_ROUNDS }, .barrier = BARRIER_INIT };
+		for(int me=0; me<2; me++)
+			tids[2*p+me] = CreateThread(token_loop, me, &pairs[p]);
+	}
+	for(uint i=0; i<2*npairs; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double dt = wall_time() - t0;
+
+	/* Every pass of the token is a wakeup and a context switch */
+	double rate = 2*npairs*(double)WAKEUP_ROUNDS/dt;
+	MSG("cores=%u pairs=%u  wakeups/sec=%.0f switches/sec/core=%.0f\n", cpu_cores(), npairs,
+		rate, rate/cpu_cores());
+	return 0;
+}
+
+
+/*
+	bench_timeouts
+
+	Many threads sleep with a timeout on a condition variable. About half 
+	of them time out, and the rest are woken up by a broadcast.
+ */
+
+#define SLEEPERS 1000
+
+static Mutex sleep_mx = MUTEX_INIT;
+static CondVar sleep_cv = COND_INIT;
+
+static int sleeper(int argl, void* args)
+{
+	Mutex_Lock(&sleep_mx);
+	Cond_TimedWait(&sleep_mx, &sleep_cv, argl);
+	Mutex_Unlock(&sleep_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_timeouts,
+	"Measure the cost of timed sleeps, with many sleeping threads."
+	)
+{
+	static Tid_t tids[SLEEPERS];
+	timer_stats ts0, ts1;
+
+	get_timer_stats(&ts0);
+	double t0 = wall_time();
+
+	/* Timeouts are spread over 1 to 400 msec */
+	for(int i=0; i<SLEEPERS; i++)
+		tids[i] = CreateThread(sleeper, 1 + (i*7919) % 400, NULL);
+	double t1 = wall_time();
+
+	/* Wake up the remaining sleepers after 200 msec */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+	Mutex_Unlock(&mx);
+
+	Mutex_Lock(&sleep_mx);
+	Cond_Broadcast(&sleep_cv);
+	Mutex_Unlock(&sleep_mx);
+
+	for(int i=0; i<SLEEPERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double t2 = wall_time();
+
+	get_timer_stats(&ts1);
+	MSG("cores=%u sleepers=%d  create=%.1f msec total=%.1f msec\n", cpu_cores(), SLEEPERS,
+		1E3*(t1-t0), 1E3*(t2-t0));
+	MSG("timer: inserts=%lu cancels=%lu expires=%lu cascades=%lu\n",
+		ts1.inserts-ts0.inserts, ts1.cancels-ts0.cancels, 
+		ts1.expires-ts0.expires, ts1.cascades-ts0.cascades);
+	return 0;
+}
+
+
+/*
+	bench_tickless
+
+	A mostly idle VM: the init process sleeps for a while, waking up 
+	periodically. The host CPU time used is compared with and without 
+	tickless mode.
+ */
+
+static int idle_init(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<10; i++)
+		Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+BARE_TEST(bench_tickless,
+	"Measure the host CPU time used by a mostly idle VM, with and without tickless mode."
+	)
+{
+	for(int tickless=0; tickless<2; tickless++) {
+		boot_options opts = BOOT_OPTIONS_INIT;
+		opts.tickless = tickless;
+
+		double c0 = cpu_time(), t0 = wall_time();
+		boot_with_options(4, 0, &opts, idle_init, 0, NULL);
+		double c1 = cpu_time(), t1 = wall_time();
+
+		MSG("cores=4 tickless=%d  wall=%.1f msec cpu=%.1f msec\n", tickless, 
+			1E3*(t1-t0), 1E3*(c1-c0));
+	}
+}
+
+
+/*
+	bench_spawn
+
+	Measure the latency of creating and joining a thread, with and 
+	without the per-core cache of thread blocks.
+ */
+
+#define SPAWN_ROUNDS 20000
+
+static int spawn_noop(int argl, void* args)
+{
+	return 0;
+}
+
+static int spawn_init(int argl, void* args)
+{
+	/* Exec copies the arguments, so we get a pointer to the result */
+	double* latency;
+	memcpy(&latency, args, sizeof(latency));
+	double t0 = wall_time();
+	for(int i=0; i<SPAWN_ROUNDS; i++) {
+		Tid_t t = CreateThread(spawn_noop, 0, NULL);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	*latency = (wall_time()-t0)/SPAWN_ROUNDS;
+	return 0;
+}
+
+BARE_TEST(bench_spawn,
+	"Measure the latency of CreateThread+ThreadJoin, with and without the thread cache."
+	)
+{
+	for(int cache=0; cache<2; cache++) {
+		boot_options opts = BOOT_OPTIONS_INIT;
+		opts.thread_cache = cache ? 0 : -1;
+
+		double latency;
+		double* plat = &latency;
+		boot_with_options(2, 0, &opts, spawn_init, sizeof(plat), &plat);
+
+		MSG("cores=2 thread_cache=%s  create+join=%.2f usec\n", cache ? "on" : "off", 
+			1E6*latency);
+	}
+}
+
+
+/*
+	bench_thread_join
+
+	A process creates many threads, which exit at once, and joins them 
+	in the reverse order of their creation. This measures the cost of 
+	ThreadJoin in a process with many threads.
+ */
+
+#define JOIN_THREADS 5000
+
+static int join_noop(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(bench_thread_join,
+	"Measure the time of ThreadJoin in a process with many threads."
+	)
+{
+	static Tid_t tids[JOIN_THREADS];
+	for(int i=0; i<JOIN_THREADS; i++)
+		ASSERT((tids[i] = CreateThread(join_noop, i, NULL)) != NOTHREAD);
+
+	double t0 = wall_time();
+	for(int i=JOIN_THREADS-1; i>=0; i--) {
+		int retval;
+		ASSERT(ThreadJoin(tids[i], &retval)==0);
+		ASSERT(retval == i);
+	}
+	double dt = wall_time() - t0;
+
+	MSG("cores=%u threads=%d  join=%.2f usec\n", cpu_cores(), JOIN_THREADS, 
+		1E6*dt/JOIN_THREADS);
+	return 0;
+}
+
+
+/*
+	bench_idle_threads
+
+	Measure the memory used by many idle threads, each blocked on a
+	condition variable.
+ */
+
+#define IDLE_THREADS 10000
+
+static Mutex idle_mx = MUTEX_INIT;
+static CondVar idle_cv = COND_INIT;
+static int idle_release, idle_count;
+
+static int idle_thread_task(int argl, void* args)
+{
+	Mutex_Lock(&idle_mx);
+	idle_count++;
+	Cond_Broadcast(&idle_cv);
+	while(! idle_release)
+		Cond_Wait(&idle_mx, &idle_cv);
+	Mutex_Unlock(&idle_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_idle_threads,
+	"Measure the memory (RSS) used by many idle threads.",
+	.timeout = 60
+	)
+{
+	static Tid_t tids[IDLE_THREADS];
+	idle_release = idle_count = 0;
+
+	long rss0 = rss_kbytes();
+	for(int i=0; i<IDLE_THREADS; i++) {
+		tids[i] = CreateThread(idle_thread_task, 0, NULL);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+
+	/* Wait until all threads are idle */
+	Mutex_Lock(&idle_mx);
+	while(idle_count < IDLE_THREADS)
+		Cond_Wait(&idle_mx, &idle_cv);
+	long rss1 = rss_kbytes();
+	idle_release = 1;
+	Cond_Broadcast(&idle_cv);
+	Mutex_Unlock(&idle_mx);
+
+	for(int i=0; i<IDLE_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	MSG("cores=%u threads=%d  rss=%ld kbytes (%.1f kbytes/thread)\n", cpu_cores(), IDLE_THREADS,
+		rss1-rss0, (double)(rss1-rss0)/IDLE_THREADS);
+	return 0;
+}
+
+
+/*
+	bench_mutex_contention
+
+	Many threads share one mutex, as the philosophers of a large symposium
+	do: each one locks it for a short critical section, and then works
+	outside it for a while.
+ */
+
+#define MUTEX_THREADS 200
+#define MUTEX_ROUNDS 200
+
+static Mutex contended_mx = MUTEX_INIT;
+static unsigned long contended_count;
+
+static int mutex_contender(int argl, void* args)
+{
+	for(int i=0; i<MUTEX_ROUNDS; i++) {
+		Mutex_Lock(&contended_mx);
+		fibo(10);
+		contended_count++;
+		Mutex_Unlock(&contended_mx);
+		fibo(12);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_contention,
+	"Measure the throughput of a mutex contended by many threads.",
+	.timeout = 120
+	)
+{
+	Tid_t tids[MUTEX_THREADS];
+	contended_count = 0;
+
+	double t0 = wall_time();
+	for(int i=0; i<MUTEX_THREADS; i++)
+		tids[i] = CreateThread(mutex_contender, 0, NULL);
+	for(int i=0; i<MUTEX_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double dt = wall_time() - t0;
+
+	ASSERT(contended_count == MUTEX_THREADS*MUTEX_ROUNDS);
+	MSG("cores=%u threads=%d  lock+unlock=%.2f usec\n", cpu_cores(), 
+		MUTEX_THREADS, 1E6*dt/contended_count);
+	return 0;
+}
+
+
+/*
+	bench_barrier
+
+	Many threads run in lock-step phases, as parallel workloads do, 
+	synchronizing at a barrier after each phase. The library barrier, 
+	built from a mutex and a condition variable, is compared with the 
+	kernel barrier.
+ */
+
+#define BARRIER_THREADS 64
+#define BARRIER_ROUNDS 500
+
+static barrier lib_barrier;
+static Barrier kernel_barrier;
+
+static int barrier_worker(int argl, void* args)
+{
+	for(int i=0; i<BARRIER_ROUNDS; i++) {
+		fibo(8);
+		if(argl)
+			Barrier_Sync(&kernel_barrier, BARRIER_THREADS);
+		else
+			BarrierSync(&lib_barrier, BARRIER_THREADS);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_barrier,
+	"Measure the time of a barrier crossed by many threads, for BarrierSync and Barrier_Sync.",
+	.timeout = 120
+	)
+{
+	for(int kernel=0; kernel<2; kernel++) {
+		Tid_t tids[BARRIER_THREADS];
+		lib_barrier = BARRIER_INIT;
+		kernel_barrier = BARRIER_OBJ_INIT;
+
+		double t0 = wall_time();
+		for(int i=0; i<BARRIER_THREADS; i++)
+			tids[i] = CreateThread(barrier_worker, kernel, NULL);
+		for(int i=0; i<BARRIER_THREADS; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		double dt = wall_time() - t0;
+
+		MSG("cores=%u threads=%d %-12s  phase=%.1f usec\n", cpu_cores(), 
+			BARRIER_THREADS, kernel ? "Barrier_Sync" : "BarrierSync", 1E6*dt/BARRIER_ROUNDS);
+	}
+	return 0;
+}
+
+
+/*
+	bench_pipeline
+
+	A pipeline of threads connected by pipes. The first stage writes
+	data, the middle stages copy it, and the last stage reads it. The
+	pipeline is run with no affinity, and with all stages pinned to the 
+	same core.
+ */
+
+#define PIPELINE_STAGES 4
+#define PIPELINE_BYTES (8 << 20)
+#define PIPELINE_CHUNK 1024
+
+static void write_all(Fid_t fid, const char* buf, int n)
+{
+	while(n > 0) {
+		int w = Write(fid, buf, n);
+		ASSERT(w > 0);
+		buf += w;  n -= w;
+	}
+}
+
+struct pipeline_stage {
+	Fid_t in, out;
+	int pin;
+};
+
+static int pipeline_stage(int argl, void* args)
+{
+	struct pipeline_stage* st = args;
+	static char zeros[PIPELINE_CHUNK];
+	char buf[PIPELINE_CHUNK];
+
+	if(st->pin >= 0)
+		ASSERT(SetAffinity(ThreadSelf(), 1u << st->pin)==0);
+
+	if(st->in == NOFILE) {
+		for(int n=0; n<PIPELINE_BYTES; n+=PIPELINE_CHUNK)
+			write_all(st->out, zeros, PIPELINE_CHUNK);
+	}
+	else {
+		int r, total = 0;
+		while((r = Read(st->in, buf, PIPELINE_CHUNK)) > 0) {
+			total += r;
+			if(st->out != NOFILE)
+				write_all(st->out, buf, r);
+		}
+		ASSERT(total == PIPELINE_BYTES);
+	}
+
+	Close(st->in);
+	Close(st->out);
+	return 0;
+}
+
+static double run_pipeline(int pinned)
+{
+	struct pipeline_stage st[PIPELINE_STAGES];
+	Tid_t tids[PIPELINE_STAGES];
+
+	st[0].in = NOFILE;
+	st[PIPELINE_STAGES-1].out = NOFILE;
+	for(int i=0; i<PIPELINE_STAGES-1; i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		st[i].out = p.write;
+		st[i+1].in = p.read;
+	}
+	for(int i=0; i<PIPELINE_STAGES; i++)
+		st[i].pin = pinned ? 0 : -1;
+
+	double t0 = wall_time();
+	for(int i=0; i<PIPELINE_STAGES; i++)
+		tids[i] = CreateThread(pipeline_stage, 0, &st[i]);
+	for(int i=0; i<PIPELINE_STAGES; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return wall_time() - t0;
+}
+
+BOOT_TEST(bench_pipeline,
+	"Measure the throughput of a pipeline of threads connected by pipes.",
+	.timeout = 60
+	)
+{
+	for(int pinned=0; pinned<2; pinned++) {
+		double dt = run_pipeline(pinned);
+		MSG("cores=%u stages=%d pinned=%d  throughput=%.1f Mbytes/sec\n", cpu_cores(), 
+			PIPELINE_STAGES, pinned, PIPELINE_BYTES/dt/(1<<20));
+	}
+	return 0;
+}
+
+
+/*
+	bench_fair_share
+
+	A wide process with many busy threads competes with a narrow process
+	with a single busy thread, for a fixed time. The share of the work done
+	by the narrow process is reported, with and without fair-share mode.
+ */
+
+#define WIDE_THREADS 50
+#define FAIR_SHARE_TIME 1.0
+
+static double fair_share_stop;
+static unsigned long fair_share_work[2];	/* indexed by 0=wide, 1=narrow */
+
+static int fair_share_worker(int argl, void* args)
+{
+	unsigned long work = 0;
+	while(wall_time() < fair_share_stop) {
+		fibo(15);
+		work++;
+	}
+	__atomic_fetch_add(&fair_share_work[argl], work, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int fair_share_process(int argl, void* args)
+{
+	int nthreads = (argl==0) ? WIDE_THREADS : 1;
+	Tid_t tids[WIDE_THREADS];
+	for(int i=0; i<nthreads; i++)
+		tids[i] = CreateThread(fair_share_worker, argl, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+static int fair_share_init(int argl, void* args)
+{
+	fair_share_work[0] = fair_share_work[1] = 0;
+	fair_share_stop = wall_time() + FAIR_SHARE_TIME;
+	Exec(fair_share_process, 0, NULL);
+	Exec(fair_share_process, 1, NULL);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+BARE_TEST(bench_fair_share,
+	"Measure the CPU share of a narrow process competing with a wide one, with and without fair-share mode.",
+	.timeout = 60
+	)
+{
+	for(unsigned int ncores=1; ncores<=2; ncores++) {
+		for(int fair=0; fair<2; fair++) {
+			boot_options opts = BOOT_OPTIONS_INIT;
+			opts.fair_share = fair;
+			boot_with_options(ncores, 0, &opts, fair_share_init, 0, NULL);
+
+			unsigned long total = fair_share_work[0] + fair_share_work[1];
+			MSG("cores=%u fair_share=%d  wide(%d threads)=%.1f%% narrow(1 thread)=%.1f%%\n", 
+				ncores, fair, WIDE_THREADS,
+				100.0*fair_share_work[0]/total, 100.0*fair_share_work[1]/total);
+		}
+	}
+}
+
+
+/*
+	bench_wakeup_latency
+
+	All cores are kept busy by low-priority threads. One of them repeatedly 
+	wakes up a high-priority thread, and keeps computing; the latency from 
+	the signal to the moment the woken thread runs is collected in a 
+	histogram. This is done with and without preemption on wakeup.
+ */
+
+#define LATENCY_ROUNDS 200
+#define LATENCY_BUCKETS 12	/* powers of 2, from 16 usec to 32 msec and above */
+
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int seq;
+	double signal_time;
+	int hogs_stop;
+	unsigned int hist[LATENCY_BUCKETS];
+	double lat[LATENCY_ROUNDS];
+	int nlat;	/* the sleeper may miss a round, if it runs late */
+} L;
+
+static void busy_wait(double sec)
+{
+	double t = wall_time() + sec;
+	while(wall_time() < t);
+}
+
+static int latency_hog(int argl, void* args)
+{
+	while(! L.hogs_stop)
+		fibo(15);
+	return 0;
+}
+
+static int latency_waker(int argl, void* args)
+{
+	/* Sink to a low priority, like the hogs */
+	busy_wait(0.3);
+
+	for(int i=0; i<LATENCY_ROUNDS; i++) {
+		busy_wait(3E-3);
+		/* Signal after unlocking, else the woken thread would find the mutex locked */
+		Mutex_Lock(&L.mx);
+		L.signal_time = wall_time();
+		L.seq++;
+		Mutex_Unlock(&L.mx);
+		Cond_Signal(&L.cv);
+	}
+	return 0;
+}
+
+static int latency_sleeper(int argl, void* args)
+{
+	int seen = 0;
+	Mutex_Lock(&L.mx);
+	while(seen < LATENCY_ROUNDS) {
+		while(L.seq == seen)
+			Cond_Wait(&L.mx, &L.cv);
+		seen = L.seq;
+		double lat = wall_time() - L.signal_time;
+		L.lat[L.nlat++] = lat;
+
+		int b = 0;
+		for(double bound = 16E-6; b < LATENCY_BUCKETS-1 && lat >= bound; bound *= 2) b++;
+		L.hist[b]++;
+	}
+	Mutex_Unlock(&L.mx);
+	return 0;
+}
+
+static int latency_init(int argl, void* args)
+{
+	uint nhogs = cpu_cores()-1;
+	Tid_t hogs[nhogs+1];
+	for(uint i=0; i<nhogs; i++)
+		hogs[i] = CreateThread(latency_hog, 0, NULL);
+
+	Tid_t sleeper = CreateThread(latency_sleeper, 0, NULL);
+	Tid_t waker = CreateThread(latency_waker, 0, NULL);
+	ThreadJoin(waker, NULL);
+	ThreadJoin(sleeper, NULL);
+
+	L.hogs_stop = 1;
+	for(uint i=0; i<nhogs; i++)
+		ThreadJoin(hogs[i], NULL);
+	return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+BARE_TEST(bench_wakeup_latency,
+	"Measure the latency from wakeup to run of a high-priority thread, when all cores are busy,\n"
+	"with and without preemption on wakeup.",
+	.timeout = 60
+	)
+{
+	for(unsigned int ncores=1; ncores<=2; ncores++) {
+		for(int preempt=0; preempt<2; preempt++) {
+			memset(&L, 0, sizeof(L));
+			L.mx = MUTEX_INIT;
+			L.cv = COND_INIT;
+
+			boot_options opts = BOOT_OPTIONS_INIT;
+			opts.no_wakeup_preempt = !preempt;
+			boot_with_options(ncores, 0, &opts, latency_init, 0, NULL);
+
+			int n = L.nlat;
+			qsort(L.lat, n, sizeof(double), compare_double);
+			MSG("cores=%u preempt=%d  wakeups=%d median=%.1f usec p90=%.1f usec max=%.1f usec\n", 
+				ncores, preempt, n, 1E6*L.lat[n/2], 1E6*L.lat[n*9/10], 1E6*L.lat[n-1]);
+
+			char line[256];
+			int pos = 0;
+			unsigned int bound = 16;
+			for(int b=0; b<LATENCY_BUCKETS; b++, bound *= 2) {
+				if(b < LATENCY_BUCKETS-1)
+					pos += sprintf(line+pos, " <%u:%u", bound, L.hist[b]);
+				else
+					pos += sprintf(line+pos, " >=%u:%u", bound/2, L.hist[b]);
+			}
+			MSG("  histogram (usec:count)%s\n", line);
+		}
+	}
+}
+
+
+/*
+	A latency-critical server thread serves requests from a client, spending
+	25 msec of CPU time on each, while CPU-bound hogs keep all cores busy. 
+	Since each request takes longer than a quantum, the server is demoted 
+	as a time-sharing thread. The latency from each request to the moment 
+	the server runs is measured, with the server in the time-sharing class 
+	and in the real-time class.
+ */
+
+#define RT_ROUNDS 60
+
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int seq;
+	double signal_time;
+	int hogs_stop;
+	double lat[RT_ROUNDS];
+	int nlat;
+} R;
+
+static int rt_hog(int argl, void* args)
+{
+	while(! R.hogs_stop)
+		fibo(15);
+	return 0;
+}
+
+static int rt_server(int argl, void* args)
+{
+	if(argl)
+		ASSERT(SetRealTime(ThreadSelf(), 30, 40) == 0);
+
+	int seen = 0;
+	Mutex_Lock(&R.mx);
+	while(seen < RT_ROUNDS) {
+		while(R.seq == seen)
+			Cond_Wait(&R.mx, &R.cv);
+		seen = R.seq;
+		R.lat[R.nlat++] = wall_time() - R.signal_time;
+
+		/* Serve the request */
+		Mutex_Unlock(&R.mx);
+		busy_wait(25E-3);
+		Mutex_Lock(&R.mx);
+	}
+	Mutex_Unlock(&R.mx);
+	return 0;
+}
+
+static int rt_client(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	for(int i=0; i<RT_ROUNDS; i++) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 40);
+		Mutex_Unlock(&mx);
+
+		Mutex_Lock(&R.mx);
+		R.signal_time = wall_time();
+		R.seq++;
+		Mutex_Unlock(&R.mx);
+		Cond_Signal(&R.cv);
+	}
+	return 0;
+}
+
+static int rt_init(int argl, void* args)
+{
+	uint nhogs = 2*cpu_cores();
+	Tid_t hogs[nhogs];
+	for(uint i=0; i<nhogs; i++)
+		hogs[i] = CreateThread(rt_hog, 0, NULL);
+
+	Tid_t server = CreateThread(rt_server, argl, NULL);
+	Tid_t client = CreateThread(rt_client, 0, NULL);
+	ThreadJoin(client, NULL);
+	ThreadJoin(server, NULL);
+
+	R.hogs_stop = 1;
+	for(uint i=0; i<nhogs; i++)
+		ThreadJoin(hogs[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_realtime_latency,
+	"Measure the tail latency of a CPU-intensive server thread, when the cores are busy\n"
+	"with CPU hogs, with the server in the time-sharing and in the real-time class.",
+	.timeout = 120
+	)
+{
+	for(unsigned int ncores=1; ncores<=2; ncores++) {
+		for(int rt=0; rt<2; rt++) {
+			memset(&R, 0, sizeof(R));
+			R.mx = MUTEX_INIT;
+			R.cv = COND_INIT;
+
+			boot(ncores, 0, rt_init, rt, NULL);
+
+			int n = R.nlat;
+			qsort(R.lat, n, sizeof(double), compare_double);
+			MSG("cores=%u %-12s requests=%d median=%.1f usec p90=%.1f usec p99=%.1f usec max=%.1f usec\n", 
+				ncores, rt ? "real-time" : "time-sharing", n, 
+				1E6*R.lat[n/2], 1E6*R.lat[n*9/10], 1E6*R.lat[n*99/100], 1E6*R.lat[n-1]);
+		}
+	}
+}
+
+
+/*
+	bench_priority_inversion
+
+	A low-priority thread runs a critical section over and over, and a 
+	high-priority thread needs the same mutex every 20 msec, while CPU hogs
+	keep all cores busy at the low priority levels. Without priority 
+	inheritance, the owner of the mutex shares its core with the hogs, while
+	the high-priority thread waits for it.
+ */
+
+#define PI_ROUNDS 40
+
+static struct {
+	Mutex mx;
+	int stop;
+	double wait[PI_ROUNDS];
+} PI;
+
+static int pi_hog(int argl, void* args)
+{
+	while(! PI.stop)
+		fibo(15);
+	return 0;
+}
+
+static int pi_low(int argl, void* args)
+{
+	while(! PI.stop) {
+		Mutex_Lock(&PI.mx);
+		fibo(22);
+		Mutex_Unlock(&PI.mx);
+	}
+	return 0;
+}
+
+static int pi_high(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	for(int i=0; i<PI_ROUNDS; i++) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 20);
+		Mutex_Unlock(&mx);
+
+		double t0 = wall_time();
+		Mutex_Lock(&PI.mx);
+		PI.wait[i] = wall_time() - t0;
+		Mutex_Unlock(&PI.mx);
+	}
+	return 0;
+}
+
+static int pi_init(int argl, void* args)
+{
+	uint nhogs = 2*cpu_cores();
+	Tid_t hogs[nhogs];
+
+	Tid_t low = CreateThread(pi_low, 0, NULL);
+	for(uint i=0; i<nhogs; i++)
+		hogs[i] = CreateThread(pi_hog, 0, NULL);
+	Tid_t high = CreateThread(pi_high, 0, NULL);
+
+	ThreadJoin(high, NULL);
+	PI.stop = 1;
+	ThreadJoin(low, NULL);
+	for(uint i=0; i<nhogs; i++)
+		ThreadJoin(hogs[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_priority_inversion,
+	"Measure how long a high-priority thread waits for a mutex held by a low-priority\n"
+	"thread, while the cores are busy with CPU hogs, with and without priority inheritance.",
+	.timeout = 120
+	)
+{
+	for(unsigned int ncores=1; ncores<=2; ncores++) {
+		for(int pi=0; pi<2; pi++) {
+			memset(&PI, 0, sizeof(PI));
+			PI.mx = MUTEX_INIT;
+
+			boot_options opts = BOOT_OPTIONS_INIT;
+			opts.no_priority_inheritance = !pi;
+			boot_with_options(ncores, 0, &opts, pi_init, 0, NULL);
+
+			qsort(PI.wait, PI_ROUNDS, sizeof(double), compare_double);
+			MSG("cores=%u inheritance=%-3s  median wait=%.1f usec p90=%.1f usec max=%.1f usec\n", 
+				ncores, pi ? "on" : "off", 1E6*PI.wait[PI_ROUNDS/2], 
+				1E6*PI.wait[PI_ROUNDS*9/10], 1E6*PI.wait[PI_ROUNDS-1]);
+		}
+	}
+}
+
+
+/*
+	bench_pipe_throughput
+
+	One writer and one reader thread move data through a pipe, with 
+	writes of a given size. The reader reads as much as it can each time.
+	Each size is measured with the default capacity of a pipe, and with
+	a large one. The context switches of the two threads are taken from 
+	their scheduler accounting.
+ */
+
+#define PIPE_READ_CHUNK (64 << 10)
+
+struct pipe_run {
+	pipe_t p;
+	unsigned int chunk;
+	unsigned long bytes;
+	unsigned long switches;
+};
+
+/* The context switches of the current thread so far */
+static unsigned long thread_switches()
+{
+	Fid_t fid = OpenThreadInfo();
+	ASSERT(fid != NOFILE);
+	threadinfo info;
+	unsigned long sw = 0;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info))
+		if(info.pid == GetPid() && info.tid == ThreadSelf())
+			sw = info.vol_switches + info.invol_switches;
+	Close(fid);
+	return sw;
+}
+
+static int pipe_run_writer(int argl, void* args)
+{
+	struct pipe_run* run = args;
+	static char data[PIPE_READ_CHUNK];
+	for(unsigned long n=0; n<run->bytes; n+=run->chunk)
+		write_all(run->p.write, data, run->chunk);
+	Close(run->p.write);
+	__atomic_add_fetch(&run->switches, thread_switches(), __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int pipe_run_reader(int argl, void* args)
+{
+	struct pipe_run* run = args;
+	static char buf[PIPE_READ_CHUNK];
+	unsigned long total = 0;
+	int r;
+	while((r = Read(run->p.read, buf, PIPE_READ_CHUNK)) > 0)
+		total += r;
+	ASSERT(total == run->bytes);
+	Close(run->p.read);
+	__atomic_add_fetch(&run->switches, thread_switches(), __ATOMIC_RELAXED);
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_throughput,
+	"Measure the throughput of a pipe, for writes of 1 byte, 64 bytes, 4 kbytes and 64 kbytes."
+	)
+{
+	static const unsigned int chunks[] = { 1, 64, 4 << 10, 64 << 10 };
+	static const unsigned int capacities[] = { PIPE_DEFAULT_CAPACITY, 256 << 10 };
+
+	for(int c=0; c<2; c++)
+	for(int i=0; i<4; i++) {
+		struct pipe_run run = { .chunk = chunks[i], 
+			.bytes = (chunks[i] == 1) ? (1ul << 20) : (32ul << 20) };
+		ASSERT(PipeWithCapacity(&run.p, capacities[c])==0);
+
+		double t0 = wall_time();
+		Tid_t w = CreateThread(pipe_run_writer, 0, &run);
+		Tid_t r = CreateThread(pipe_run_reader, 0, &run);
+		ASSERT(ThreadJoin(w, NULL)==0);
+		ASSERT(ThreadJoin(r, NULL)==0);
+		double dt = wall_time() - t0;
+
+		MSG("cores=%u capacity=%-6u write=%-6u  throughput=%.1f Mbytes/sec  switches/Mbyte=%.0f\n", 
+			cpu_cores(), capacities[c], run.chunk, run.bytes/dt/(1<<20), 
+			run.switches / (run.bytes/(double)(1<<20)));
+	}
+	return 0;
+}
+
+
+/*
+	bench_parallel_streams
+
+	Independent pairs of writer and reader threads, each pair connected 
+	by its own pipe or socket, move data in parallel. Since the pairs share
+	no stream, their aggregate throughput should grow with the cores.
+ */
+
+#define STREAM_PAIRS 4
+#define STREAM_BYTES (4 << 20)
+
+struct stream_pair {
+	Fid_t in, out;
+};
+
+struct stream_run {
+	int sockets;
+	double* dt;
+};
+
+static int stream_writer(int argl, void* args)
+{
+	struct stream_pair* sp = args;
+	static char zeros[PIPELINE_CHUNK];
+
+	for(int n=0; n<STREAM_BYTES; n+=PIPELINE_CHUNK)
+		write_all(sp->out, zeros, PIPELINE_CHUNK);
+	Close(sp->out);
+	return 0;
+}
+
+static int stream_reader(int argl, void* args)
+{
+	struct stream_pair* sp = args;
+	char buf[PIPELINE_CHUNK];
+
+	int r, total = 0;
+	while((r = Read(sp->in, buf, PIPELINE_CHUNK)) > 0)
+		total += r;
+	ASSERT(total == STREAM_BYTES);
+	Close(sp->in);
+	return 0;
+}
+
+static int stream_acceptor(int argl, void* args)
+{
+	struct stream_pair* sp = args;
+	for(int i=0; i<STREAM_PAIRS; i++) {
+		sp[i].in = Accept(argl);
+		ASSERT(sp[i].in != NOFILE);
+	}
+	return 0;
+}
+
+static int streams_init(int argl, void* args)
+{
+	struct stream_run* run = args;
+	struct stream_pair sp[STREAM_PAIRS];
+	Tid_t tids[2*STREAM_PAIRS];
+
+	if(run->sockets) {
+		Fid_t lsock = Socket(100);
+		ASSERT(Listen(lsock)==0);
+		Tid_t acceptor = CreateThread(stream_acceptor, lsock, sp);
+		for(int i=0; i<STREAM_PAIRS; i++) {
+			sp[i].out = Socket(NOPORT);
+			ASSERT(Connect(sp[i].out, 100, 1000)==0);
+		}
+		ASSERT(ThreadJoin(acceptor, NULL)==0);
+		Close(lsock);
+	}
+	else {
+		for(int i=0; i<STREAM_PAIRS; i++) {
+			pipe_t p;
+			ASSERT(Pipe(&p)==0);
+			sp[i].in = p.read;
+			sp[i].out = p.write;
+		}
+	}
+
+	double t0 = wall_time();
+	for(int i=0; i<STREAM_PAIRS; i++) {
+		tids[2*i] = CreateThread(stream_writer, 0, &sp[i]);
+		tids[2*i+1] = CreateThread(stream_reader, 0, &sp[i]);
+	}
+	for(int i=0; i<2*STREAM_PAIRS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	*run->dt = wall_time() - t0;
+	return 0;
+}
+
+BARE_TEST(bench_parallel_streams,
+	"Measure the aggregate throughput of independent pipes and sockets, used in parallel.",
+	.timeout = 120
+	)
+{
+	for(int sockets=0; sockets<2; sockets++) {
+		for(unsigned int ncores=1; ncores<=4; ncores*=2) {
+			double dt;
+			struct stream_run run = { sockets, &dt };
+			boot(ncores, 0, streams_init, sizeof(run), &run);
+
+			MSG("cores=%u %-7s pairs=%d  throughput=%.1f Mbytes/sec\n", ncores, 
+				sockets ? "sockets" : "pipes", STREAM_PAIRS, 
+				(double)STREAM_PAIRS*STREAM_BYTES/dt/(1<<20));
+		}
+	}
+}
+
+
+TEST_SUITE(io_benchmarks,
+	"Benchmarks of the pipes and sockets."
+	)
+{
+	&bench_pipe_throughput,
+	&bench_parallel_streams,
+	NULL
+};
+
+
+TEST_SUITE(scheduler_benchmarks,
+	"Benchmarks of the scheduler."
+	)
+{
+	&bench_syscalls,
+	&bench_yield,
+	&bench_wakeup,
+	&bench_timeouts,
+	&bench_tickless,
+	&bench_spawn,
+	&bench_idle_threads,
+	&bench_thread_join,
+	&bench_mutex_contention,
+	&bench_barrier,
+	&bench_pipeline,
+	&bench_fair_share,
+	&bench_wakeup_latency,
+	&bench_realtime_latency,
+	&bench_priority_inversion,
+	NULL
+};
+
+
+TEST_SUITE(all_benchmarks,
+	"All benchmarks."
+	)
+{
+	&bench_context_switch,
+	&scheduler_benchmarks,
+	&io_benchmarks,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
+
@@ -1054,9 +1054,9 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
@@ -1118,6 +1118,87 @@ void cpu_enable_interrupts()
 }
 
 
+#if defined(BIOS_FAST_CONTEXT)
+
+/*
+	The x86-64 context switch.
+
+	A suspended context is a stack, whose top contains the callee-saved 
+	registers (rbp, rbx, r12-r15), the SSE and x87 control words, and
+	the return address into the code that suspended it. Caller-saved
+	registers are saved by the C compiler at the call site of bios_ctx_switch.
+
+	A new context is set up so that bios_ctx_switch "returns" into 
+	bios_ctx_start, with the context function in rbx.
+ */
+void bios_ctx_switch(void** save_sp, void* load_sp);
+void bios_ctx_start(void);
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type bios_ctx_switch,@function\n"
+	"bios_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size bios_ctx_switch, .-bios_ctx_switch\n"
+	"\n"
+	".p2align 4\n"
+	".type bios_ctx_start,@function\n"
+	"bios_ctx_start:\n"
+	"	andq $-16, %rsp\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	".size bios_ctx_start, .-bios_ctx_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* Build the initial frame at the top of the stack */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) top;
+
+	*--sp = 0;									/* fake return address of bios_ctx_start */
+	*--sp = (uint64_t) bios_ctx_start;			/* return address of bios_ctx_switch */
+	*--sp = 0;									/* rbp */
+	*--sp = (uint64_t) ctx_func;				/* rbx */
+	*--sp = 0;									/* r12 */
+	*--sp = 0;									/* r13 */
+	*--sp = 0;									/* r14 */
+	*--sp = 0;									/* r15 */
+	*--sp = 0x1F80 | ((uint64_t)0x037F << 32);	/* default mxcsr and x87 control word */
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_ctx_switch(& oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1140,6 +1221,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -387,8 +387,9 @@ void cpu_core_halt();
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted, 0 otherwise
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -405,10 +406,32 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use a hand-written context switch.
+
+	On x86-64, contexts are switched by saving and restoring only the
+	callee-saved registers on the stack, without any system call. 
+	On other architectures, or if @c BIOS_UCONTEXT is defined, 
+	contexts are switched by @c swapcontext(3), which also saves and 
+	restores the signal mask.
+
+	In both cases, the interrupt state (see @c cpu_disable_interrupts) is 
+	a property of the core, not of the context. Contexts should only be 
+	switched with interrupts disabled, and a new context starts with 
+	interrupts disabled.
+ */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_FAST_CONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#if defined(BIOS_FAST_CONTEXT)
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
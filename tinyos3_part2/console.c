@@ -11,10 +11,14 @@
 
 extern FILE *saved_in, *saved_out;
 
+/* Streams are used by many cores at once, so each one has a lock */
+static Mutex stdin_lock = MUTEX_INIT, stdout_lock = MUTEX_INIT;
+
 static int stdio_read(void* __this, char *buf, unsigned int size)
 {
 	size_t ret;
 
+	Mutex_Lock(&stdin_lock);
 	while(1) {
 		ret = fread_unlocked(buf, 1, size, saved_in);
 
@@ -29,13 +33,17 @@ static int stdio_read(void* __this, char *buf, unsigned int size)
 			break;
 		}
 	}
+	Mutex_Unlock(&stdin_lock);
 	return ret;
 }
 
 
 static int stdio_write(void* __this, const char* buf, unsigned int size)
 {
-	return fwrite_unlocked(buf, 1, size, saved_out);
+	Mutex_Lock(&stdout_lock);
+	size_t ret = fwrite_unlocked(buf, 1, size, saved_out);
+	Mutex_Unlock(&stdout_lock);
+	return ret;
 }
 
 static int stdio_close(void* this) { return 0; }
@@ -59,10 +67,7 @@ void tinyos_pseudo_console()
 		abort();
 	}
 
-	fcb[0]->streamobj = NULL;
-	fcb[1]->streamobj = NULL;
-
-	fcb[0]->streamfunc = &__stdio_ops;
-	fcb[1]->streamfunc = &__stdio_ops;
+	FCB_open(fcb[0], NULL, &__stdio_ops);
+	FCB_open(fcb[1], NULL, &__stdio_ops);
 
 }
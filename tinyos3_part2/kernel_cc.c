@@ -1,6 +1,14 @@
 
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(LOCK_STATISTICS)
+#include <stdio.h>
+#include <time.h>
+#endif
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -20,49 +28,523 @@
 
 
 /*
- 	Pre-emption aware mutex.
- 	-------------------------
+	Futex wait queues.
+	------------------
+
+	A thread can sleep on the address of a mutex, as long as the mutex has
+	a given value, and be woken up by a thread that changes the value. 
+	The sleeping threads are kept in a small hash table of wait queues, 
+	keyed by the address. The bucket locks are pure spinlocks, taken with
+	preemption off, and they are never contended for long.
+ */
+
+/* The mutex word: 0 when unlocked, else the owner's TCB address and these flags */
+#define MUTEX_LOCKED ((Mutex)1)
+#define MUTEX_WAITERS ((Mutex)2)
+#define MUTEX_OWNER(v) ((TCB*)((v) & ~(MUTEX_LOCKED|MUTEX_WAITERS)))
+
+/** \cond HELPER Helper structure for futex waiters. */
+typedef struct __futex_waiter {
+	rlnode node;				/* become part of a bucket's ring */
+	Mutex* addr;				/* the address we sleep on */
+	TCB* thread;				/* thread to wait */
+	sig_atomic_t queued;		/* this is cleared when the waiter is removed */
+} __futex_waiter;
+/** \endcond */
+
+#define FUTEX_BUCKETS 64
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+static struct futex_bucket {
+	Mutex lock;
+	__futex_waiter* waiters;	/* a ring of waiters, or NULL */
+} futex_table[FUTEX_BUCKETS];
 
- 	Therefore, we can call the same function from both the preemptive and
- 	the non-preemptive domain of the kernel.
+static inline struct futex_bucket* futex_bucket(Mutex* addr)
+{
+	uintptr_t a = (uintptr_t) addr;
+	return & futex_table[(a ^ (a >> 6) ^ (a >> 12)) % FUTEX_BUCKETS];
+}
+
+static inline void futex_remove(struct futex_bucket* b, __futex_waiter* w)
+{
+	if(b->waiters == w) {
+		__futex_waiter* nextw = w->node.next->obj;
+		b->waiters = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+	w->queued = 0;
+}
 
- 	The implementation is based on GCC atomics, as the standard C11 primitives
- 	are not supported by all recent compilers. Eventually, this will change.
+/* 
+  Add a waiter to a bucket, and lend the waiter's priority to the owner 
+  of the mutex, if any. The owner cannot go away meanwhile, since its 
+  unlock must wake up the waiter, under the bucket lock.
  */
-void Mutex_Lock(Mutex* lock)
+static void futex_enqueue(struct futex_bucket* b, __futex_waiter* w, TCB* owner)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+	if(b->waiters)
+		rlist_push_back(& b->waiters->node, & w->node);
+	else
+		b->waiters = w;
+	w->queued = 1;
+
+	if(owner != NULL)
+		sched_inherit_priority(owner, w->thread);
+}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+
+/* Sleep on addr while it equals val, lending our priority to owner */
+static void futex_sleep(Mutex* addr, Mutex val, TCB* owner)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	__futex_waiter waiter = { .addr = addr, .thread = cur_thread(), .queued = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	/* The value may have changed before we locked the bucket */
+	if(__atomic_load_n(addr, __ATOMIC_RELAXED) != val) {
+		Mutex_Unlock(& b->lock);
+		if(preempt) preempt_on;
+		return;
+	}
+
+	futex_enqueue(b, &waiter, owner);
+
+	sleep_releasing(STOPPED, & b->lock, SCHED_MUTEX, NO_TIMEOUT);
+
+	/* We may have been woken up by someone else (e.g., a condition variable
+	   that we were leaving); the caller re-checks the value anyway. */
+	Mutex_Lock(& b->lock);
+	if(waiter.queued)
+		futex_remove(b, &waiter);
+	Mutex_Unlock(& b->lock);
+
+	if(preempt) preempt_on;
+}
+
+
+/*
+  The highest priority lent by the waiters of the mutexes held by a thread, 
+  or -1. A thread does not keep a list of the mutexes it holds, so all the
+  buckets are scanned; this is only done when a thread with an inherited 
+  priority releases a contended mutex. The mutex of a queued waiter cannot
+  go away, so its value can be read.
+ */
+static int futex_lent_priority(TCB* owner)
+{
+	int lent = -1;
+	int preempt = preempt_off;
+	for(int i=0; i<FUTEX_BUCKETS; i++) {
+		struct futex_bucket* b = & futex_table[i];
+		if(__atomic_load_n(&b->waiters, __ATOMIC_RELAXED) == NULL)
+			continue;
+		Mutex_Lock(& b->lock);
+		__futex_waiter* w = b->waiters;
+		for(int left = w ? rlist_len(& w->node) + 1 : 0; left > 0; left--) {
+			if(MUTEX_OWNER(__atomic_load_n(w->addr, __ATOMIC_RELAXED)) == owner) {
+				int p = sched_lent_priority(w->thread);
+				if(p > lent)
+					lent = p;
+			}
+			w = w->node.next->obj;
+		}
+		Mutex_Unlock(& b->lock);
+	}
+	if(preempt) preempt_on;
+	return lent;
+}
+
+
+void futex_wait(Mutex* addr, Mutex val)
+{
+	futex_sleep(addr, val, MUTEX_OWNER(val));
+}
+
+
+int futex_wake(Mutex* addr, int n)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	int woken = 0;
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	__futex_waiter* w = b->waiters;
+	for(int left = b->waiters ? rlist_len(& w->node) + 1 : 0; left > 0 && woken < n; left--) {
+		__futex_waiter* next = w->node.next->obj;
+		if(w->addr == addr) {
+			futex_remove(b, w);
+			/* A requeued waiter may be awake already (see futex_requeue) */
+			if(wakeup(w->thread))
+				woken++;
+		}
+		w = next;
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+	return woken;
+}
+
+
+/*
+  Move a thread to the wait queue of a locked mutex, without waking it up,
+  so that the thread that unlocks the mutex wakes it. The mutex is marked 
+  as contended. The thread may be awake already, e.g., after a timeout; 
+  it must then remove the waiter itself, and futex_wake() skips it.
+
+  Returns 0 if the mutex is unlocked; the thread must then be woken up.
+ */
+static int futex_requeue(__futex_waiter* w, Mutex* addr)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	int queued = 0;
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	Mutex v = __atomic_load_n(addr, __ATOMIC_RELAXED);
+	while(v != 0) {
+		if((v & MUTEX_WAITERS) 
+				|| __atomic_compare_exchange_n(addr, &v, v | MUTEX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			w->addr = addr;
+			futex_enqueue(b, w, MUTEX_OWNER(v));
+			queued = 1;
+			break;
+		}
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+	return queued;
+}
+
+/* Remove a waiter that may still be queued */
+static void futex_dequeue(__futex_waiter* w)
+{
+	struct futex_bucket* b = futex_bucket(w->addr);
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+	if(w->queued)
+		futex_remove(b, w);
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Pre-emption aware mutex.
+	-------------------------
+
+	The mutex is 0 when unlocked. When locked, it holds the address of the
+	owner thread with MUTEX_LOCKED set, and also MUTEX_WAITERS when some 
+	threads may be sleeping on it (as in Drepper's "Futexes are tricky").
+
+	A thread that finds the mutex locked spins for a while, if the holder
+	can be running on another core, and then sleeps on the futex wait queue
+	of the mutex, lending its priority to the owner. The unlocking thread 
+	drops any priority it has inherited, and wakes up one sleeper.
+
+	This mutex will act as a spinlock if preemption is off. Therefore, we can
+	call the same function from both the preemptive and the non-preemptive 
+	domain of the kernel.
+
+	The implementation is based on GCC atomics, as the standard C11 primitives
+	are not supported by all recent compilers. Eventually, this will change.
+ */
+
+#define MUTEX_SPINS 1000
+
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
+#endif
+}
+
+/* 
+  The current thread (or NULL before the scheduler runs), read without disabling 
+  preemption. If the thread migrates between the two reads of the core id, we retry.
+ */
+static inline TCB* mutex_self()
+{
+  uint core;
+  TCB* cur;
+  do {
+    core = __atomic_load_n(&cpu_core_id, __ATOMIC_RELAXED);
+    cur = __atomic_load_n(&cctx[core].current_thread, __ATOMIC_RELAXED);
+  } while(core != __atomic_load_n(&cpu_core_id, __ATOMIC_RELAXED));
+  return cur;
+}
+
+/*
+  Lock statistics.
+  ----------------
+
+  With LOCK_STATISTICS defined, each call of Mutex_Lock, Cond_Wait and 
+  Cond_TimedWait passes its own static lock_site (see tinyos.h). A site 
+  is added to the list of sites the first time it is used. Its counters 
+  are updated atomically, since it may be used on many cores at once.
+
+  To measure hold times, the site and time of each acquisition are kept 
+  in a small table indexed by the mutex address, and read back by 
+  Mutex_Unlock. A mutex that shares its slot with another held mutex 
+  is not measured, so the maximum hold time is a lower bound. 
+  The BIOS clock is too coarse for this, so the host clock is used.
+ */
+
+/* The waiting done to lock a contended mutex */
+struct lock_wait {
+  unsigned long spins, yields, sleeps;
+};
+
+#if defined(LOCK_STATISTICS)
+
+static lock_site* lock_sites;	/* the list of used sites */
+
+/* Calls of the plain functions are accounted here */
+static lock_site unknown_site = { LOCKINFO_MUTEX, "(unknown)", 0, "" };
+#define UNKNOWN_SITE (&unknown_site)
+
+#define LOCK_HOLD_SLOTS 4096
+static struct lock_hold {
+  Mutex* lock;
+  lock_site* site;
+  unsigned long since;
+} lock_hold[LOCK_HOLD_SLOTS];
+
+static inline unsigned long lockstat_clock()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000ul + t.tv_nsec/1000ul;
+}
+
+static inline struct lock_hold* lock_hold_slot(Mutex* lock)
+{
+  return &lock_hold[((uintptr_t) lock / sizeof(Mutex)) % LOCK_HOLD_SLOTS];
+}
+
+static void lockstat_acquired(lock_site* site, Mutex* lock, int contended, struct lock_wait* w)
+{
+  if(! __atomic_load_n(&site->registered, __ATOMIC_ACQUIRE) 
+      && ! __atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL)) {
+    site->next = __atomic_load_n(&lock_sites, __ATOMIC_RELAXED);
+    while(! __atomic_compare_exchange_n(&lock_sites, &site->next, site, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+  if(contended) {
+    __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->spins, w->spins, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->yields, w->yields, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->sleeps, w->sleeps, __ATOMIC_RELAXED);
+  }
+
+  struct lock_hold* h = lock_hold_slot(lock);
+  h->site = site;
+  h->since = lockstat_clock();
+  __atomic_store_n(&h->lock, lock, __ATOMIC_RELEASE);
+}
+
+static void lockstat_released(Mutex* lock)
+{
+  struct lock_hold* h = lock_hold_slot(lock);
+  if(__atomic_load_n(&h->lock, __ATOMIC_ACQUIRE) != lock)
+    return;
+
+  lock_site* site = h->site;
+  unsigned long held = lockstat_clock() - h->since;
+  __atomic_store_n(&h->lock, NULL, __ATOMIC_RELAXED);
+
+  unsigned long max = __atomic_load_n(&site->max_hold, __ATOMIC_RELAXED);
+  while(held > max 
+    && ! __atomic_compare_exchange_n(&site->max_hold, &max, held, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void reset_lock_statistics()
+{
+  for(lock_site* site = __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE); site; site = site->next)
+    site->acquisitions = site->contended = site->spins 
+      = site->yields = site->sleeps = site->max_hold = 0;
+  memset(lock_hold, 0, sizeof(lock_hold));
+}
+
+static void lockstat_info(lock_site* site, lockinfo* info)
+{
+  info->kind = site->kind;
+  snprintf(info->name, LOCKINFO_NAME_SIZE, "%s:%d %s", site->file, site->line, site->expr);
+  info->acquisitions = site->acquisitions;
+  info->contended = site->contended;
+  info->spins = site->spins;
+  info->yields = site->yields;
+  info->sleeps = site->sleeps;
+  info->max_hold = site->max_hold;
+}
+
+int get_lock_info(lockinfo* info, int n)
+{
+  int count = 0;
+  for(lock_site* site = __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+    if(site->acquisitions == 0)
+      continue;
+    if(count < n)
+      lockstat_info(site, &info[count]);
+    count++;
+  }
+  return count;
+}
+
+void print_lock_statistics()
+{
+  fprintf(stderr, "%-48s %10s %10s %12s %8s %8s %10s\n",
+    "Lock site", "Acquired", "Contended", "Spins", "Yields", "Sleeps", "Max hold");
+  lockinfo info;
+  for(lock_site* site = lock_sites; site; site = site->next) {
+    if(site->acquisitions == 0)
+      continue;
+    lockstat_info(site, &info);
+    fprintf(stderr, "%-48.48s %10lu %10lu %12lu %8lu %8lu %10lu\n",
+      info.name, info.acquisitions, info.contended, info.spins, 
+      info.yields, info.sleeps, info.max_hold);
+  }
+}
+
+#else
+
+typedef struct lock_site lock_site;
+#define UNKNOWN_SITE NULL
+#define lockstat_acquired(site, lock, contended, w)
+#define lockstat_released(lock)
+
+int get_lock_info(lockinfo* info, int n)
+{
+  return -1;
+}
+
 #endif
+
+
+/* 
+  Mark the mutex as contended and sleep, until we lock it. Since others
+  may still sleep on it, we lock it as contended too.
+ */
+static void mutex_lock_sleeping(Mutex* lock, TCB* cur, struct lock_wait* w)
+{
+  Mutex self = (Mutex) cur | MUTEX_LOCKED | MUTEX_WAITERS;
+  Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  for(;;) {
+    if(v == 0) {
+      if(__atomic_compare_exchange_n(lock, &v, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    }
+    else if((v & MUTEX_WAITERS) 
+        || __atomic_compare_exchange_n(lock, &v, v | MUTEX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      futex_wait(lock, v | MUTEX_WAITERS);
+      w->sleeps++;
+      v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Lock a mutex that was found locked */
+static void mutex_lock_contended(Mutex* lock, struct lock_wait* w)
+{
+  /* 
+    With preemption off we can only spin. The idle thread must not sleep,
+    so it yields as it spins.
+   */
+  TCB* cur = cpu_interrupts_enabled() ? cur_thread() : NULL;
+  if(cur == NULL || cur->type == IDLE_THREAD) {
+    int spin=MUTEX_SPINS;
+    while(! Mutex_TryLock(lock)) {
+      cpu_relax();
+      w->spins++;
       if(spin>0) 
-      	spin--; 
+        spin--; 
       else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+        spin=MUTEX_SPINS; 
+        if(cur != NULL) {
+          yield(SCHED_MUTEX); 
+          w->yields++;
+        }
       }
     }
+    return;
+  }
+
+  /* On a single core, the holder cannot run while we spin */
+  if(cpu_cores() > 1) {
+    for(int spin=MUTEX_SPINS; spin>0; spin--) {
+      if(__atomic_load_n(lock, __ATOMIC_RELAXED) == 0 && Mutex_TryLock(lock))
+        return;
+      cpu_relax();
+      w->spins++;
+    }
   }
-#undef MUTEX_SPINS
+
+  mutex_lock_sleeping(lock, cur, w);
+}
+
+static void mutex_lock(Mutex* lock, lock_site* site)
+{
+  struct lock_wait w = { 0, 0, 0 };
+  int contended = ! Mutex_TryLock(lock);
+  if(contended)
+    mutex_lock_contended(lock, &w);
+  lockstat_acquired(site, lock, contended, &w);
+}
+
+void (Mutex_Lock)(Mutex* lock)
+{
+  mutex_lock(lock, UNKNOWN_SITE);
+}
+
+#if defined(LOCK_STATISTICS)
+void Mutex_Lock_at(Mutex* lock, lock_site* site)
+{
+  mutex_lock(lock, site);
+}
+#endif
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  Mutex unlocked = 0;
+  Mutex self = (Mutex) mutex_self() | MUTEX_LOCKED;
+  return __atomic_compare_exchange_n(lock, &unlocked, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  lockstat_released(lock);
+  if(__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) & MUTEX_WAITERS) {
+    /* Drop the inherited priority first, so that the woken thread can 
+       preempt us, before we lock the mutex again. The priority lent by the 
+       waiters of the mutexes we still hold is kept. */
+    TCB* cur = mutex_self();
+    while(cur != NULL && cur->pi_base >= 0) {
+      uint gen = __atomic_load_n(&cur->pi_gen, __ATOMIC_ACQUIRE);
+      if(sched_restore_priority(cur, futex_lent_priority(cur), gen))
+        break;
+    }
+    futex_wake(lock, 1);
+  }
 }
 
 
 /*
 	Condition variables.	
+
+	A signalled waiter must lock the mutex again, which is usually held by
+	the signalling thread. Instead of waking the waiter up to find the mutex
+	locked, the waiter is moved to the wait queue of the mutex ("wait
+	morphing"), and the thread that unlocks the mutex wakes it up. This 
+	way, a broadcast wakes up the waiters one at a time, as the mutex 
+	becomes free, and not all at once.
 */
 
 
@@ -70,9 +552,13 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* the mutex to lock again */
+	__futex_waiter fw;			/* to wait on the mutex, when requeued */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t requeued;		/* this is set if the waiter is moved to 
+								   the wait queue of the mutex */
 } __cv_waiter;
 /** \endcond */
 
@@ -88,6 +574,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 		cv->waitset =  (nextw == w) ? NULL : nextw;
 	}
 	rlist_remove(& w->node);
+	cv->waiters--;
 }
 
 
@@ -112,6 +599,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+  @param site The lock site to account the re-locking of the mutex to.
 
   @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
 
@@ -119,10 +607,13 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Broadcast
   */
 static int cv_wait(Mutex* mutex, CondVar* cv, 
-		enum SCHED_CAUSE cause, TimerDuration timeout)
+		enum SCHED_CAUSE cause, TimerDuration timeout, lock_site* site)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	TCB* cur = cur_thread();
+	__cv_waiter waiter = { .thread=cur, .mutex=mutex, .fw = { .thread=cur }, 
+		.signalled = 0, .removed=0, .requeued=0 };
 	rlnode_init(& waiter.node, &waiter);
+	rlnode_init(& waiter.fw.node, &waiter.fw);
 
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
@@ -132,6 +623,7 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	} else {
 		cv->waitset = &waiter;
 	}
+	cv->waiters++;
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
@@ -147,7 +639,18 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	if(! waiter.requeued) {
+		mutex_lock(mutex, site);
+		return waiter.signalled;
+	}
+
+	/* We may have woken up before the mutex was unlocked (e.g., by a timeout).
+	   Other requeued threads may still sleep on the mutex, so we lock it as 
+	   contended, in order to wake them up when we unlock it. */
+	futex_dequeue(&waiter.fw);
+	struct lock_wait w = { 0, 0, 0 };
+	mutex_lock_sleeping(mutex, cur, &w);
+	lockstat_acquired(site, mutex, w.sleeps > 0, &w);
 	return waiter.signalled;
 }
 
@@ -156,7 +659,8 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
-  Else, it leaves the cv->waitset == NULL.
+  Else, it leaves the cv->waitset == NULL. If the waiter's mutex is 
+  locked, the waiter is moved to its wait queue, instead of woken up.
  */
 static inline void cv_signal(CondVar* cv)
 {
@@ -165,6 +669,11 @@ static inline void cv_signal(CondVar* cv)
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
+		if(futex_requeue(&waiter->fw, waiter->mutex)) {
+			waiter->requeued = 1;
+			waiter->signalled = 1;
+			return;
+		}
 		if(wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
@@ -174,31 +683,59 @@ static inline void cv_signal(CondVar* cv)
 
 
 
-int Cond_Wait(Mutex* mutex, CondVar* cv)
+int (Cond_Wait)(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT, UNKNOWN_SITE);
 }
 
-int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
+int (Cond_TimedWait)(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul, UNKNOWN_SITE);
+}
+
+#if defined(LOCK_STATISTICS)
+int Cond_Wait_at(Mutex* mutex, CondVar* cv, lock_site* site)
+{
+	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT, site);
 }
 
+int Cond_TimedWait_at(Mutex* mutex, CondVar* cv, timeout_t timeout, lock_site* site)
+{
+	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul, site);
+}
+#endif
+
 
+/*
+  The waitset lock is held with preemption off: a wakeup may preempt this 
+  core, and the woken thread would then spin on the waitset lock.
+
+  Without waiters, there is nothing to lock. A thread that waits before 
+  the signal must have locked the mutex, and counted itself, before the 
+  signalling thread changed the condition under the same mutex.
+ */
 void Cond_Signal(CondVar* cv)
 {
+  if(__atomic_load_n(&cv->waiters, __ATOMIC_RELAXED) == 0) return;
+
+  int preempt = preempt_off;
   Mutex_Lock(&(cv->waitset_lock));
   cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
+  if(__atomic_load_n(&cv->waiters, __ATOMIC_RELAXED) == 0) return;
+
+  int preempt = preempt_off;
   Mutex_Lock(&(cv->waitset_lock));
   while(cv->waitset) cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
@@ -206,68 +743,231 @@ void Cond_Broadcast(CondVar* cv)
 
 
 /*
- *
- * The kernel locks
- *
+	Reader-writer locks.
+	--------------------
+
+	The state word counts the readers in units of RW_READER. It has flags 
+	for a writer that holds the lock, a writer that waits for it, and 
+	threads that may sleep on it. A waiting writer keeps new readers out, 
+	so that writers are not starved. Sleepers wait on the futex queue of 
+	the state word, and are all woken up on release, as writers are rare.
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+#define RW_WRITER ((Mutex)1)
+#define RW_WAITERS ((Mutex)2)
+#define RW_WANTED ((Mutex)4)
+#define RW_READER ((Mutex)8)
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	Mutex v = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	for(;;) {
+		if(! (v & (RW_WRITER|RW_WANTED))) {
+			if(__atomic_compare_exchange_n(&rw->state, &v, v + RW_READER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+		}
+		else if((v & RW_WAITERS) 
+				|| __atomic_compare_exchange_n(&rw->state, &v, v | RW_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			futex_sleep(&rw->state, v | RW_WAITERS, NULL);
+			v = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	Mutex v = __atomic_sub_fetch(&rw->state, RW_READER, __ATOMIC_RELEASE);
+
+	/* The last reader wakes up the sleepers, unless a writer got in first */
+	while(v < RW_READER && (v & RW_WAITERS) && !(v & RW_WRITER)) {
+		if(__atomic_compare_exchange_n(&rw->state, &v, v & ~RW_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			futex_wake(&rw->state, INT_MAX);
+			return;
+		}
+	}
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	Mutex v = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	for(;;) {
+		if(! (v & ~(RW_WAITERS|RW_WANTED))) {
+			/* Other writers may still sleep; they set RW_WANTED again */
+			if(__atomic_compare_exchange_n(&rw->state, &v, RW_WRITER | (v & RW_WAITERS), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+		}
+		else if((v & (RW_WAITERS|RW_WANTED)) == (RW_WAITERS|RW_WANTED)
+				|| __atomic_compare_exchange_n(&rw->state, &v, v | RW_WAITERS | RW_WANTED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			futex_sleep(&rw->state, v | RW_WAITERS | RW_WANTED, NULL);
+			v = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	if(__atomic_exchange_n(&rw->state, 0, __ATOMIC_RELEASE) & RW_WAITERS)
+		futex_wake(&rw->state, INT_MAX);
+}
+
+
+
+/*
+	Semaphores.
+	-----------
+
+	The tokens are taken and put back with atomic updates of the value. 
+	A thread that finds no tokens sleeps on the futex queue of the value;
+	it is counted in the waiters first, so that either it sees the token 
+	of a concurrent Sem_Post, or the poster sees it and wakes it up.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+void Sem_Wait(Semaphore* sem)
+{
+	Mutex v = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+	while(v > 0)
+		if(__atomic_compare_exchange_n(&sem->value, &v, v-1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+
+	__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+	for(;;) {
+		v = __atomic_load_n(&sem->value, __ATOMIC_SEQ_CST);
+		if(v == 0)
+			futex_sleep(&sem->value, 0, NULL);
+		else if(__atomic_compare_exchange_n(&sem->value, &v, v-1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_RELAXED);
+}
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+void Sem_Post(Semaphore* sem)
+{
+	__atomic_add_fetch(&sem->value, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0)
+		futex_wake(&sem->value, 1);
+}
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
 
-void kernel_lock()
+
+/*
+	Barriers.
+	---------
+
+	An arriving thread reads the epoch and then counts itself in, with
+	one atomic increment. The last arrival resets the count and advances 
+	the epoch, and wakes all the sleepers on the epoch in one pass. The 
+	others sleep on the epoch while it is unchanged; since they do not 
+	share the count's word, arrivals do not disturb them.
+
+	Arrivals are serialized only by the atomic increment, i.e., by the 
+	cores, not by the threads, which is why there is no combining tree:
+	there are never more than MAX_CORES concurrent arrivals.
+ */
+
+void Barrier_Sync(Barrier* bar, unsigned int n)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	assert(n>0);
+	Mutex epoch = __atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE);
+	Mutex count = __atomic_add_fetch(&bar->count, 1, __ATOMIC_ACQ_REL);
+	assert(count <= n);
+
+	if(count == n) {
+		__atomic_store_n(&bar->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&bar->epoch, epoch+1, __ATOMIC_RELEASE);
+		futex_wake(&bar->epoch, INT_MAX);
+		return;
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+
+	while(__atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE) == epoch)
+		futex_sleep(&bar->epoch, epoch, NULL);
 }
 
-void kernel_unlock()
+
+
+/*
+	Read-copy-update.
+	-----------------
+
+	A read-side section runs with preemption off, and must not sleep. On
+	entry, it records the global epoch in the slot of its core, which is 
+	the only memory it writes, and it clears the slot on exit. A writer
+	that has unpublished an object calls synchronize_rcu(), which advances
+	the epoch and waits until no core is in a section that began earlier.
+	After that, no reader can still hold a pointer to the object.
+ */
+
+static unsigned long rcu_epoch = 1;
+
+static struct rcu_slot {
+	unsigned long epoch;	/* the epoch at the start of the section, or 0 */
+	unsigned int nesting;	/* the depth of nested sections */
+} __attribute__((aligned(64))) rcu_slot[MAX_CORES];
+
+int rcu_read_lock()
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	int preempt = preempt_off;
+	struct rcu_slot* rs = &rcu_slot[cpu_core_id];
+	if(rs->nesting++ == 0) {
+		__atomic_store_n(&rs->epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		/* The slot must be visible to writers before we read their data */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return preempt;
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+void rcu_read_unlock(int preempt)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	struct rcu_slot* rs = &rcu_slot[cpu_core_id];
+	if(--rs->nesting == 0)
+		__atomic_store_n(&rs->epoch, 0, __ATOMIC_RELEASE);
+	if(preempt) preempt_on;
+}
+
+void synchronize_rcu()
+{
+	unsigned long epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for(uint c=0; c<cpu_cores(); c++) {
+		for(;;) {
+			unsigned long e = __atomic_load_n(&rcu_slot[c].epoch, __ATOMIC_ACQUIRE);
+			if(e == 0 || e >= epoch)
+				break;
+			cpu_relax();
+		}
+	}
+}
+
+
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+/*
+ *
+ * Kernel waiting
+ *
+ */
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+/*
+  There is no big kernel lock. Each kernel subsystem protects its data 
+  with its own mutexes (the process table, each PCB, each pipe and socket,
+  the file table), so that system calls on different objects run in 
+  parallel. Kernel code waits on a condition variable with the mutex that
+  protects the condition.
+ */
 
-	return ret;
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout, UNKNOWN_SITE);
 }
 
+#if defined(LOCK_STATISTICS)
+int kernel_wait_site(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	lock_site* site, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout, site);
+}
+#endif
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -278,14 +978,8 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
 }
 
-
-
-
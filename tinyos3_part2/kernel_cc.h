@@ -32,32 +32,110 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+/**
+	@brief Try to lock a mutex, without waiting.
+
+	This is used by the scheduler, in order to take locks out of the
+	usual locking order without risking a deadlock.
+
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked.
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Sleep on the address of a mutex.
+
+	The calling thread sleeps until it is woken up by @ref futex_wake on
+	the same address, unless @c *addr is no longer equal to @c val, in which 
+	case it returns at once. The thread may also return spuriously, so the 
+	caller must re-check its condition.
+
+	This is used by @c Mutex_Lock, to sleep on a contended mutex.
  */
+void futex_wait(Mutex* addr, Mutex val);
 
 /**
-	@brief Lock the kernel.
+	@brief Wake up threads sleeping on the address of a mutex.
+
+	Up to @c n threads sleeping on @c addr in @ref futex_wait are woken up.
+
+	@returns the number of threads woken up.
  */
-void kernel_lock();
+int futex_wake(Mutex* addr, int n);
+
 
 /**
-	@brief Unlock the kernel.
+	@brief Enter an RCU read-side section.
+
+	Inside the section, the reader may follow pointers to objects that 
+	writers unpublish concurrently; the objects are not freed before the 
+	section ends (see @ref synchronize_rcu). Preemption is off inside the 
+	section, so it must be short and it must not sleep. It writes no 
+	shared memory, apart from a slot of the current core. Sections may nest.
+
+	A typical read-side section is
+	@code
+	int preempt = rcu_read_lock();
+	...
+	    obj = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+	...
+	rcu_read_unlock(preempt);
+	@endcode
+
+	@returns the previous preemption status, to be passed to @ref rcu_read_unlock.
+ */
+int rcu_read_lock();
+
+/** @brief Leave an RCU read-side section. */
+void rcu_read_unlock(int preempt);
+
+/**
+	@brief Wait for the current RCU read-side sections to end.
+
+	A writer calls this after it has unpublished an object, and before it
+	frees it. The call waits for the sections running on other cores, so 
+	it must not be called inside a read-side section.
+ */
+void synchronize_rcu();
+
+
+/*
+ * Kernel waiting.
+ * There is no kernel lock; kernel code waits on a condition variable 
+ * with the mutex that protects the condition, as in a monitor.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	The mutex @c mx must be locked by the caller. It is unlocked
+	atomically with going to sleep, and locked again before returning.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#if defined(LOCK_STATISTICS)
+
+/** @brief Like @ref kernel_wait_wchan, accounting the re-locking of @c mx to a lock site. */
+int kernel_wait_site(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	lock_site* site, TimerDuration timeout);
+
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_site((mx),(cv),(cause),LOCK_SITE(LOCKINFO_COND, cv), NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_site((mx),(cv),(cause),LOCK_SITE(LOCKINFO_COND, cv), (timeout))
+
+#else
+
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
+#endif
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -73,13 +151,44 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put the current thread to sleep, releasing @c mx.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	This is used by an exiting thread. The mutex (if not NULL) is released
+	only after the thread's CPU time has been charged to its process, so
+	that the process is not released under it.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
+
+
+
+/**
+	@brief Copy the statistics of the used lock sites.
 
+	Up to @c n @c lockinfo records are stored in @c info.
+
+	@returns the number of used lock sites, which may be more than @c n, 
+	or -1 if the kernel was not built with @c LOCK_STATISTICS.
+	@see OpenLockInfo
+  */
+int get_lock_info(lockinfo* info, int n);
+
+#if defined(LOCK_STATISTICS)
+
+/**
+	@brief Clear the statistics of all lock sites.
+
+	This is called at boot, so that each boot reports its own statistics.
+  */
+void reset_lock_statistics();
+
+/**
+	@brief Print the statistics of the used lock sites to @c stderr.
+
+	This is called after the VM halts, next to the core statistics of the BIOS.
+  */
+void print_lock_statistics();
+
+#endif
 
 
 /** @brief Set the preemption status for the current core.
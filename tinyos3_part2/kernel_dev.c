@@ -103,6 +103,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
@@ -113,12 +114,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -145,7 +147,12 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 
   unsigned int count = 0;
   while(count < size) {
+    /* The lock is never held across a yield */
+    int pre = preempt_off;
+    Mutex_Lock(&dcb->spinlock);
     int success = bios_write_serial(dcb->devno, buf[count] );
+    Mutex_Unlock(&dcb->spinlock);
+    if(pre) preempt_on;
 
     if(success) {
       count++;
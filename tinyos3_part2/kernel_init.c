@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -26,6 +27,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  boot_options options;
 } boot_rec;
 
 
@@ -35,10 +37,10 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
-    initialize_processes();
+    initialize_processes(& boot_rec.options);
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(& boot_rec.options);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -59,13 +61,29 @@ void boot_tinyos_kernel()
 }
 
 
-void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+void boot_with_options(uint ncores, uint nterm, const boot_options* options, 
+  Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
+  boot_rec.options = (options!=NULL) ? *options : BOOT_OPTIONS_INIT;
+
+#if defined(LOCK_STATISTICS)
+  reset_lock_statistics();
+#endif
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+#if defined(LOCK_STATISTICS)
+  print_lock_statistics();
+#endif
+}
+
+
+void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_with_options(ncores, nterm, NULL, boot_task, argl, args);
 }
 
 
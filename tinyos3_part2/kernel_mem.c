@@ -0,0 +1,161 @@
+
+#include <assert.h>
+#include <string.h>
+#include "kernel_mem.h"
+#include "kernel_cc.h"
+
+
+/*
+	The caches that have been used, in a lock-free list. A cache is
+	pushed at its first use and never removed.
+ */
+static kmem_cache* kmem_caches;
+
+static void kmem_register(kmem_cache* cache)
+{
+	if(__atomic_exchange_n(&cache->registered, 1, __ATOMIC_ACQ_REL))
+		return;
+	kmem_cache* head = __atomic_load_n(&kmem_caches, __ATOMIC_RELAXED);
+	do {
+		cache->next = head;
+	} while(!__atomic_compare_exchange_n(&kmem_caches, &head, cache, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+	The depot. A core exchanges an empty magazine for a full one, and
+	vice versa, under the depot lock. Both calls are made with the lock
+	of the core's magazines held.
+ */
+
+/* Exchange an empty magazine (or NULL) for a full one, if there is one */
+static kmem_magazine* depot_get_full(kmem_cache* cache, kmem_magazine* empty)
+{
+	Mutex_Lock(&cache->depot_lock);
+	kmem_magazine* mag = cache->full;
+	if(mag != NULL) {
+		cache->full = mag->next;
+		cache->depot_full--;
+		if(empty != NULL) {
+			empty->next = cache->empty;
+			cache->empty = empty;
+		}
+	}
+	Mutex_Unlock(&cache->depot_lock);
+	return mag;
+}
+
+/* Exchange a full magazine (or NULL) for an empty one */
+static kmem_magazine* depot_get_empty(kmem_cache* cache, kmem_magazine* full)
+{
+	Mutex_Lock(&cache->depot_lock);
+	if(full != NULL) {
+		full->next = cache->full;
+		cache->full = full;
+		cache->depot_full++;
+	}
+	kmem_magazine* mag = cache->empty;
+	if(mag != NULL)
+		cache->empty = mag->next;
+	else
+		cache->magazines++;
+	Mutex_Unlock(&cache->depot_lock);
+
+	if(mag == NULL) {
+		mag = (kmem_magazine*) xmalloc(sizeof(kmem_magazine));
+		mag->rounds = 0;
+	}
+	return mag;
+}
+
+
+/*
+	The magazines of a core are used without disabling preemption, which
+	is expensive; a thread that migrates after reading cpu_core_id simply
+	uses the magazines of its previous core, under their lock.
+ */
+
+void* kmem_alloc(kmem_cache* cache)
+{
+	kmem_register(cache);
+	kmem_cpu_cache* cc = &cache->cpu[cpu_core_id];
+	void* obj = NULL;
+
+	Mutex_Lock(&cc->lock);
+	cc->allocs++;
+
+	if(cc->loaded == NULL || cc->loaded->rounds == 0) {
+		if(cc->previous != NULL && cc->previous->rounds > 0) {
+			kmem_magazine* mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+		} else {
+			kmem_magazine* mag = depot_get_full(cache, cc->loaded);
+			if(mag != NULL)
+				cc->loaded = mag;
+		}
+	}
+
+	if(cc->loaded != NULL && cc->loaded->rounds > 0)
+		obj = cc->loaded->objs[--cc->loaded->rounds];
+	Mutex_Unlock(&cc->lock);
+
+	if(obj == NULL) {
+		__atomic_add_fetch(&cache->host_allocs, 1, __ATOMIC_RELAXED);
+		obj = xmalloc(cache->size);
+	}
+	return obj;
+}
+
+
+void kmem_free(kmem_cache* cache, void* obj)
+{
+	assert(obj != NULL);
+	kmem_cpu_cache* cc = &cache->cpu[cpu_core_id];
+
+	Mutex_Lock(&cc->lock);
+	cc->frees++;
+
+	if(cc->loaded == NULL || cc->loaded->rounds == KMEM_MAGAZINE_SIZE) {
+		if(cc->previous != NULL && cc->previous->rounds < KMEM_MAGAZINE_SIZE) {
+			kmem_magazine* mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+		} else {
+			/* Both are full (or missing): the previous one goes to the depot */
+			kmem_magazine* mag = depot_get_empty(cache, cc->previous);
+			cc->previous = cc->loaded;
+			cc->loaded = mag;
+		}
+	}
+
+	cc->loaded->objs[cc->loaded->rounds++] = obj;
+	Mutex_Unlock(&cc->lock);
+}
+
+
+int get_mem_info(meminfo* info, int n)
+{
+	int count = 0;
+	for(kmem_cache* cache = __atomic_load_n(&kmem_caches, __ATOMIC_ACQUIRE);
+			cache != NULL; cache = cache->next, count++) {
+		if(count >= n)
+			continue;
+
+		meminfo* mi = &info[count];
+		memset(mi, 0, sizeof(meminfo));
+		strncpy(mi->name, cache->name, MEMINFO_NAME_SIZE-1);
+		mi->object_size = cache->size;
+
+		/* The counters are read without locks; they may be slightly stale */
+		for(int c=0; c<MAX_CORES; c++) {
+			mi->allocs += __atomic_load_n(&cache->cpu[c].allocs, __ATOMIC_RELAXED);
+			mi->frees += __atomic_load_n(&cache->cpu[c].frees, __ATOMIC_RELAXED);
+		}
+		mi->host_allocs = __atomic_load_n(&cache->host_allocs, __ATOMIC_RELAXED);
+		mi->magazines = __atomic_load_n(&cache->magazines, __ATOMIC_RELAXED);
+		mi->depot_full = __atomic_load_n(&cache->depot_full, __ATOMIC_RELAXED);
+	}
+	return count;
+}
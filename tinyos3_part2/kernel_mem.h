@@ -0,0 +1,107 @@
+#ifndef __KERNEL_MEM_H
+#define __KERNEL_MEM_H
+
+/**
+  @file kernel_mem.h
+  @brief Object caches for kernel objects.
+
+  @defgroup mem Kernel memory
+  @ingroup kernel
+  @brief Object caches for kernel objects.
+
+  Kernel objects that are created and destroyed often (PTCBs, pipes,
+  sockets and connection requests) are allocated from object caches,
+  instead of the host's @c malloc. Each cache holds objects of one type.
+  Freed objects are kept by the cache for reuse, so that in the steady
+  state no host memory is allocated.
+
+  Each core has two magazines (bounded stacks of free objects) per cache,
+  which serve allocations and frees without contention with other cores.
+  When both magazines of a core are empty (full), a full (empty) magazine
+  is exchanged with the cache's depot. Objects are allocated from the
+  host only when the depot has no full magazines.
+
+  @{
+*/
+
+#include "util.h"
+#include "bios.h"
+#include "tinyos.h"
+
+/** @brief The number of objects in a magazine */
+#define KMEM_MAGAZINE_SIZE 16
+
+/** @brief A bounded stack of free objects */
+typedef struct kmem_magazine {
+  struct kmem_magazine* next;   /**< @brief Next magazine in the depot */
+  unsigned int rounds;          /**< @brief The number of objects in @c objs */
+  void* objs[KMEM_MAGAZINE_SIZE];
+} kmem_magazine;
+
+/** @brief The magazines of a cache on one core */
+typedef struct kmem_cpu_cache {
+  Mutex lock;                 /**< @brief Protects this struct; almost never contended */
+  kmem_magazine* loaded;      /**< @brief The magazine used first */
+  kmem_magazine* previous;    /**< @brief The other magazine, either full or empty */
+  unsigned long allocs;       /**< @brief Objects allocated on this core */
+  unsigned long frees;        /**< @brief Objects freed on this core */
+} __attribute__((aligned(64))) kmem_cpu_cache;
+
+/**
+  @brief An object cache.
+
+  A cache is defined statically, by @ref KMEM_CACHE_INIT, and it is added
+  to the list of caches reported by @c OpenMemInfo the first time it is used.
+ */
+typedef struct kmem_cache {
+  const char* name;           /**< @brief The name of the cache */
+  size_t size;                /**< @brief The size of the objects */
+
+  kmem_cpu_cache cpu[MAX_CORES];  /**< @brief The per-core magazines */
+
+  Mutex depot_lock;           /**< @brief Protects the depot */
+  kmem_magazine* full;        /**< @brief The full magazines of the depot */
+  kmem_magazine* empty;       /**< @brief The empty magazines of the depot */
+  unsigned long depot_full;   /**< @brief The number of magazines in @c full */
+
+  unsigned long host_allocs;  /**< @brief Objects allocated from the host */
+  unsigned long magazines;    /**< @brief Magazines allocated from the host */
+
+  struct kmem_cache* next;    /**< @brief The next cache in the list of caches */
+  int registered;             /**< @brief Set when the cache is added to the list */
+} kmem_cache;
+
+/**
+  @brief Initializer for the cache of a type.
+
+  @code
+  static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe_cb", pipe_cb);
+  @endcode
+ */
+#define KMEM_CACHE_INIT(name, type) { (name), sizeof(type) }
+
+/**
+  @brief Allocate an object from a cache.
+
+  The object is not initialized. This must be called with preemption on.
+ */
+void* kmem_alloc(kmem_cache* cache);
+
+/**
+  @brief Return an object to its cache.
+ */
+void kmem_free(kmem_cache* cache, void* obj);
+
+/**
+  @brief Copy the statistics of the used caches.
+
+  Up to @c n @c meminfo records are stored in @c info.
+
+  @returns the number of used caches, which may be more than @c n.
+  @see OpenMemInfo
+ */
+int get_mem_info(meminfo* info, int n);
+
+/** @} */
+
+#endif
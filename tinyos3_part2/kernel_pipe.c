@@ -1,9 +1,12 @@
+#include <string.h>
 #include "kernel_pipe.h"
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_dev.h"
 #include "kernel_sched.h"
 #include "kernel_cc.h"
+#include "kernel_mem.h"
+#include "kernel_proc.h"
 
 
 //Used to return -1 in specific file operation functions
@@ -28,65 +31,311 @@ static file_ops reader_file_ops=
 	.Close = pipe_reader_close
 };
 
-//Allocates memory for a pipe control block.
+_Static_assert((PIPE_DEFAULT_CAPACITY & (PIPE_DEFAULT_CAPACITY-1)) == 0, 
+	"PIPE_DEFAULT_CAPACITY must be a power of two");
+_Static_assert((PIPE_MAX_CAPACITY & (PIPE_MAX_CAPACITY-1)) == 0, 
+	"PIPE_MAX_CAPACITY must be a power of two");
+
+static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe_cb", pipe_cb);
+
+/* Buffers of the default size are cached; larger ones come from the host */
+typedef struct { char bytes[PIPE_DEFAULT_CAPACITY]; } pipe_buffer;
+static kmem_cache pipe_buffer_cache = KMEM_CACHE_INIT("pipe_buffer", pipe_buffer);
+
+static char* alloc_pipe_buffer(unsigned int size)
+{
+	if(size == PIPE_DEFAULT_CAPACITY)
+		return (char*)kmem_alloc(&pipe_buffer_cache);
+	return (char*)xmalloc(size);
+}
+
+static void free_pipe_buffer(char* buffer, unsigned int size)
+{
+	if(size == PIPE_DEFAULT_CAPACITY)
+		kmem_free(&pipe_buffer_cache, buffer);
+	else
+		free(buffer);
+}
+
+/*
+  The buffer of a pipe is charged to the process that created it, up to the
+  pipe_budget of the process. A buffer that the budget does not cover does 
+  not grow, and writers wait for the reader, as if it were at its capacity.
+  When a process exits, its pipes still open in other processes are taken 
+  off its account, and are no longer charged; they keep their buffer, but 
+  it no longer grows. Pipes of sockets have no account, and do not grow.
+
+  The accounts of all processes are protected by one lock, which is taken 
+  last, and held only briefly: charges are made when buffers are allocated.
+ */
+static Mutex pipe_account_lock = MUTEX_INIT;
+
+//Opens the account of a new pipe at a process, charging its buffer. Returns 0 if the budget does not cover it.
+static int pipe_open_account(pipe_cb* pipe, PCB* pcb)
+{
+	Mutex_Lock(&pipe_account_lock);
+	int ok = (pcb->pipe_budget - pcb->pipe_bytes >= pipe->size);
+	if(ok) {
+		pcb->pipe_bytes += pipe->size;
+		pipe->account = pcb;
+		rlist_push_back(&pcb->pipe_list, &pipe->account_node);
+	}
+	Mutex_Unlock(&pipe_account_lock);
+	return ok;
+}
+
+//Closes the account of a pipe that is freed, refunding its buffer.
+static void pipe_close_account(pipe_cb* pipe)
+{
+	Mutex_Lock(&pipe_account_lock);
+	if(pipe->account != NULL) {
+		pipe->account->pipe_bytes -= pipe->size;
+		rlist_remove(&pipe->account_node);
+		pipe->account = NULL;
+	}
+	Mutex_Unlock(&pipe_account_lock);
+}
+
+//Charges n more bytes of buffer to the account of a pipe. Returns 0 if the budget does not cover them.
+static int pipe_charge(pipe_cb* pipe, unsigned int n)
+{
+	Mutex_Lock(&pipe_account_lock);
+	PCB* pcb = pipe->account;
+	int ok = (pcb != NULL && pcb->pipe_budget - pcb->pipe_bytes >= n);
+	if(ok)
+		pcb->pipe_bytes += n;
+	Mutex_Unlock(&pipe_account_lock);
+	return ok;
+}
+
+//Refunds n bytes of buffer to the account of a pipe, if it still has one.
+static void pipe_refund(pipe_cb* pipe, unsigned int n)
+{
+	Mutex_Lock(&pipe_account_lock);
+	if(pipe->account != NULL)
+		pipe->account->pipe_bytes -= n;
+	Mutex_Unlock(&pipe_account_lock);
+}
+
+void pipe_release_account(PCB* pcb)
+{
+	Mutex_Lock(&pipe_account_lock);
+	while(! is_rlist_empty(&pcb->pipe_list)) {
+		pipe_cb* pipe = rlist_pop_front(&pcb->pipe_list)->obj;
+		pipe->account = NULL;
+	}
+	pcb->pipe_bytes = 0;
+	Mutex_Unlock(&pipe_account_lock);
+}
+
+//Allocates memory for a pipe control block, and initializes everything but the reader and writer.
 pipe_cb* acquire_pipe_cb()
 {
-  pipe_cb* pipecb_t = (pipe_cb*)xmalloc(sizeof(pipe_cb));
+  pipe_cb* pipecb_t = (pipe_cb*)kmem_alloc(&pipe_cache);
+  pipecb_t->lock = MUTEX_INIT;
+  pipecb_t->w_position = 0;
+  pipecb_t->r_position = 0;
+  pipecb_t->has_space = COND_INIT;
+  pipecb_t->has_data = COND_INIT;
+  pipecb_t->BUFFER = alloc_pipe_buffer(PIPE_DEFAULT_CAPACITY);
+  pipecb_t->size = PIPE_DEFAULT_CAPACITY;
+  pipecb_t->capacity = PIPE_DEFAULT_CAPACITY;
+  pipecb_t->peak = 0;
+  pipecb_t->rd = pipecb_t->wr = (pipe_end_state){ 0 };
+  pipecb_t->account = NULL;
+  rlnode_init(&pipecb_t->account_node, pipecb_t);
   return pipecb_t;
 }
 
-//Returns 1 if the buffer is full and zero if not. Makes that conclusion based on the reading and writing position of the buffer.
-int isBuffFull(int r_pos,int w_pos){
-	if((w_pos == r_pos - 1)||(r_pos== 0 && w_pos == PIPE_BUFFER_SIZE-1))
-		return 1; //is Full
-	return 0; //is not Full
+static void release_pipe_cb(pipe_cb* pipe)
+{
+	pipe_close_account(pipe);
+	free_pipe_buffer(pipe->BUFFER, pipe->size);
+	kmem_free(&pipe_cache, pipe);
+}
+
+//Returns the capacity a pipe gets for a requested capacity, or 0 if it is too large.
+static unsigned int pipe_capacity(unsigned int capacity)
+{
+	if(capacity > PIPE_MAX_CAPACITY)
+		return 0;
+	unsigned int cap = PIPE_DEFAULT_CAPACITY;
+	while(cap < capacity)
+		cap <<= 1;
+	return cap;
+}
+
+//Returns the number of bytes in the buffer. The whole buffer is used, so it is full at pipe->size.
+static inline unsigned int pipe_used(pipe_cb* pipe)
+{
+	return pipe->w_position - pipe->r_position;
+}
+
+/*
+  Copy n bytes into (out of) the ring, which must have room for (hold) them. 
+  The bytes lie in at most two contiguous segments: up to the end of the 
+  buffer, and from its start.
+ */
+static void ring_put(pipe_cb* pipe, const char* buf, unsigned int n)
+{
+	unsigned int pos = pipe->w_position & (pipe->size-1);
+	unsigned int first = (n < pipe->size - pos) ? n : pipe->size - pos;
+	memcpy(pipe->BUFFER + pos, buf, first);
+	memcpy(pipe->BUFFER, buf + first, n - first);
+	pipe->w_position += n;
+}
+
+static void ring_get(pipe_cb* pipe, char* buf, unsigned int n)
+{
+	unsigned int pos = pipe->r_position & (pipe->size-1);
+	unsigned int first = (n < pipe->size - pos) ? n : pipe->size - pos;
+	memcpy(buf, pipe->BUFFER + pos, first);
+	memcpy(buf + first, pipe->BUFFER, n - first);
+	pipe->r_position += n;
+}
+
+//Moves the bytes of the pipe to a new buffer of the given size, which must hold them.
+static void pipe_resize(pipe_cb* pipe, unsigned int size)
+{
+	char* buffer = alloc_pipe_buffer(size);
+	unsigned int used = pipe_used(pipe);
+	ring_get(pipe, buffer, used);
+	free_pipe_buffer(pipe->BUFFER, pipe->size);
+	pipe->BUFFER = buffer;
+	pipe->size = size;
+	pipe->r_position = 0;
+	pipe->w_position = used;
+}
+
+/*
+  Returns the free space in the buffer. If n bytes do not fit, the buffer 
+  is first doubled until they do, or until it reaches the capacity. If the
+  budget of the pipe's account does not cover that, it grows by as many 
+  doublings as it covers.
+ */
+static unsigned int pipe_room(pipe_cb* pipe, unsigned int n)
+{
+	unsigned int used = pipe_used(pipe);
+	if(pipe->size - used < n && pipe->size < pipe->capacity) {
+		unsigned int size = pipe->size;
+		while(size < pipe->capacity && size - used < n)
+			size <<= 1;
+		while(size > pipe->size && ! pipe_charge(pipe, size - pipe->size))
+			size >>= 1;
+		if(size > pipe->size)
+			pipe_resize(pipe, size);
+	}
+	return pipe->size - used;
+}
+
+/*
+  Wakeups are batched with watermarks. A thread that blocks at one end of 
+  the pipe wants a number of bytes (of data at the read end, of space at 
+  the write end), and the other end wakes it up only once they are there, 
+  or when it is closed. When nobody sleeps, nobody is signalled.
+
+  Batching is only safe while the other end keeps coming back. A writer 
+  that writes a request and then waits for the reply must wake the reader
+  at once. So a thread wants a single byte, unless the thread last at the
+  other end is streaming: it did not block between its last two calls.
+  Then it wants up to a quarter of the buffer, and sleeps for at most 
+  PIPE_BATCH_DELAY, in case the stream stops short of that.
+ */
+#define PIPE_BATCH_DELAY (1000ul)	/* usec */
+
+//Records a call at an end by the current thread, and whether the thread streams.
+static TCB* pipe_end_enter(pipe_end_state* end)
+{
+	TCB* cur = cur_thread();
+	end->streaming = (end->last_thread == cur && end->last_switches == cur->vol_switches);
+	end->last_thread = cur;
+	return cur;
+}
+
+//Records that a call at an end returns; blocking in it does not end streaming.
+static inline void pipe_end_leave(pipe_end_state* end, TCB* cur)
+{
+	end->last_switches = cur->vol_switches;
 }
 
-//Returns 1 if the buffer is empty and zero if not. Makes that conclusion based on the reading and writing position of the buffer.
-int isBuffEmpty(int r_pos,int w_pos){
-	if(r_pos==w_pos)
-		return 1; //is Empty
-	return 0; //is not Empty
+//The bytes a thread blocking at one end wants, for a call of n bytes.
+static unsigned int pipe_want(pipe_cb* pipe, pipe_end_state* other, unsigned int n)
+{
+	unsigned int batch = pipe->size / 4;
+	if(! other->streaming)
+		return 1;
+	return (n < batch) ? n : batch;
 }
 
+//Sleep at an end, until the other end finds the wanted bytes there (or the delay passes).
+static void pipe_end_sleep(pipe_cb* pipe, pipe_end_state* end, CondVar* cv, unsigned int want)
+{
+	if(end->sleepers++ == 0 || want < end->wanted)
+		end->wanted = want;
+	kernel_timedwait(&pipe->lock, cv, SCHED_PIPE, (want > 1) ? PIPE_BATCH_DELAY : NO_TIMEOUT);
+	end->sleepers--;
+}
+
+//Returns 1 if the threads blocked at an end must be woken, with the given bytes there.
+static inline int pipe_end_wakeup(pipe_end_state* end, unsigned int bytes)
+{
+	return end->sleepers > 0 && bytes >= end->wanted;
+}
+
+/*
+  The reader and writer only contend for the lock of their pipe, so readers
+  and writers of different pipes run in parallel. The waiters are signalled
+  after the lock is released, so that a woken thread which preempts the 
+  signaller does not find the pipe locked. This is safe, since the caller
+  holds a reference to the FCB of its end, and the pipe cannot be freed.
+ */
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n) 
 {
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
-	int written_counter = 0;
+	unsigned int written_counter, room;
+	int wake;
 
 //
 	if(pipe == NULL || buf == NULL){
 		return -1; 
 	}
 
+	Mutex_Lock(&pipe->lock);
+
 	if(pipe->reader == NULL || pipe->writer == NULL){
+		Mutex_Unlock(&pipe->lock);
 		return -1; 
 	}
 
-	while((pipe->reader!=NULL) && (isBuffFull(pipe->r_position,pipe->w_position)) ){
-		kernel_wait(&pipe->has_space,SCHED_PIPE);
+	TCB* cur = pipe_end_enter(&pipe->wr);
+	while((pipe->reader!=NULL) && (room = pipe_room(pipe, n)) == 0){
+		pipe_end_sleep(pipe, &pipe->wr, &pipe->has_space, pipe_want(pipe, &pipe->rd, n));
 	}
 
 	if(pipe->reader == NULL){
+		Mutex_Unlock(&pipe->lock);
 		return -1; 
 	}
 	
-	//copy the data.
-	while (written_counter < n && (!isBuffFull(pipe->r_position,pipe->w_position))) {
-	  pipe->BUFFER[pipe->w_position] = buf[written_counter];
-		written_counter++;
-		pipe->w_position=(pipe->w_position+1)%PIPE_BUFFER_SIZE;  /*! prosoxi an xanetai thesi kai pos epireazei tin ilopoiisi*/ 
-		
-	}
-
-	kernel_broadcast(&pipe->has_data);
+	//copy as much of the data as there is room for.
+	written_counter = (room < n) ? room : n;
+	ring_put(pipe, buf, written_counter);
+	if(pipe_used(pipe) > pipe->peak)
+		pipe->peak = pipe_used(pipe);
+	wake = pipe_end_wakeup(&pipe->rd, pipe_used(pipe));
+	pipe_end_leave(&pipe->wr, cur);
+
+	Mutex_Unlock(&pipe->lock);
+	if(wake)
+		kernel_broadcast(&pipe->has_data);
 
 	return written_counter;
 }
 
 
 int pipe_read(void* pipecb_t, char *buf, unsigned int n) {
-	int reader_counter = 0;
+	unsigned int reader_counter;
+	int wake;
 
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
 
@@ -94,26 +343,34 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n) {
 		return -1; 
 	}
 
+	Mutex_Lock(&pipe->lock);
+
 	if(pipe->reader == NULL){
+		Mutex_Unlock(&pipe->lock);
 		return -1; 
 	}
 
-	while(pipe->writer!=NULL && isBuffEmpty(pipe->r_position,pipe->w_position)){
-		kernel_wait(&pipe->has_data,SCHED_PIPE);
+	TCB* cur = pipe_end_enter(&pipe->rd);
+	while(pipe->writer!=NULL && pipe_used(pipe) == 0){
+		pipe_end_sleep(pipe, &pipe->rd, &pipe->has_data, pipe_want(pipe, &pipe->wr, n));
 	}
 
 	if(pipe->reader == NULL){
+		Mutex_Unlock(&pipe->lock);
 		return -1; 
 	}
 	
-	//copies the data.
-	while (reader_counter < n && (!isBuffEmpty(pipe->r_position,pipe->w_position))) {
-	  buf[reader_counter] = pipe->BUFFER[pipe->r_position];
-		reader_counter++;
-		pipe->r_position=(pipe->r_position+1)%PIPE_BUFFER_SIZE;  /*! prosoxi an xanetai thesi kai pos epireazei tin ilopoiisi*/ 
-	}
-
-	kernel_broadcast(&pipe->has_space);
+	//copies as much of the data as there is.
+	reader_counter = pipe_used(pipe);
+	if(reader_counter > n)
+		reader_counter = n;
+	ring_get(pipe, buf, reader_counter);
+	wake = pipe_end_wakeup(&pipe->wr, pipe->size - pipe_used(pipe));
+	pipe_end_leave(&pipe->rd, cur);
+
+	Mutex_Unlock(&pipe->lock);
+	if(wake)
+		kernel_broadcast(&pipe->has_space);
 
 	return reader_counter;
 }
@@ -127,19 +384,26 @@ int pipe_writer_close(void* _pipecb)
 	if(pipe==NULL)
 		return -1;
 
+	Mutex_Lock(&pipe->lock);
+
 	//if closed from before returns error message
-	if(pipe->writer == NULL)//closed from before
+	if(pipe->writer == NULL) {//closed from before
+		Mutex_Unlock(&pipe->lock);
 		return -1;
+	}
 
 	//Close it by making pointer equal to null (no reference)
 	pipe->writer = NULL; 
 
+	//Notify, before the pipe may be freed
+	kernel_broadcast(&pipe->has_data); 
+
 	//Now if both reader AND writer are null, free pipe control block
-	if(pipe->reader == NULL) 
-		free(pipe);
+	int unused = (pipe->reader == NULL);
+	Mutex_Unlock(&pipe->lock);
+	if(unused) 
+		release_pipe_cb(pipe);
 
-	//Notify
-	kernel_broadcast(&pipe->has_data); 
 	return 0;
 }
 
@@ -151,20 +415,26 @@ int pipe_reader_close(void* _pipecb)
 	if(pipe==NULL)
 		return -1;
 	
+	Mutex_Lock(&pipe->lock);
+
 	//if closed from before returns error message
-	if(pipe->reader == NULL)
+	if(pipe->reader == NULL) {
+		Mutex_Unlock(&pipe->lock);
 		return -1;
+	}
 
 	//Close it by making pointer equal to null (no reference)
 	pipe->reader = NULL; 
 
-	//Now if both reader AND writer are null, free pipe control block
-	if(pipe->writer == NULL) 
-		free(pipe);
-	
-	//Notify
+	//Notify, before the pipe may be freed
 	kernel_broadcast(&pipe->has_space); 
 
+	//Now if both reader AND writer are null, free pipe control block
+	int unused = (pipe->writer == NULL);
+	Mutex_Unlock(&pipe->lock);
+	if(unused) 
+		release_pipe_cb(pipe);
+
 	return 0;	
 }
 
@@ -172,10 +442,19 @@ int pipe_reader_close(void* _pipecb)
 Returns 0 when successful and -1 when failure.
 reserve 2 fcbs in the current process*/ 
 int sys_Pipe(pipe_t* pipe)
+{
+	return sys_PipeWithCapacity(pipe, 0);
+}
+
+int sys_PipeWithCapacity(pipe_t* pipe, unsigned int capacity)
 {
 	Fid_t fd[2];            
 	FCB* fcb[2];
 
+	unsigned int cap = pipe_capacity(capacity);
+	if(cap == 0)
+		return -1;
+
 //fcb reserve for two fids.
 	if(!FCB_reserve(2,fd,fcb))
 		return -1;
@@ -186,24 +465,85 @@ int sys_Pipe(pipe_t* pipe)
 	pipe->write = fd[1];//file descriptor for writing
 
 	pipe_cb* pipecb_t = acquire_pipe_cb();
+	if(! pipe_open_account(pipecb_t, CURPROC)) {
+		release_pipe_cb(pipecb_t);
+		FCB_unreserve(2, fd, fcb);
+		return -1;
+	}
 
 	pipecb_t->reader = fcb[0];
 	pipecb_t->writer = fcb[1];
+	pipecb_t->capacity = cap;
 
-	//initializing pipe control block variables
-	pipecb_t->w_position = 0;
-	pipecb_t->r_position = 0;
+	//both FCBs modify the same pipe, with their own functions
+	FCB_open(fcb[0], pipecb_t, &reader_file_ops);
+	FCB_open(fcb[1], pipecb_t, &writer_file_ops);
 
-	pipecb_t->has_space = COND_INIT;
-	pipecb_t->has_data = COND_INIT;
+	return 0;
+}
 
-	//both FCBs modify the same pipe 
-	fcb[0]->streamobj = pipecb_t;
-	fcb[1]->streamobj = pipecb_t;
 
-  //assigning the pointers to the functions.
-	fcb[0]->streamfunc = &reader_file_ops;
-	fcb[1]->streamfunc = &writer_file_ops;
+/*
+  Returns the pipe of an end, which is held by the FCB reference of the caller,
+  or NULL if the FCB is not an end of a pipe. 
+ */
+static pipe_cb* fcb_pipe(FCB* fcb)
+{
+	if(fcb->streamfunc == &reader_file_ops || fcb->streamfunc == &writer_file_ops)
+		return (pipe_cb*) fcb->streamobj;
+	return NULL;
+}
 
-	return 0;
+int sys_SetPipeCapacity(Fid_t fd, unsigned int capacity)
+{
+	unsigned int cap = pipe_capacity(capacity);
+	FCB* fcb = get_fcb(fd);
+	if(fcb == NULL)
+		return -1;
+
+	int rc = -1;
+	pipe_cb* pipe = fcb_pipe(fcb);
+	if(pipe != NULL && cap != 0) {
+		Mutex_Lock(&pipe->lock);
+		if(pipe_used(pipe) <= cap) {
+			pipe->capacity = cap;
+			if(pipe->size > cap) {
+				pipe_refund(pipe, pipe->size - cap);
+				pipe_resize(pipe, cap);
+			}
+			rc = 0;
+		}
+		Mutex_Unlock(&pipe->lock);
+
+		//Writers waiting for space may now grow the buffer
+		if(rc == 0)
+			kernel_broadcast(&pipe->has_space);
+	}
+
+	FCB_decref(fcb);
+	return rc;
+}
+
+int sys_GetPipeInfo(Fid_t fd, pipeinfo* info)
+{
+	if(info == NULL)
+		return -1;
+	FCB* fcb = get_fcb(fd);
+	if(fcb == NULL)
+		return -1;
+
+	int rc = -1;
+	pipe_cb* pipe = fcb_pipe(fcb);
+	if(pipe != NULL) {
+		Mutex_Lock(&pipe->lock);
+		info->capacity = pipe->capacity;
+		info->buffer_size = pipe->size;
+		info->used = pipe_used(pipe);
+		info->peak = pipe->peak;
+		Mutex_Unlock(&pipe->lock);
+		rc = 0;
+	}
+
+	FCB_decref(fcb);
+	return rc;
 }
@@ -7,10 +7,6 @@
 
 pipe_cb* acquire_pipe_cb();
 
-int isBuffFull(int r_pos,int w_pos);
-
-int isBuffEmpty(int r_pos,int w_pos);
-
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n);
 
 int pipe_read(void* pipecb_t, char *buf, unsigned int n);
@@ -20,3 +16,11 @@ int pipe_writer_close(void* _pipecb);
 int pipe_reader_close(void* _pipecb);
 
 int sys_Pipe(pipe_t* pipe);
+
+int sys_PipeWithCapacity(pipe_t* pipe, unsigned int capacity);
+
+int sys_SetPipeCapacity(Fid_t fd, unsigned int capacity);
+
+int sys_GetPipeInfo(Fid_t fd, pipeinfo* info);
+
+void pipe_release_account(PCB* pcb);
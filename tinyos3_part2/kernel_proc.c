@@ -3,6 +3,7 @@
 #include "kernel_proc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
+#include "kernel_mem.h"
 
 
 /* 
@@ -18,6 +19,7 @@
 /* The process table */
 PCB PT[MAX_PROC];
 unsigned int process_count;
+Mutex proc_lock = MUTEX_INIT;
 
 PCB* get_pcb(Pid_t pid)
 {
@@ -37,6 +39,7 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
 
+  pcb->lock = MUTEX_INIT;
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
@@ -45,13 +48,34 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
+
+  //the scheduler process (pid 0) has no threads, but its list must be valid
+  rlnode_init(& pcb->ptcb_list, NULL);
+  pcb->thread_count = 0;
+  pcb->thread_table = NULL;
+  pcb->thread_table_size = 0;
+  pcb->thread_free = 0;
+
+  pcb->weight = DEFAULT_PROCESS_WEIGHT;
+  pcb->vruntime = 0;
+
+  pcb->pipe_budget = PIPE_DEFAULT_BUDGET;
+  pcb->pipe_bytes = 0;
+  rlnode_init(& pcb->pipe_list, NULL);
 }
 
 
 static PCB* pcb_freelist;
 
-void initialize_processes()
+/* The pipe budget of every process */
+static unsigned int pipe_budget;
+
+void initialize_processes(const boot_options* options)
 {
+  pipe_budget = options->pipe_budget;
+  if(pipe_budget == 0)
+    pipe_budget = PIPE_DEFAULT_BUDGET;
+
   /* initialize the PCBs */
   for(Pid_t p=0; p<MAX_PROC; p++) {
     initialize_PCB(&PT[p]);
@@ -73,13 +97,73 @@ void initialize_processes()
     FATAL("The scheduler process does not have pid==0");
 }
 
+static kmem_cache ptcb_cache = KMEM_CACHE_INIT("PTCB", PTCB);
+
 PTCB* acquire_PTCB()
 {
-  PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));
+  PTCB* ptcb = (PTCB*)kmem_alloc(&ptcb_cache);
   return ptcb;
 }
+
+void release_PTCB(PTCB* ptcb)
+{
+  kmem_free(&ptcb_cache, ptcb);
+}
+
+
 /*
-  Must be called with kernel_mutex held
+  The thread table.
+
+  A Tid_t holds the index of its slot plus one in the low 32 bits (so that
+  it is never NOTHREAD), and the generation of the slot in the high bits.
+ */
+#define TID_MAKE(index, gen) (((Tid_t)(gen) << 32) | ((Tid_t)(index) + 1))
+#define TID_INDEX(tid) ((Tid_t)((tid) & 0xffffffffu) - 1)
+#define TID_GEN(tid) ((unsigned int)((tid) >> 32))
+
+void acquire_tid(PCB* pcb, PTCB* ptcb)
+{
+  if(pcb->thread_free == 0) {
+    /* Double the table, and chain the new slots into the free list */
+    unsigned int oldsize = pcb->thread_table_size;
+    unsigned int newsize = (oldsize==0) ? 16 : 2*oldsize;
+    pcb->thread_table = realloc(pcb->thread_table, newsize*sizeof(thread_slot));
+    if(pcb->thread_table == NULL)
+      FATAL("Out of memory for the thread table");
+    for(unsigned int i=oldsize; i<newsize; i++)
+      pcb->thread_table[i] = (thread_slot){ NULL, 0, (i+1<newsize) ? i+2 : 0 };
+    pcb->thread_table_size = newsize;
+    pcb->thread_free = oldsize+1;
+  }
+
+  unsigned int index = pcb->thread_free - 1;
+  thread_slot* slot = &pcb->thread_table[index];
+  pcb->thread_free = slot->next_free;
+  slot->ptcb = ptcb;
+  ptcb->tid = TID_MAKE(index, slot->gen);
+}
+
+PTCB* lookup_tid(PCB* pcb, Tid_t tid)
+{
+  Tid_t index = TID_INDEX(tid);
+  if(index >= pcb->thread_table_size)
+    return NULL;
+  thread_slot* slot = &pcb->thread_table[index];
+  return (slot->gen == TID_GEN(tid)) ? slot->ptcb : NULL;
+}
+
+void release_tid(PCB* pcb, PTCB* ptcb)
+{
+  unsigned int index = TID_INDEX(ptcb->tid);
+  thread_slot* slot = &pcb->thread_table[index];
+  assert(slot->ptcb == ptcb);
+  slot->ptcb = NULL;
+  slot->gen++;
+  slot->next_free = pcb->thread_free;
+  pcb->thread_free = index+1;
+}
+/*
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -87,7 +171,7 @@ PCB* acquire_PCB()
 
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
-    pcb->pstate = ALIVE;
+    __atomic_store_n(&pcb->pstate, ALIVE, __ATOMIC_RELAXED);
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
@@ -96,12 +180,12 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
-  pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
+  __atomic_store_n(&pcb->pstate, FREE, __ATOMIC_RELAXED);
+  __atomic_store_n(&pcb->parent, pcb_freelist, __ATOMIC_RELAXED);
   pcb_freelist = pcb;
   process_count--;
 }
@@ -153,14 +237,20 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   PCB *curproc, *newproc;
   
   /* The new process PCB */
+  Mutex_Lock(&proc_lock);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    Mutex_Unlock(&proc_lock);
+    goto finish;  /* We have run out of PIDs! */
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->weight = DEFAULT_PROCESS_WEIGHT;
+    newproc->vruntime = 0;
   }
   else
   {
@@ -168,30 +258,49 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     curproc = CURPROC;
 
     /* Add new process to the parent's child list */
-    newproc->parent = curproc;
+    __atomic_store_n(&newproc->parent, curproc, __ATOMIC_RELAXED);
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    /* Inherit file streams from parent */
+    /* Inherit the scheduling weight; starting from the parent's virtual 
+       runtime, a new process does not get more than its share */
+    newproc->weight = curproc->weight;
+    newproc->vruntime = curproc->vruntime;
+
+    /* Inherit file streams from parent, except those still being set up */
+    Mutex_Lock(&curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+       FCB* fcb = curproc->FIDT[i];
+       if(fcb && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) == NULL)
+          fcb = NULL;
+       newproc->FIDT[i] = fcb;
+       if(fcb)
+          FCB_incref(fcb);
     }
+    Mutex_Unlock(&curproc->lock);
   }
 
+  /* The pipes of the exited process that used the PCB have been uncharged */
+  newproc->pipe_budget = pipe_budget;
+  assert(newproc->pipe_bytes == 0 && is_rlist_empty(& newproc->pipe_list));
+
 
   /* Set the main thread's function */
   newproc->main_task = call;
 
-  /* Copy the arguments to new storage, owned by the new process */
+  /* Copy the arguments to new storage, owned by the new process. 
+     procinfo_read looks at them without proc_lock, so they are published
+     after argl. */
   newproc->argl = argl;
   if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+    void* pargs = malloc(argl);
+    memcpy(pargs, args, argl);
+    __atomic_store_n(&newproc->args, pargs, __ATOMIC_RELEASE);
   }
   else
     newproc->args=NULL;
 
+  Mutex_Unlock(&proc_lock);
+
   /* 
     Create and wake up the thread for the main function. This must be the last thing
     we do, because once we wakeup the new thread it may run! so we need to have finished
@@ -204,7 +313,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     //initializing ptcb list of this new process
     rlnode_init(& newproc->ptcb_list, NULL);
 
-    PTCB* firstptcb =spawn_process_thread(newproc,start_main_thread) ;
+    PTCB* firstptcb =spawn_process_thread(newproc,start_main_thread, 0) ;
 
     //passingthe arguments of the process to the ptcb
     firstptcb->task = call; 
@@ -228,7 +337,28 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* PCBs are never freed, so a stale parent is still a valid pointer */
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_RELAXED));
+}
+
+
+int sys_SetProcessWeight(Pid_t pid, unsigned int weight)
+{
+  if(pid < 0 || pid >= MAX_PROC)
+    return -1;
+
+  if(weight < 1 || weight > MAX_PROCESS_WEIGHT)
+    return -1;
+
+  int ret = -1;
+  Mutex_Lock(&proc_lock);
+  PCB* pcb = get_pcb(pid);
+  if(pcb != NULL && pcb->pstate == ALIVE) {
+    pcb->weight = weight;
+    ret = 0;
+  }
+  Mutex_Unlock(&proc_lock);
+  return ret;
 }
 
 static void cleanup_zombie(PCB* pcb, int* status)
@@ -262,7 +392,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -286,7 +416,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -303,15 +433,20 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Pid_t ret;
+
+  Mutex_Lock(&proc_lock);
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    ret = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    ret = wait_for_any_child(status);
   }
+  Mutex_Unlock(&proc_lock);
 
+  return ret;
 }
 
 
@@ -320,7 +455,9 @@ void sys_Exit(int exitval)
   PCB* curproc = CURPROC;  
 
   /* First, store the exit status in the current process*/
+  Mutex_Lock(&proc_lock);
   curproc->exitval = exitval;
+  Mutex_Unlock(&proc_lock);
 
   /* 
     Here, we must check that we are not the init task. 
@@ -354,22 +491,34 @@ int procinfo_read(void* procinfo_, char* buf, unsigned int size) {
   if (procinfo->cursor == NULL)
     return 0; //reached end of PT array.
 
+  /* The process table is read-mostly; rather than stalling Exec and Exit
+     on proc_lock, we read it inside an RCU read-side section. The PCBs
+     themselves are never freed, and the args buffer is freed by its exiting
+     process only after synchronize_rcu(), so the worst we can see is a 
+     slightly stale snapshot. */
+  int preempt = rcu_read_lock();
+
   //reference for convenience
   PCB* pcb_cursor = procinfo->cursor;
 
   //making all the necessary initializations for the procinfo struct
   procinfo->info->pid = get_pid(pcb_cursor);
-  procinfo->info->ppid = get_pid(pcb_cursor->parent); 
-  procinfo->info->alive = (pcb_cursor->pstate == ALIVE); 
+  procinfo->info->ppid = get_pid(__atomic_load_n(&pcb_cursor->parent, __ATOMIC_RELAXED)); 
+  procinfo->info->alive = (__atomic_load_n(&pcb_cursor->pstate, __ATOMIC_RELAXED) == ALIVE); 
   procinfo->info->thread_count = pcb_cursor->thread_count;
   procinfo->info->main_task = pcb_cursor->main_task;
-  procinfo->info->argl = pcb_cursor->argl;
+
+  /* args is published after argl, so an argl read after it matches */
+  void* args = __atomic_load_n(&pcb_cursor->args, __ATOMIC_ACQUIRE);
+  int argl = pcb_cursor->argl;
+  procinfo->info->argl = argl;
 
   //copy size should never be greater than PROCINFO_MAX_ARGS_SIZE
-  unsigned int copy_size = (pcb_cursor->argl < PROCINFO_MAX_ARGS_SIZE) ?
-                             pcb_cursor->argl : PROCINFO_MAX_ARGS_SIZE;
+  unsigned int copy_size = (argl < PROCINFO_MAX_ARGS_SIZE) ?
+                             argl : PROCINFO_MAX_ARGS_SIZE;
 
-  memcpy(procinfo->info->args, (char *)pcb_cursor->args, copy_size);
+  if(args != NULL)
+    memcpy(procinfo->info->args, (char *)args, copy_size);
   
   //we copy the information of the process into the buffer
   memcpy(buf, (char *)procinfo->info, size);
@@ -383,7 +532,7 @@ int procinfo_read(void* procinfo_, char* buf, unsigned int size) {
   //always point to an ALIVE/ZOMBIE proc OR NULL(EOF)
   unsigned int index = procinfo->info->pid + 1;
   while(index < MAX_PROC) {
-    if (PT[index].pstate != FREE) {
+    if (__atomic_load_n(&PT[index].pstate, __ATOMIC_RELAXED) != FREE) {
        procinfo->cursor = &PT[index];
        break;
     }
@@ -396,6 +545,8 @@ int procinfo_read(void* procinfo_, char* buf, unsigned int size) {
   if (index == MAX_PROC)
     procinfo->cursor = NULL;
 
+  rcu_read_unlock(preempt);
+
   //in any case, we return the correct size that we stored
   return infoSize; 
 }
@@ -443,9 +594,206 @@ Fid_t sys_OpenInfo()
   procinfo->info->pid = 1;
 
   //making the necessary connections for the fcb
-  fcb->streamobj = procinfo;
-  fcb->streamfunc = &procinfo_file_ops;
+  FCB_open(fcb, procinfo, &procinfo_file_ops);
 
   //returning the file id
   return fd;
-}
\ No newline at end of file
+}
+
+
+//read function for threadinfo_cb; returns one threadinfo per call
+static int threadinfo_read(void* threadinfo_, char* buf, unsigned int size) {
+  threadinfo_cb* tinfo = (threadinfo_cb*) threadinfo_;
+
+  if (tinfo->cursor == tinfo->count)
+    return 0; //EOF
+
+  if (size < sizeof(threadinfo))
+    return -1;
+
+  memcpy(buf, &tinfo->info[tinfo->cursor++], sizeof(threadinfo));
+  return sizeof(threadinfo);
+}
+
+//close function for threadinfo_cb
+static int threadinfo_close(void* threadinfo_){
+  threadinfo_cb* tinfo = (threadinfo_cb*) threadinfo_;
+  free(tinfo->info);
+  free(tinfo);
+  return 0;
+}
+
+//file operations for threadinfo
+static file_ops threadinfo_file_ops = {
+  .Write = dummy,
+  .Read = threadinfo_read, 
+  .Open = NULL,
+  .Close = threadinfo_close
+};
+
+//invoked by OpenThreadInfo
+Fid_t sys_OpenThreadInfo()
+{
+  Fid_t fd;        
+  FCB* fcb;
+
+  if(!FCB_reserve(1,&fd,&fcb))
+    return NOFILE; 
+
+  //count the live threads, to size the snapshot.
+  //New threads may be created while we count, so the snapshot
+  //holds at most count of them.
+  Mutex_Lock(&proc_lock);
+  int count = 0;
+  for(Pid_t pid=0; pid<MAX_PROC; pid++)
+    if(PT[pid].pstate == ALIVE) {
+      Mutex_Lock(&PT[pid].lock);
+      count += rlist_len(&PT[pid].ptcb_list);
+      Mutex_Unlock(&PT[pid].lock);
+    }
+
+  threadinfo_cb* tinfo = (threadinfo_cb*)xmalloc(sizeof(threadinfo_cb));
+  tinfo->info = (threadinfo*)xmalloc((count>0 ? count : 1)*sizeof(threadinfo));
+  tinfo->cursor = 0;
+  tinfo->count = 0;
+
+  //take the snapshot of every thread that has not exited
+  for(Pid_t pid=0; pid<MAX_PROC; pid++) {
+    if(PT[pid].pstate != ALIVE)
+      continue;
+    Mutex_Lock(&PT[pid].lock);
+    rlnode* list = &PT[pid].ptcb_list;
+    for(rlnode* n = list->next; n != list && tinfo->count < count; n = n->next) {
+      PTCB* ptcb = n->ptcb;
+      if(ptcb->exited)
+        continue;
+      threadinfo* info = &tinfo->info[tinfo->count++];
+      info->pid = pid;
+      info->tid = ptcb->tid;
+      get_thread_info(ptcb->tcb, info);
+    }
+    Mutex_Unlock(&PT[pid].lock);
+  }
+  Mutex_Unlock(&proc_lock);
+
+  //making the necessary connections for the fcb
+  FCB_open(fcb, tinfo, &threadinfo_file_ops);
+
+  return fd;
+}
+
+
+//read function for lockinfo_cb; returns one lockinfo per call
+static int lockinfo_read(void* lockinfo_, char* buf, unsigned int size) {
+  lockinfo_cb* linfo = (lockinfo_cb*) lockinfo_;
+
+  if (linfo->cursor == linfo->count)
+    return 0; //EOF
+
+  if (size < sizeof(lockinfo))
+    return -1;
+
+  memcpy(buf, &linfo->info[linfo->cursor++], sizeof(lockinfo));
+  return sizeof(lockinfo);
+}
+
+//close function for lockinfo_cb
+static int lockinfo_close(void* lockinfo_){
+  lockinfo_cb* linfo = (lockinfo_cb*) lockinfo_;
+  free(linfo->info);
+  free(linfo);
+  return 0;
+}
+
+//file operations for lockinfo
+static file_ops lockinfo_file_ops = {
+  .Write = dummy,
+  .Read = lockinfo_read, 
+  .Open = NULL,
+  .Close = lockinfo_close
+};
+
+//invoked by OpenLockInfo
+Fid_t sys_OpenLockInfo()
+{
+  Fid_t fd;        
+  FCB* fcb;
+
+  //count the used lock sites, to size the snapshot.
+  //Sites used for the first time after we count are left out.
+  int count = get_lock_info(NULL, 0);
+  if(count < 0)
+    return NOFILE; //no lock statistics in this kernel
+
+  if(!FCB_reserve(1,&fd,&fcb))
+    return NOFILE; 
+
+  lockinfo_cb* linfo = (lockinfo_cb*)xmalloc(sizeof(lockinfo_cb));
+  linfo->info = (lockinfo*)xmalloc((count>0 ? count : 1)*sizeof(lockinfo));
+  linfo->cursor = 0;
+  linfo->count = get_lock_info(linfo->info, count);
+  if(linfo->count > count)
+    linfo->count = count;
+
+  //making the necessary connections for the fcb
+  FCB_open(fcb, linfo, &lockinfo_file_ops);
+
+  return fd;
+}
+
+
+//read function for meminfo_cb; returns one meminfo per call
+static int meminfo_read(void* meminfo_, char* buf, unsigned int size) {
+  meminfo_cb* minfo = (meminfo_cb*) meminfo_;
+
+  if (minfo->cursor == minfo->count)
+    return 0; //EOF
+
+  if (size < sizeof(meminfo))
+    return -1;
+
+  memcpy(buf, &minfo->info[minfo->cursor++], sizeof(meminfo));
+  return sizeof(meminfo);
+}
+
+//close function for meminfo_cb
+static int meminfo_close(void* meminfo_){
+  meminfo_cb* minfo = (meminfo_cb*) meminfo_;
+  free(minfo->info);
+  free(minfo);
+  return 0;
+}
+
+//file operations for meminfo
+static file_ops meminfo_file_ops = {
+  .Write = dummy,
+  .Read = meminfo_read, 
+  .Open = NULL,
+  .Close = meminfo_close
+};
+
+//invoked by OpenMemInfo
+Fid_t sys_OpenMemInfo()
+{
+  Fid_t fd;        
+  FCB* fcb;
+
+  if(!FCB_reserve(1,&fd,&fcb))
+    return NOFILE; 
+
+  //count the used caches, to size the snapshot.
+  //Caches used for the first time after we count are left out.
+  int count = get_mem_info(NULL, 0);
+
+  meminfo_cb* minfo = (meminfo_cb*)xmalloc(sizeof(meminfo_cb));
+  minfo->info = (meminfo*)xmalloc((count>0 ? count : 1)*sizeof(meminfo));
+  minfo->cursor = 0;
+  minfo->count = get_mem_info(minfo->info, count);
+  if(minfo->count > count)
+    minfo->count = count;
+
+  //making the necessary connections for the fcb
+  FCB_open(fcb, minfo, &meminfo_file_ops);
+
+  return fd;
+}
@@ -30,10 +30,34 @@ typedef enum pid_state_e {
   ZOMBIE  /**< @brief The PID is held by a zombie */
 } pid_state;
 
+/**
+  @brief A slot of the thread table of a process.
+
+  A @c Tid_t is the index of the slot, together with the generation of 
+  the slot when the thread was created. The generation is advanced when 
+  the slot is released, so that a stale @c Tid_t does not match the 
+  thread that reuses the slot.
+  */
+typedef struct thread_slot {
+  PTCB* ptcb;             /**< @brief The thread, or NULL for a free slot */
+  unsigned int gen;       /**< @brief The generation of the slot */
+  unsigned int next_free; /**< @brief The next free slot plus one, or 0 */
+} thread_slot;
+
+
 /**
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
+
+  The process table, the process state, the exit value and the
+  parent/child relations are protected by @c proc_lock. The fileid table
+  and the threads of the process are protected by the @c lock of the PCB.
+  When both are needed, @c proc_lock is locked first.
+
+  @c pstate, @c parent and @c args are also read without @c proc_lock,
+  by @c GetPPid and the process info stream, so they are written with
+  atomic stores; @c args is freed only after @ref synchronize_rcu.
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
@@ -58,12 +82,25 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
+  Mutex lock;             /**< @brief Protects @c FIDT, @c ptcb_list, @c thread_count, the thread table and the PTCBs */
+
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
 
 //
   rlnode ptcb_list; 
   int thread_count; 
 
+  thread_slot* thread_table;  /**< @brief The thread table, indexed by @c Tid_t */
+  unsigned int thread_table_size; /**< @brief The number of slots in @c thread_table */
+  unsigned int thread_free;   /**< @brief The first free slot plus one, or 0 */
+
+  unsigned int weight;    /**< @brief The share of the CPU of the process, in fair-share mode */
+  TimerDuration vruntime; /**< @brief CPU time used by the process, scaled by @c DEFAULT_PROCESS_WEIGHT/weight */
+
+  unsigned int pipe_budget; /**< @brief The bytes of pipe buffers the process may hold */
+  unsigned int pipe_bytes;  /**< @brief The bytes of pipe buffers charged to the process */
+  rlnode pipe_list;         /**< @brief The pipes charged to the process; these three are protected by the lock of the pipe accounts */
+
 } PCB;
 
 typedef struct procinfo_cb {
@@ -73,13 +110,43 @@ typedef struct procinfo_cb {
 
 }procinfo_cb; 
 
+typedef struct threadinfo_cb {
+
+  threadinfo* info;  /* snapshot of all live threads */
+  int count;         /* number of entries in info */
+  int cursor;        /* next entry to read */
+
+}threadinfo_cb; 
+
+typedef struct lockinfo_cb {
+
+  lockinfo* info;    /* snapshot of the used lock sites */
+  int count;         /* number of entries in info */
+  int cursor;        /* next entry to read */
+
+}lockinfo_cb; 
+
+typedef struct meminfo_cb {
+
+  meminfo* info;     /* snapshot of the used object caches */
+  int count;         /* number of entries in info */
+  int cursor;        /* next entry to read */
+
+}meminfo_cb; 
+
+/**
+  @brief Protects the process table.
+*/
+extern Mutex proc_lock;
+
 /**
   @brief Initialize the process table.
 
   This function is called during kernel initialization, to initialize
-  any data structures related to process creation.
+  any data structures related to process creation. The pipe budget of 
+  processes is taken from @c options.
 */
-void initialize_processes();
+void initialize_processes(const boot_options* options);
 
 /**
   @brief Get the PCB for a PID.
@@ -105,6 +172,32 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Give a thread of a process its @c Tid_t.
+
+  A free slot of the thread table of @c pcb is assigned to @c ptcb, 
+  growing the table if needed, and @c ptcb->tid is set.
+  The lock of @c pcb must be held.
+*/
+void acquire_tid(PCB* pcb, PTCB* ptcb);
+
+/**
+  @brief Find the thread of a process with a given @c Tid_t.
+
+  This takes constant time. The lock of @c pcb must be held.
+
+  @returns the PTCB of the thread, or NULL if @c tid is not a thread of
+    @c pcb, or if its thread has been released.
+*/
+PTCB* lookup_tid(PCB* pcb, Tid_t tid);
+
+/**
+  @brief Release the @c Tid_t of a thread, whose PTCB is about to be freed.
+
+  The lock of @c pcb must be held.
+*/
+void release_tid(PCB* pcb, PTCB* ptcb);
+
 /** @} */
 
 #endif
@@ -118,8 +211,8 @@ void start_process_thread();
 void start_main_thread(); 
 
 
-/* Releases the args data of the current (exiting) process,
-  closes files, cleans up what is left of the PTCB list of the exiting process, 
-  disconnects main_thread and marks current process as exited.
+/* Closes the files of the current (exiting) process, 
+  cleans up what is left of the PTCB list of the exiting process
+  and disconnects main_thread. It is called with no lock held.
 */
 void CleanUp(PCB* curproc);
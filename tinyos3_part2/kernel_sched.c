@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <sys/mman.h>
+#include <limits.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
@@ -21,9 +22,6 @@
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
-/*number of yield() calls*/ 
-int yield_calls; 
-
 /* 
 	The current core's CCB. This must only be used in a 
 	non-preemtpive context.
@@ -38,104 +36,152 @@ int yield_calls;
 */
 #define CURTHREAD (CURCORE.current_thread)
 
-//number of (priority) queues of scheduler
-#define PRIORITY_QUEUES 10
-
-//every N yield() calls, all threads will be boosted by one
-#define N 1000
+/*
+	Scheduler parameters, set at boot time by initialize_scheduler().
+ */
+static uint sched_levels;	/* number of priority levels in use */
+static TimerDuration sched_quantum[PRIORITY_QUEUES];	/* the quantum of each level */
+static TimerDuration sched_aging;	/* the aging period */
+static int sched_tickless;	/* flag for tickless mode */
+static uint thread_cache_limit;	/* the high-water mark of each core's thread cache */
+static int sched_fair;	/* flag for fair-share mode */
+static int sched_wakeup_preempt;	/* flag for preemption on wakeup */
+static int sched_pi;	/* flag for priority inheritance on mutexes */
+static uint rt_bandwidth;	/* the real-time bandwidth of each core, in permille */
 
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
+
+	Turning preemption off and on costs two signal mask system calls of the
+	host, which would dominate trivial syscalls such as GetPid. Instead, we
+	read the current thread of the core, and the base of its stack, as a 
+	pair that is consistent by its sequence number. If the frame of the 
+	caller lies in that stack, the thread is the caller: it was running on
+	the core while the caller was alive, so their stacks are disjoint. If we
+	migrated in the meantime, or we are on a core's own stack, the check
+	fails and we take the slow path.
  */
 TCB* cur_thread()
 {
+  CCB* ccb = &CURCORE;
+  uint seq = __atomic_load_n(&ccb->switch_seq, __ATOMIC_ACQUIRE);
+  TCB* cur = __atomic_load_n(&ccb->current_thread, __ATOMIC_RELAXED);
+  void* stack = __atomic_load_n(&ccb->current_stack, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  void* frame = __builtin_frame_address(0);
+  if(!(seq & 1) && seq == __atomic_load_n(&ccb->switch_seq, __ATOMIC_RELAXED)
+      && frame >= stack && frame < (void*)cur)
+    return cur;
+
   int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
+  cur = CURTHREAD;
   if(preempt) preempt_on;
   return cur;
 }
 
 
 
+
 /*
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the top of the memory block used as the stack,
+  and a guard page at the bottom.
 
   +-------------+
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The guard page is mapped with no access rights, so that a stack 
+  overrun causes a segmentation fault, instead of corrupting memory.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  The block is mapped with mmap(), without reserving swap space. Therefore,
+  the pages of the stack are only committed when they are first touched, and
+  a mostly-idle thread costs only a few pages of memory.
+
+  Disadvantages: The stack cannot grow. Of course, we do not support stack 
+  growth anyway!
  */
 
 /*
   A counter for active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
+  It is updated atomically.
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
 
+/* Round up to a multiple of SYSTEM_PAGE_SIZE */
+#define PAGE_ROUND_UP(size) \
+	((((size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_TCB_SIZE \
-	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+#define THREAD_TCB_SIZE PAGE_ROUND_UP(sizeof(TCB))
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+  Use mmap to allocate a thread block, with a guard page. 
+  The stack size must be a multiple of the page size.
+  Return the TCB of the block.
 
-void* allocate_thread(size_t size)
+  The memory is not executable, so tasks cannot use gcc nested functions
+  that need trampolines on the stack.
+ */
+static TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	size_t size = THREAD_SIZE(stack_size);
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
 
-	return ptr;
+	TCB* tcb = (TCB*)(ptr + THREAD_GUARD_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
 
-void* allocate_thread(size_t size)
+static void free_thread(TCB* tcb)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	size_t stack_size = tcb->stack_size;
+	void* ptr = ((void*)tcb) - stack_size - THREAD_GUARD_SIZE;
+	CHECK(munmap(ptr, THREAD_SIZE(stack_size)));
 }
-#endif
 
+/* The base (lowest address) of the stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) - (tcb)->stack_size)
 
+/* Set the current thread of this core, with preemption off */
+static void set_current_thread(CCB* ccb, TCB* tcb)
+{
+  __atomic_store_n(&ccb->switch_seq, ccb->switch_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&ccb->current_thread, tcb, __ATOMIC_RELAXED);
+  /* The idle thread runs on the core's own stack; give it an empty range */
+  __atomic_store_n(&ccb->current_stack, 
+    (tcb->type == IDLE_THREAD) ? (void*)tcb : THREAD_STACK(tcb), __ATOMIC_RELAXED);
+  __atomic_store_n(&ccb->switch_seq, ccb->switch_seq + 1, __ATOMIC_RELEASE);
+}
 
 
 /*
@@ -157,10 +203,55 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+/*
+  Thread blocks (TCB and stack) of exited threads with the default stack size
+  are kept in a per-core cache, up to thread_cache_limit blocks per core, and 
+  reused by spawn_thread(). Cached blocks stay registered with valgrind.
+*/
+
+static TCB* thread_cache_get()
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	TCB* tcb = NULL;
+	if (ccb->thread_cache_size > 0) {
+		tcb = rlist_pop_front(&ccb->thread_cache)->tcb;
+		ccb->thread_cache_size--;
+	}
+	if (preempt) preempt_on;
+	return tcb;
+}
+
+/*
+  Free the thread blocks in the cache of the current core.
+ */
+static void thread_cache_drain()
+{
+	CCB* ccb = &CURCORE;
+	while (ccb->thread_cache_size > 0) {
+		TCB* tcb = rlist_pop_front(&ccb->thread_cache)->tcb;
+		ccb->thread_cache_size--;
+#ifndef NVALGRIND
+		VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+		free_thread(tcb);
+	}
+}
+
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The stack size must be a multiple of page size */
+	stack_size = (stack_size == 0) ? THREAD_STACK_SIZE : PAGE_ROUND_UP(stack_size);
+
+	/* Reuse a cached thread block, or allocate a new one. */
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE) ? thread_cache_get() : NULL;
+	if (tcb == NULL) {
+		tcb = allocate_thread(stack_size);
+#ifndef NVALGRIND
+		void* stack = THREAD_STACK(tcb);
+		tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(stack, stack + stack_size);
+#endif
+	}
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -171,30 +262,37 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->sched_lock = MUTEX_INIT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	tcb->affinity = ~0u; /* all cores */
+	tcb->last_core = cpu_core_id;
+	tcb->rt_budget = tcb->rt_period = 0;
+	tcb->rt_deadline = tcb->rt_left = 0;
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
- 	tcb->priority = (PRIORITY_QUEUES)-1; //setting the new thread's priority as maximum
- 	//tcb->priority = (PRIORITY_QUEUES)/2-1; //setting the new thread's priority as mid
-  //tcb->priority = 0; //setting the new thread's priority as minimum
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	/* Reset the accounting; the block may have been used by another thread */
+	tcb->state_time = 0;
+	tcb->block_cause = SCHED_IDLE;
+	tcb->run_time = tcb->ready_time = 0;
+	memset(tcb->blocked_time, 0, sizeof(tcb->blocked_time));
+	tcb->vol_switches = tcb->invol_switches = 0;
+
+	tcb->pi_base = -1;
+	tcb->pi_gen = 0;
+	tcb->rq_realtime = 0;
+	tcb->priority = sched_levels-1; //setting the new thread's priority as maximum
+	//tcb->priority = sched_levels/2-1; //setting the new thread's priority as mid
+  //tcb->priority = 0; //setting the new thread's priority as minimum
+	tcb->its = sched_quantum[tcb->priority];
+	tcb->rts = tcb->its;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
-
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+	cpu_initialize_context(&tcb->context, THREAD_STACK(tcb), tcb->stack_size, thread_start);
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_SEQ_CST);
 
 	return tcb;
 }
@@ -203,16 +301,13 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	Inside this function we call the spawn_thread() function that was already 
 	implemented. 
 */
-PTCB* spawn_process_thread(PCB* pcb,void (*func)())
+PTCB* spawn_process_thread(PCB* pcb,void (*func)(), size_t stack_size)
 {
 	PTCB* ptcb = acquire_PTCB(); //allocating memory for the new PTCB
 
 	rlnode* ptcb_node = rlnode_init(& ptcb->ptcb_list_node, ptcb);   
 
-	//adding node in the tail of the list:
-  rlist_push_back(& pcb->ptcb_list, ptcb_node);
-
-	ptcb->tcb = spawn_thread(pcb, func); //current ptcb reference to its tcb 
+	ptcb->tcb = spawn_thread(pcb, func, stack_size); //current ptcb reference to its tcb 
 
   //initializing values for the new PTCB
   ptcb->exitval = -1;
@@ -222,25 +317,42 @@ PTCB* spawn_process_thread(PCB* pcb,void (*func)())
 	ptcb->exit_cv = COND_INIT;     
 	ptcb->tcb->ptcb = ptcb; //current tcb reference to its ptcb
 
+	//adding node in the tail of the list:
+	Mutex_Lock(& pcb->lock);
+  acquire_tid(pcb, ptcb);
+  rlist_push_back(& pcb->ptcb_list, ptcb_node);
 	pcb->thread_count ++; //incrementing thread count
+	Mutex_Unlock(& pcb->lock);
 
 	return ptcb; 
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called in the non-preemptive domain, from gain().
  */
+static void rt_release(TCB* tcb); /* forward */
+
 void release_TCB(TCB* tcb)
 {
+	CCB* ccb = &CURCORE;
+
+	/* Give back the real-time bandwidth of the thread */
+	rt_release(tcb);
+
+	/* Keep the thread block in the cache of this core, or free it */
+	if (tcb->stack_size == THREAD_STACK_SIZE && ccb->thread_cache_size < thread_cache_limit) {
+		rlist_push_front(&ccb->thread_cache, &tcb->sched_node);
+		ccb->thread_cache_size++;
+	} else {
 #ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+		VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
+		free_thread(tcb);
+	}
 
-	free_thread(tcb, THREAD_SIZE);
-
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	/* Halted cores may have no timer armed, so tell them to exit the scheduler */
+	if (__atomic_sub_fetch(&active_threads, 1, __ATOMIC_SEQ_CST) == 0)
+		cpu_core_restart_all();
 }
 
 /*
@@ -254,137 +366,1124 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core has its own run queue, made of sched_levels doubly linked 
+  lists (an mlfq), stored in its CCB and protected by the core's rq_lock.
+  In fair-share mode, there is one mlfq per process with ready threads
+  at the core, also protected by rq_lock.
+
+  Also, the scheduler contains a timer wheel with all the sleeping
+  threads with a timeout, protected by timeout_spinlock.
+
+  The state of each thread (state, phase, wakeup_time) is protected by
+  the thread's own sched_lock. 
+
+  The real-time bandwidth reserved by all threads is protected by rt_lock,
+  which is only taken alone, or under tcb->sched_lock.
+
+  When more than one of these locks is needed, they are taken in the order
+	  tcb->sched_lock  <  timeout_spinlock  <  rq_lock
+  Code that needs to go against this order (to wake up the threads 
+  of the timer wheel) must use Mutex_TryLock(). Stealing from the run queue 
+  of another core also uses Mutex_TryLock(), to skip busy run queues.
+*/
+
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for the timer wheel */
+
+
+/*
+  The timer wheel.
+  ----------------
+
+  Time is divided into ticks of TIMER_TICK usec. A thread sleeping with 
+  a timeout expires at tick  et = ceil(wakeup_time / TIMER_TICK).
+
+  The wheel has TIMER_LEVELS levels of TIMER_SLOTS lists (slots) each. 
+  A thread whose expiry tick et is  d = et - TW.now  ticks in the future, 
+  is placed at the lowest level l such that  d < TIMER_SLOTS^(l+1),  in slot 
+     (et / TIMER_SLOTS^l) mod TIMER_SLOTS
+  Threads further in the future than the span of the wheel are kept at the
+  top level, and are re-inserted when their slot comes up.
+
+  When the wheel advances to a tick T which is a multiple of TIMER_SLOTS^l, 
+  the slot of level l for T is cascaded, i.e., its threads are re-inserted 
+  at lower levels. Then, the threads in the level-0 slot of T have expired,
+  and are moved to the TW.expired list, from where they are woken up.
+
+  Thus, insertion and cancellation take O(1) time, and each thread is moved
+  at most TIMER_LEVELS times. A bitmap of the (possibly) non-empty slots of each
+  level allows the wheel to skip over empty slots quickly.
+
+  Invariant: a thread with a timeout is in a wheel slot iff et > TW.now, 
+  else it is in TW.expired.
+*/
+
+#define TIMER_TICK (1000ul)	/* usec per tick */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1u << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS-1)
+#define TIMER_LEVELS 4
+#define TIMER_SPAN (1ul << (TIMER_BITS*TIMER_LEVELS)) /* in ticks */
+
+/* The expiry tick of a thread */
+#define TIMER_EXPIRY(tcb) (((tcb)->wakeup_time + TIMER_TICK - 1) / TIMER_TICK)
+
+static struct {
+	rlnode slot[TIMER_LEVELS][TIMER_SLOTS];	/* the wheel */
+	uint64_t occupied[TIMER_LEVELS]; /* bit i set if slot i may be non-empty */
+	TimerDuration now;	/* the last tick processed */
+	uint count;	/* number of threads in the wheel slots */
+	rlnode expired;	/* threads that have expired but are not woken up yet */
+	timer_stats stats;
+} TW;
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
 
-  Both of these structures are protected by @c sched_spinlock.
+/*
+  Insert a thread into the timer wheel.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
 */
+static void timer_insert(TCB* tcb)
+{
+	TimerDuration et = TIMER_EXPIRY(tcb);
+	if(et <= TW.now) {
+		rlist_push_back(&TW.expired, &tcb->sched_node);
+		return;
+	}
+
+	TimerDuration delta = et - TW.now;
+	if(delta >= TIMER_SPAN)
+		et = TW.now + TIMER_SPAN - 1;	/* saturate */
+
+	uint level = 0;
+	while(level < TIMER_LEVELS-1 && delta >= (1ul << (TIMER_BITS*(level+1))))
+		level++;
+
+	uint slot = (et >> (TIMER_BITS*level)) & TIMER_MASK;
+	rlist_push_back(&TW.slot[level][slot], &tcb->sched_node);
+	TW.occupied[level] |= (1ull << slot);
+	TW.count++;
+}
+
+/*
+  Remove a thread from the timer wheel.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_cancel(TCB* tcb)
+{
+	if(TIMER_EXPIRY(tcb) > TW.now)
+		TW.count--;
+	rlist_remove(&tcb->sched_node);
+}
+
+/*
+  Re-insert the threads of a slot. This is called for tick T, with TW.now == T,
+  so that the threads are placed relative to T. Placed relative to T-1, a 
+  thread expiring at T+63 would go back into the level-1 slot being cascaded,
+  which does not come up again for a whole round of level 1. Threads that 
+  expire at T go straight to TW.expired.
+*/
+static void timer_cascade(uint level, TimerDuration T)
+{
+	uint slot = (T >> (TIMER_BITS*level)) & TIMER_MASK;
+	rlnode* list = & TW.slot[level][slot];
+	TW.occupied[level] &= ~(1ull << slot);
+
+	rlnode moved;
+	rlnode_init(&moved, NULL);
+	rlist_append(&moved, list);
+
+	while(! is_rlist_empty(&moved)) {
+		TCB* tcb = rlist_pop_front(&moved)->tcb;
+		TW.count--;
+		timer_insert(tcb);
+		TW.stats.cascades++;
+	}
+}
+
+/*
+  Advance the timer wheel up to the given tick, moving all threads
+  that expire to TW.expired.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_advance(TimerDuration tick)
+{
+	while(TW.now < tick) {
+
+		/* Nothing to do if the wheel is empty */
+		if(TW.count == 0) {
+			TW.now = tick;
+			break;
+		}
+
+		TimerDuration T = TW.now+1;
+
+		if((T & TIMER_MASK) != 0) {
+			/* No cascading until the end of this round of level 0, so skip
+			   to the next occupied slot, if any */
+			uint64_t occ = TW.occupied[0] >> (T & TIMER_MASK);
+			if(occ == 0) {
+				TW.now = ((T | TIMER_MASK) < tick) ? (T | TIMER_MASK) : tick;
+				continue;
+			}
+			T += __builtin_ctzll(occ);
+			if(T > tick) {
+				TW.now = tick;
+				break;
+			}
+		}
+		else {
+			/* Cascade every level whose round has ended, from the top */
+			TW.now = T;
+			for(uint level = TIMER_LEVELS-1; level > 0; level--)
+				if((T & ((1ul << (TIMER_BITS*level))-1)) == 0)
+					timer_cascade(level, T);
+		}
 
-rlnode SCHED[PRIORITY_QUEUES]; //the scheduler queues
+		/* Expire the level-0 slot of T */
+		TW.now = T;
+		uint slot = T & TIMER_MASK;
+		rlnode* list = & TW.slot[0][slot];
+		TW.occupied[0] &= ~(1ull << slot);
+		for(rlnode* n = list->next; n != list; n = n->next)
+			TW.count--;
+		rlist_append(&TW.expired, list);
+	}
+}
 
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
+/*
+  Return the time (as in bios_clock()) of the next event of the timer wheel, 
+  or NO_TIMEOUT if the wheel is empty. The next event is either an expiry
+  or a cascade, therefore it is a lower bound for the next expiry.
 
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static TimerDuration timer_next_event()
+{
+	if(! is_rlist_empty(&TW.expired))
+		return TW.now * TIMER_TICK;
+	if(TW.count == 0)
+		return NO_TIMEOUT;
+
+	TimerDuration next = NO_TIMEOUT;
+	for(uint level=0; level<TIMER_LEVELS; level++) {
+		uint64_t occ = TW.occupied[level];
+		if(occ == 0) continue;
+
+		/* Find the next occupied slot after the current one, cyclically */
+		TimerDuration base = TW.now >> (TIMER_BITS*level);
+		uint cur = base & TIMER_MASK;
+		uint64_t rot = (cur == TIMER_MASK) ? occ : (occ >> (cur+1)) | (occ << (TIMER_MASK-cur));
+		TimerDuration t = (base + __builtin_ctzll(rot) + 1) << (TIMER_BITS*level);
+		if(t < next) 
+			next = t;
+	}
+	return next * TIMER_TICK;
+}
+
+void get_timer_stats(timer_stats* stats)
+{
+	Mutex_Lock(&timeout_spinlock);
+	*stats = TW.stats;
+	Mutex_Unlock(&timeout_spinlock);
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
-{ /* noop for now... */
+{ 
+	CCB* ccb = &CURCORE;
+
+	/* Another core woke up a thread of higher priority than ours, and queued it here */
+	if(__atomic_exchange_n(&ccb->preempt_pending, 0, __ATOMIC_ACQUIRE) && ccb->ready_count > 0) {
+		yield(SCHED_PREEMPT);
+		return;
+	}
+
+	/* The affinity of the current thread was changed to exclude this core */
+	TCB* cur = ccb->current_thread;
+	if(cur->type != IDLE_THREAD && !(cur->affinity & (1u << ccb->id))) {
+		yield(SCHED_PREEMPT);
+		return;
+	}
+
+	/* In tickless mode, another core may have queued a thread here */
+	if(ccb->quantum_off && ccb->ready_count > 0) {
+		ccb->quantum_off = 0;
+		bios_set_timer(QUANTUM);
+	}
 }
 
 /*
   Possibly add TCB to the scheduler timeout list.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		tcb->wakeup_time = curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		Mutex_Lock(&timeout_spinlock);
+		timer_insert(tcb);
+		TW.stats.inserts++;
+		Mutex_Unlock(&timeout_spinlock);
+	}
+}
+
+static void mlfq_init(mlfq* q)
+{
+	for(int i=0; i<PRIORITY_QUEUES; i++)
+		rlnode_init(&q->list[i], NULL);
+	q->levels = 0;
+}
+
+/*
+  Remove and return a thread of a multi-level queue that may run on 
+  core c, or NULL if there is none. A core popping its own queue takes the
+  first allowed thread of the highest level, looking past any number of 
+  threads excluded by affinity. A core that steals (warm is set) looks at 
+  no more than STEAL_SCAN threads per level, and prefers among them a thread
+  that last ran on core c, since its cache may still be warm there. The 
+  priority of the returned thread is updated to its level, since aging may
+  have moved it up.
+*/
+#define STEAL_SCAN 8
+
+static TCB* mlfq_pop_allowed(mlfq* q, uint c, int warm)
+{
+	uint32_t levels = q->levels;
+	while(levels) {
+		//the non-empty list with the highest priority is the most significant bit set
+		int i = 31 - __builtin_clz(levels);
+		levels &= ~(1u << i);
+
+		rlnode* list = &q->list[i];
+		TCB* found = NULL;
+		int scan = warm ? STEAL_SCAN : INT_MAX;
+		for(rlnode* n = list->next; n != list && scan > 0; n = n->next, scan--) {
+			TCB* tcb = n->tcb;
+			if(! (tcb->affinity & (1u << c))) continue;
+			if(found == NULL) found = tcb;
+			if(!warm || tcb->last_core == c) { found = tcb; break; }
+		}
+
+		if(found) {
+			rlist_remove(&found->sched_node);
+			if(is_rlist_empty(list))
+				q->levels &= ~(1u << i);
+			found->priority = i;
+			return found;
+		}
 	}
+	return NULL;
+}
+
+/*
+  Add a thread to the end of the list of its priority level.
+*/
+static inline void mlfq_push(mlfq* q, TCB* tcb)
+{
+	rlist_push_back(&q->list[tcb->priority], &tcb->sched_node);
+	q->levels |= (1u << tcb->priority);
+}
+
+/*
+  Remove a queued thread from a multi-level queue, and return the level it 
+  was queued at. Because of aging, this may be higher than its priority, so
+  the list head is found by walking the list.
+*/
+static int mlfq_remove(mlfq* q, TCB* tcb)
+{
+	rlnode* n = tcb->sched_node.next;
+	while(n < &q->list[0] || n >= &q->list[PRIORITY_QUEUES])
+		n = n->next;
+	int i = n - q->list;
+
+	rlist_remove(&tcb->sched_node);
+	if(is_rlist_empty(&q->list[i]))
+		q->levels &= ~(1u << i);
+	return i;
 }
 
 /*
-  Add TCB to the end of the corresponding scheduler queue.
+  Age a multi-level queue, by moving every list up by one level. The 
+  top level absorbs the level below it, and level 0 becomes empty.
+  Thread priorities are corrected lazily, by mlfq_pop_allowed().
+*/
+static void mlfq_age(mlfq* q)
+{
+	for(int i = sched_levels-1; i > 0; i--)
+		rlist_append(&q->list[i], &q->list[i-1]);
+
+	uint32_t top = 1u << (sched_levels-1);
+	q->levels = (q->levels & top) | (q->levels << 1);
+	q->levels &= (top << 1) - 1;
+}
+
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Fair-share mode.
+
+  Each process has a virtual runtime, which is the CPU time used by its
+  threads, scaled by DEFAULT_PROCESS_WEIGHT/weight. At each core, the 
+  ready threads of each process form a group, and the group whose process
+  has the least virtual runtime is served first. The number of groups of
+  a core is the number of processes with ready threads there, which is 
+  usually small, so groups are kept in an unordered list and searched 
+  linearly; the virtual runtimes change as other cores charge them, so 
+  an ordered structure would need constant fixing.
+
+  A process whose group becomes active at a core has its virtual runtime 
+  raised to the core's min_vruntime, so that a process which slept for 
+  long cannot monopolize the core afterwards.
+*/
+
+/*
+  Charge t usec of CPU time, used by a thread, to its process. 
 */
-static void sched_queue_add(TCB* tcb)
+static inline void fair_charge(TCB* tcb, TimerDuration t)
 {
+	if(sched_fair && tcb->type != IDLE_THREAD && t > 0) {
+		PCB* pcb = tcb->owner_pcb;
+		__atomic_fetch_add(&pcb->vruntime, t * DEFAULT_PROCESS_WEIGHT / pcb->weight, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+  Return the group of a process at a core, activating it if needed.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static sched_group* fair_group(CCB* ccb, PCB* pcb)
+{
+	for(rlnode* n = ccb->groups.next; n != &ccb->groups; n = n->next) {
+		sched_group* g = n->obj;
+		if(g->pcb == pcb)
+			return g;
+	}
+
+	sched_group* g;
+	if(! is_rlist_empty(&ccb->free_groups))
+		g = rlist_pop_front(&ccb->free_groups)->obj;
+	else {
+		g = (sched_group*) xmalloc(sizeof(sched_group));
+		mlfq_init(&g->queue);
+		rlnode_init(&g->node, g);
+	}
+	g->pcb = pcb;
+	g->count = 0;
+	rlist_push_back(&ccb->groups, &g->node);
+
+	/* Raise the virtual runtime of the process to min_vruntime, if it is behind */
+	TimerDuration vrt = __atomic_load_n(&pcb->vruntime, __ATOMIC_RELAXED);
+	while(vrt < ccb->min_vruntime &&
+		!__atomic_compare_exchange_n(&pcb->vruntime, &vrt, ccb->min_vruntime, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return g;
+}
+
+/*
+  Remove and return a ready thread of the group with the least virtual 
+  runtime that has a thread allowed on core c. Empty groups are deactivated.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static TCB* fair_pop_allowed(CCB* ccb, uint c, int warm)
+{
+	sched_group* best = NULL;
+	for(rlnode* n = ccb->groups.next; n != &ccb->groups; n = n->next) {
+		sched_group* g = n->obj;
+		if(best == NULL || g->pcb->vruntime < best->pcb->vruntime)
+			best = g;
+	}
+	if(best == NULL)
+		return NULL;
+
+	sched_group* g = best;
+	TCB* tcb = mlfq_pop_allowed(&g->queue, c, warm);
+
+	/* Rarely, affinity masks exclude the best group; try the rest in any order */
+	for(rlnode* n = ccb->groups.next; tcb == NULL && n != &ccb->groups; n = n->next) {
+		g = n->obj;
+		if(g != best)
+			tcb = mlfq_pop_allowed(&g->queue, c, warm);
+	}
+	if(tcb == NULL)
+		return NULL;
+
+	if(g == best && g->pcb->vruntime > ccb->min_vruntime)
+		ccb->min_vruntime = g->pcb->vruntime;
+
+	if(--g->count == 0) {
+		rlist_remove(&g->node);
+		rlist_push_front(&ccb->free_groups, &g->node);
+	}
+	return tcb;
+}
+
+/*
+  Free the groups of the current core, at shutdown.
+*/
+static void fair_groups_drain()
+{
+	CCB* ccb = &CURCORE;
+	assert(is_rlist_empty(&ccb->groups));
+	while(! is_rlist_empty(&ccb->free_groups))
+		free(rlist_pop_front(&ccb->free_groups)->obj);
+}
+
+
+/*
+  The real-time class.
+
+  A real-time thread has a budget of CPU time per period. When it is queued
+  after its current period has ended, a new period starts, with a deadline
+  at its end and a full budget (so a thread that slept for long does not 
+  accumulate budget). While it has budget left, it is queued in the rt_queue 
+  of the core, which is ordered by deadline and served before the rest of 
+  the run queue; else it is queued like any other thread until its next 
+  period. Real-time threads are charged for the time they run in the 
+  real-time class from their timer, which is more precise than the clock.
+
+  Admission control keeps the total bandwidth (budget/period) of real-time 
+  threads within rt_bandwidth of every core, so that time-sharing threads
+  are not starved.
+*/
+static Mutex rt_lock = MUTEX_INIT;	/* protects rt_load */
+static uint rt_load;	/* the bandwidth reserved by all real-time threads, in permille */
+
+/* The bandwidth of a reservation in permille, rounded up */
+static inline uint rt_utilization(TimerDuration budget, TimerDuration period)
+{
+	return (budget == 0) ? 0 : (budget * 1000 + period - 1) / period;
+}
+
+/* The priority of a thread, where real-time threads with budget left are above all levels */
+static inline int sched_priority(TCB* tcb)
+{
+	return (tcb->rt_left > 0) ? PRIORITY_QUEUES : tcb->priority;
+}
+
+/*
+  Start a new period of a real-time thread, if the current one has ended.
+
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
+*/
+static inline void rt_replenish(TCB* tcb)
+{
+	if(tcb->rt_budget == 0)
+		return;
+	TimerDuration curtime = bios_clock();
+	if(curtime >= tcb->rt_deadline) {
+		tcb->rt_deadline = curtime + tcb->rt_period;
+		tcb->rt_left = tcb->rt_budget;
+	}
+}
+
+/*
+  Insert a thread into the real-time queue of a core, after the threads 
+  with the same or earlier deadline.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static inline void rt_push(CCB* ccb, TCB* tcb)
+{
+	rlnode* n = ccb->rt_queue.prev;
+	while(n != &ccb->rt_queue && n->tcb->rt_deadline > tcb->rt_deadline)
+		n = n->prev;
+	rlist_push_front(n, &tcb->sched_node);
+}
+
+/*
+  Remove and return the real-time thread with the earliest deadline that 
+  may run on core c, or NULL if there is none.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static inline TCB* rt_pop_allowed(CCB* ccb, uint c)
+{
+	for(rlnode* n = ccb->rt_queue.next; n != &ccb->rt_queue; n = n->next) {
+		if(n->tcb->affinity & (1u << c))
+			return rlist_remove(n)->tcb;
+	}
+	return NULL;
+}
+
+/* Return the bandwidth of a thread that exits */
+static void rt_release(TCB* tcb)
+{
+	if(tcb->rt_budget == 0)
+		return;
+	Mutex_Lock(&rt_lock);
+	rt_load -= rt_utilization(tcb->rt_budget, tcb->rt_period);
+	Mutex_Unlock(&rt_lock);
+}
+
+
+/*
+  Remove and return a thread of the run queue of a core that may run on 
+  core c, or NULL if there is none (see mlfq_pop_allowed()).
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static TCB* rq_pop_allowed(CCB* ccb, uint c, int warm)
+{
+	TCB* tcb = rt_pop_allowed(ccb, c);
+	if(tcb == NULL)
+		tcb = sched_fair ? fair_pop_allowed(ccb, c, warm) 
+			: mlfq_pop_allowed(&ccb->ready_queue, c, warm);
+	if(tcb != NULL)
+		ccb->ready_count--;
+	return tcb;
+}
+
+/*
+  Add a thread to the run queue of a core.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static inline void rq_push(CCB* ccb, TCB* tcb)
+{
+	tcb->rq_realtime = (tcb->rt_left > 0);
+	if(tcb->rq_realtime)
+		rt_push(ccb, tcb);
+	else if(sched_fair) {
+		sched_group* g = fair_group(ccb, tcb->owner_pcb);
+		mlfq_push(&g->queue, tcb);
+		g->count++;
+	}
+	else
+		mlfq_push(&ccb->ready_queue, tcb);
+	ccb->ready_count++;
+	tcb->rq_core = ccb->id;
+}
+
+/*
+  Remove a queued thread from the run queue of a core. Its priority is
+  raised to the level it was queued at, which aging may have raised.
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static void rq_remove(CCB* ccb, TCB* tcb)
+{
+	if(tcb->rq_realtime)
+		rlist_remove(&tcb->sched_node);
+	else {
+		sched_group* g = sched_fair ? fair_group(ccb, tcb->owner_pcb) : NULL;
+		int level = mlfq_remove(g ? &g->queue : &ccb->ready_queue, tcb);
+		if(level > tcb->priority)
+			tcb->priority = level;
+		if(g && --g->count == 0) {
+			rlist_remove(&g->node);
+			rlist_push_front(&ccb->free_groups, &g->node);
+		}
+	}
+	ccb->ready_count--;
+}
+
+/*
+  Age the run queue of a core (see mlfq_age()).
+
+  *** MUST BE CALLED WITH ccb->rq_lock HELD ***
+*/
+static void rq_age(CCB* ccb)
+{
+	if(sched_fair) {
+		for(rlnode* n = ccb->groups.next; n != &ccb->groups; n = n->next)
+			mlfq_age(& ((sched_group*)n->obj)->queue);
+	}
+	else
+		mlfq_age(&ccb->ready_queue);
+}
+
+/*
+  Choose the core at whose run queue a thread will be queued.
+
+  The thread's affinity mask is always respected. If the current core is
+  allowed, the thread is queued here: the waker usually blocks soon after
+  a wakeup (e.g., on a pipe), and the woken thread then runs on the same
+  core with the data still in the cache, instead of bouncing between cores.
+  Else, the core the thread last ran on is preferred, then an idle allowed
+  core, then the first allowed core. Since this is only a heuristic, the 
+  CCBs of other cores are read without locking.
+*/
+static inline int core_is_idle(CCB* ccb)
+{
+	return ccb->current_thread == &ccb->idle_thread && ccb->ready_count == 0;
+}
+
+static CCB* sched_pick_core(TCB* tcb)
+{
+	uint self = cpu_core_id;
+	uint allowed = tcb->affinity & ((cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ~0u);
+
+	if(allowed & (1u << self))
+		return &cctx[self];
+
+	uint last = tcb->last_core;
+	if(allowed & (1u << last))
+		return &cctx[last];
+
+	for(uint m = allowed; m; m &= m-1) {
+		uint c = __builtin_ctz(m);
+		if(core_is_idle(&cctx[c]))
+			return &cctx[c];
+	}
+	return &cctx[__builtin_ctz(allowed)];
+}
+
+/*
+  Choose a core to preempt, so that a woken thread runs at once, or
+  return NULL if no core should be preempted. The priority of an idle core
+  is taken to be -1, and that of a real-time thread with budget left is
+  above all levels (see sched_priority()).
+
+  If the core chosen by sched_pick_core() runs a thread of lower priority,
+  that core is preempted. Else, if an allowed core is idle, it will steal 
+  the thread soon, and no core is preempted. Else, the allowed core running 
+  the thread of the lowest priority is preempted, if that priority is lower 
+  than the woken thread's. As in sched_pick_core(), the CCBs of other cores 
+  are read without locking.
+*/
+static inline int core_priority(CCB* ccb)
+{
+	/* At boot, a core may not have entered the scheduler yet */
+	TCB* cur = ccb->current_thread;
+	return (cur == NULL || cur == &ccb->idle_thread) ? -1 : sched_priority(cur);
+}
+
+static CCB* sched_preempt_target(TCB* tcb, CCB* chosen)
+{
+	int tprio = sched_priority(tcb);
+	int prio = core_priority(chosen);
+	if(prio < 0)
+		return NULL;
+	if(prio < tprio)
+		return chosen;
+
+	uint allowed = tcb->affinity & ((cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ~0u);
+	CCB* victim = NULL;
+	int lowest = tprio;
+	for(uint m = allowed; m; m &= m-1) {
+		CCB* ccb = &cctx[__builtin_ctz(m)];
+		int p = core_priority(ccb);
+		if(p < 0)
+			return NULL;
+		if(p < lowest) {
+			lowest = p;
+			victim = ccb;
+		}
+	}
+	return victim;
+}
+
+/*
+  Add TCB to the end of the corresponding queue, in the run queue of
+  the core chosen by sched_pick_core(). Idle cores will steal it, if the 
+  chosen core is busy.
+
+  If wake is set, the thread has just been woken up. Then, unless wakeup 
+  preemption is disabled, a core running a thread of lower priority may 
+  be chosen instead (see sched_preempt_target()). That core is sent an 
+  ICI, so that it reschedules at once, instead of at the end of its quantum.
+
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
+*/
+static void sched_queue_add(TCB* tcb, int wake)
+{
+	rt_replenish(tcb);
+
+	CCB* ccb = sched_pick_core(tcb);
+
+	CCB* victim = (wake && sched_wakeup_preempt) ? sched_preempt_target(tcb, ccb) : NULL;
+	if(victim != NULL)
+		ccb = victim;
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	Mutex_Lock(&ccb->rq_lock);
+	rq_push(ccb, tcb);
+	Mutex_Unlock(&ccb->rq_lock);
+
+	/* Set if some other core was restarted or interrupted for the thread */
+	int kicked = 0;
+
+	if(victim != NULL) {
+		/* The ICI is delivered when the victim core enables interrupts; 
+		   if this is the current core, after the caller enables preemption. */
+		__atomic_store_n(&victim->preempt_pending, 1, __ATOMIC_RELEASE);
+		cpu_ici(victim->id);
+		kicked = (victim->id != cpu_core_id);
+	}
+	else if(ccb->id == cpu_core_id) {
+		/* In tickless mode, the current thread may be running without a quantum */
+		if(ccb->quantum_off) {
+			ccb->quantum_off = 0;
+			bios_set_timer(QUANTUM);
+		}
+	}
+	else {
+		/* Restart the chosen core if it is halted, else make it re-arm its timer if needed,
+		   or wake it up from a halt that it is about to enter (see idle_thread()) */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		kicked = cpu_core_restart(ccb->id);
+		if(! kicked && ccb->quantum_off) {
+			cpu_ici(ccb->id);
+			kicked = 1;
+		}
+	}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	/* Else, restart a halted core, so that it can steal the thread. Restarting
+	   one on every wakeup would keep idle cores from staying halted. */
+	if(! kicked)
+		cpu_core_restart_one();
 }
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->sched_lock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+		Mutex_Lock(&timeout_spinlock);
+		/* tcb may have been removed by sched_wakeup_expired_timeouts(), 
+		   while we were waiting for the lock */
+		if (tcb->wakeup_time != NO_TIMEOUT) {
+			/* tcb is in the timer wheel, fix it */
+			assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+			timer_cancel(tcb);
+			TW.stats.cancels++;
+			tcb->wakeup_time = NO_TIMEOUT;
+		}
+		Mutex_Unlock(&timeout_spinlock);
 	}
 
+	/* Account for the time the thread was blocked */
+	TimerDuration curtime = bios_clock();
+	if (tcb->state == STOPPED)
+		tcb->blocked_time[tcb->block_cause] += curtime - tcb->state_time;
+	tcb->state_time = curtime;
+
 	/* Mark as ready */
 	tcb->state = READY;
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+		sched_queue_add(tcb, 1);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Advance the timer wheel to the current time, and wake up the 
+  expired threads.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Because this goes against the locking order, the threads' locks are 
+  only tried. Threads whose lock is busy stay in the expired list, 
+  and will be woken up by a subsequent call.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	/* Do not bother with the lock, if there is nothing to do */
+	if (TW.count == 0 && is_rlist_empty(&TW.expired))
+		return;
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
+	TimerDuration tick = bios_clock() / TIMER_TICK;
+
+	Mutex_Lock(&timeout_spinlock);
+	timer_advance(tick);
+
+	rlnode* n = TW.expired.next;
+	while (n != &TW.expired) {
+		TCB* tcb = n->tcb;
+		n = n->next;
+		if (!Mutex_TryLock(&tcb->sched_lock))
+			continue;
+
+		/* Remove from the wheel, so that sched_make_ready() does not need the lock */
+		rlist_remove(&tcb->sched_node);
+		tcb->wakeup_time = NO_TIMEOUT;
+		TW.stats.expires++;
 		sched_make_ready(tcb);
+
+		Mutex_Unlock(&tcb->sched_lock);
 	}
+	Mutex_Unlock(&timeout_spinlock);
 }
 
 /*
-  Remove the head of the queue with maximum priority, if any, and
-  return it. Return NULL if there is no thread in any queue.
+  Try to steal a thread from the run queue of some other core.
+  Return the stolen thread, or NULL.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  The run queues of other cores are visited in a round-robin order,
+  starting from the next core. Busy run queues are skipped, and so are
+  threads whose affinity does not allow them to run on the thief.
 */
-static TCB* sched_queue_select(TCB* current)
+static TCB* sched_steal(CCB* thief)
 {
-	int i = PRIORITY_QUEUES - 1; //maximum priority 
-	//finding the non-empty list with the highest priority
-	while(is_rlist_empty(&SCHED[i]) && i>0) {
-		i--;
+	uint ncores = cpu_cores();
+
+	for(uint i=1; i<ncores; i++) {
+		CCB* victim = & cctx[(thief->id + i) % ncores];
+
+		/* A cheap check, before we touch the lock */
+		if(victim->ready_count == 0) 
+			continue;
+
+		if(! Mutex_TryLock(&victim->rq_lock))
+			continue;
+		TCB* tcb = rq_pop_allowed(victim, thief->id, 1);
+		Mutex_Unlock(&victim->rq_lock);
+
+		if(tcb != NULL)
+			return tcb;
 	}
+	return NULL;
+}
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[i]);
+/*
+  Remove the head of the local queue with maximum priority that may run
+  on this core, if any, and return it. If the local run queue is empty, return the current thread
+  if it is still READY (and not the idle thread) and may run here, else try 
+  to steal a thread from another core. Finally, return the idle thread.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	CCB* ccb = &CURCORE;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	Mutex_Lock(&ccb->rq_lock);
+	TCB* next_thread = rq_pop_allowed(ccb, ccb->id, 0);
+	Mutex_Unlock(&ccb->rq_lock);
+
+	if (next_thread == NULL && current->state == READY && current->type != IDLE_THREAD
+		&& (current->affinity & (1u << ccb->id)))
+		next_thread = current;
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = sched_steal(ccb);
 
-	next_thread->its = QUANTUM;
+	if (next_thread == NULL)
+		next_thread = &ccb->idle_thread;
+
+	/* Real-time threads with budget left run until the budget is used up,
+	   but no more than a top-level quantum, to share the core with each other */
+	if(next_thread->type == IDLE_THREAD)
+		next_thread->its = QUANTUM;
+	else if(next_thread->rt_left > 0)
+		next_thread->its = (next_thread->rt_left < sched_quantum[sched_levels-1]) 
+			? next_thread->rt_left : sched_quantum[sched_levels-1];
+	else
+		next_thread->its = sched_quantum[next_thread->priority];
 
 	return next_thread;
 }
 
+int set_thread_affinity(TCB* tcb, uint mask)
+{
+	if((mask & ((cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ~0u)) == 0)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->sched_lock);
+	tcb->affinity = mask;
+
+	/* A thread queued at an excluded core is queued again at an allowed one;
+	   the owning core would skip it, and thieves may never reach it. While we
+	   hold its sched_lock, only a pop can take the thread off its queue. */
+	uint stray = 0;
+	if(tcb != CURTHREAD && tcb->state == READY && tcb->phase == CTX_CLEAN) {
+		CCB* ccb = &cctx[tcb->rq_core];
+		Mutex_Lock(&ccb->rq_lock);
+		int queued = (tcb->sched_node.next != &tcb->sched_node);
+		int moved = queued && !(mask & (1u << ccb->id));
+		if(moved)
+			rq_remove(ccb, tcb);
+		Mutex_Unlock(&ccb->rq_lock);
+
+		if(moved)
+			sched_queue_add(tcb, 0);
+		else if(! queued)
+			/* Popped by some core, which may not have switched to it yet */
+			stray = ~mask;
+	}
+	else if(tcb != CURTHREAD && tcb->state == RUNNING)
+		stray = ~mask & (1u << tcb->last_core);
+	Mutex_Unlock(&tcb->sched_lock);
+
+	/* A remote core running the thread on an excluded core must reschedule */
+	stray &= (cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ~0u;
+	stray &= ~(1u << cpu_core_id);
+	for(; stray; stray &= stray-1)
+		cpu_ici(__builtin_ctz(stray));
+
+	/* Move away from this core, if needed */
+	if(tcb == CURTHREAD && !(mask & (1u << cpu_core_id)))
+		yield(SCHED_USER);
+
+	if(preempt)
+		preempt_on;
+	return 0;
+}
+
+int set_thread_realtime(TCB* tcb, TimerDuration budget, TimerDuration period)
+{
+	if(budget > 0 && (period == 0 || budget > period))
+		return -1;
+	if(budget == 0)
+		period = 0;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->sched_lock);
+
+	/* Admission control: replace the old reservation of the thread with the new one */
+	uint old = rt_utilization(tcb->rt_budget, tcb->rt_period);
+	uint new = rt_utilization(budget, period);
+	Mutex_Lock(&rt_lock);
+	int admit = (new <= rt_bandwidth && rt_load - old + new <= rt_bandwidth * cpu_cores());
+	if(admit)
+		rt_load = rt_load - old + new;
+	Mutex_Unlock(&rt_lock);
+
+	if(admit) {
+		tcb->rt_budget = budget;
+		tcb->rt_period = period;
+		/* The first period starts when the thread is next queued */
+		tcb->rt_deadline = 0;
+		tcb->rt_left = 0;
+	}
+	Mutex_Unlock(&tcb->sched_lock);
+
+	/* Requeue the current thread in its new class */
+	if(admit && tcb == CURTHREAD)
+		yield(SCHED_USER);
+
+	if(preempt)
+		preempt_on;
+	return admit ? 0 : -1;
+}
+
+/*
+  Priority inheritance.
+
+  The owner of a mutex inherits the priority of the threads sleeping on it
+  (see Mutex_Lock()). While a thread holds an inherited priority, its own 
+  priority is kept in pi_base, and the MLFQ adjustments of yield() apply 
+  to that instead. Inheritance is not transitive: if the owner itself sleeps 
+  on another mutex, it lends the priority it has at the time. When the owner
+  releases a contended mutex, it keeps the priority lent by the waiters of 
+  the mutexes it still holds (see Mutex_Unlock()).
+*/
+void sched_inherit_priority(TCB* owner, TCB* waiter)
+{
+	if(! sched_pi || owner->type == IDLE_THREAD)
+		return;
+
+	int preempt = preempt_off;
+	int priority = sched_lent_priority(waiter);
+
+	Mutex_Lock(&owner->sched_lock);
+	owner->pi_gen++;
+	if(owner->priority < priority) {
+		if(owner->pi_base < 0)
+			owner->pi_base = owner->priority;
+		owner->priority = priority;
+
+		/* A queued time-sharing owner moves up to its new level at once. Only 
+		   this core can pop it meanwhile, and only we can queue it. Its queue is
+		   told by rq_realtime, since rt_left may be reset while it is queued. */
+		if(owner->state == READY && owner->phase == CTX_CLEAN) {
+			CCB* ccb = &cctx[owner->rq_core];
+			Mutex_Lock(&ccb->rq_lock);
+			if(owner->sched_node.next != &owner->sched_node && !owner->rq_realtime) {
+				mlfq* q = sched_fair ? &fair_group(ccb, owner->owner_pcb)->queue : &ccb->ready_queue;
+				int level = mlfq_remove(q, owner);
+				if(level > priority)
+					owner->priority = level;
+				mlfq_push(q, owner);
+			}
+			Mutex_Unlock(&ccb->rq_lock);
+		}
+	}
+	Mutex_Unlock(&owner->sched_lock);
+
+	if(preempt)
+		preempt_on;
+}
+
+int sched_lent_priority(TCB* waiter)
+{
+	return (waiter->rt_left > 0) ? (int)sched_levels-1 : waiter->priority;
+}
+
+int sched_restore_priority(TCB* tcb, int lent, uint gen)
+{
+	if(tcb->pi_base < 0)
+		return 1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->sched_lock);
+	int done = (tcb->pi_gen == gen);
+	if(done && tcb->pi_base >= 0) {
+		if(lent > tcb->pi_base)
+			tcb->priority = lent;
+		else {
+			tcb->priority = tcb->pi_base;
+			tcb->pi_base = -1;
+		}
+	}
+	Mutex_Unlock(&tcb->sched_lock);
+
+	if(preempt)
+		preempt_on;
+	return done;
+}
+
+_Static_assert(SCHED_CAUSES == THREADINFO_CAUSES, "threadinfo does not match enum SCHED_CAUSE");
+
+void get_thread_info(TCB* tcb, threadinfo* info)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->sched_lock);
+
+	info->level = tcb->priority;
+	info->last_core = tcb->last_core;
+	info->run_time = tcb->run_time;
+	info->ready_time = tcb->ready_time;
+	for(int i=0; i<SCHED_CAUSES; i++)
+		info->blocked_time[i] = tcb->blocked_time[i];
+	info->vol_switches = tcb->vol_switches;
+	info->invol_switches = tcb->invol_switches;
+
+	/* Add the time spent in the current state */
+	TimerDuration elapsed = (tcb->state == INIT) ? 0 : bios_clock() - tcb->state_time;
+	switch(tcb->state) {
+	case RUNNING:
+		info->state = THREADINFO_RUNNING;
+		info->run_time += elapsed;
+		break;
+	case INIT:
+	case READY:
+		info->state = THREADINFO_READY;
+		info->ready_time += elapsed;
+		break;
+	default:
+		info->state = THREADINFO_BLOCKED;
+		info->blocked_time[tcb->block_cause] += elapsed;
+	}
+
+	Mutex_Unlock(&tcb->sched_lock);
+	if(preempt)
+		preempt_on;
+}
+
 /*
   Make the process ready.
  */
@@ -396,14 +1495,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->sched_lock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -414,6 +1513,9 @@ int wakeup(TCB* tcb)
 
 /*
   Atomically put the current process to sleep, after unlocking mx.
+
+  Note that the thread's new state is set before mx is unlocked. Therefore,
+  any thread that locks mx afterwards and wakes us up, will find us STOPPED.
  */
 void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	TimerDuration timeout)
@@ -423,7 +1525,14 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->sched_lock);
+
+	/* account for the time the thread ran */
+	TimerDuration curtime = bios_clock();
+	tcb->run_time += curtime - tcb->state_time;
+	fair_charge(tcb, curtime - tcb->state_time);
+	tcb->state_time = curtime;
+	tcb->block_cause = cause;
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -432,13 +1541,12 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
+	Mutex_Unlock(&tcb->sched_lock);
+
 	/* Release mx */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -448,18 +1556,62 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 }
 
 /*
-	Boost threads function.
+	Age the run queue of the given core, if the aging period has passed
+	since it was last aged. The current time is given by the caller.
 */ 
-void boost_threads()
+static void sched_age(CCB* ccb, TimerDuration curtime)
+{
+	if(curtime - ccb->last_aging < sched_aging)
+		return;
+
+	Mutex_Lock(&ccb->rq_lock);
+	rq_age(ccb);
+	ccb->last_aging = curtime;
+	Mutex_Unlock(&ccb->rq_lock);
+}
+
+/*
+  Return 1 if there is a ready thread in the run queue of any core.
+  Since this is only a heuristic, no locks are taken.
+*/
+static int sched_ready_anywhere()
+{
+	for(uint c=0; c<cpu_cores(); c++)
+		if(cctx[c].ready_count > 0)
+			return 1;
+	return 0;
+}
+
+/*
+  Program the timer of the current core, in tickless mode.
+
+  The idle thread, and a thread which is the only runnable thread
+  (unless it runs in the real-time class), do not need a quantum; the timer is armed only for the next 
+  event of the timer wheel, if any. Then quantum_off is set, so that other
+  cores send an ICI when they queue a thread here. This covers the idle
+  thread too: a thread queued after it checks ready_count, but before the
+  core halts, would else wait for the next timer event.
+*/
+static void sched_set_tickless_timer(TCB* current)
 {
-  for (int i = PRIORITY_QUEUES - 1; i >0; i--) {
-    while(!is_rlist_empty(&SCHED[i-1])){
-      rlnode* node = rlist_pop_front(&SCHED[i-1]);
-      node->tcb->priority++;
-      rlist_push_back(&SCHED[i],node);
-      }
-    }
+	CCB* ccb = &CURCORE;
+
+	/* Real-time threads need the timer to enforce their budget */
+	if(current->type != IDLE_THREAD && (current->rt_left > 0 || sched_ready_anywhere())) {
+		bios_set_timer(current->rts);
+		return;
+	}
+
+	Mutex_Lock(&timeout_spinlock);
+	TimerDuration next = timer_next_event();
+	Mutex_Unlock(&timeout_spinlock);
 
+	ccb->quantum_off = 1;
+
+	if(next != NO_TIMEOUT) {
+		TimerDuration curtime = bios_clock();
+		bios_set_timer( (next > curtime) ? next - curtime : TIMER_TICK );
+	}
 }
 
 /* This function is the entry point to the scheduler's context switching */
@@ -472,44 +1624,62 @@ void yield(enum SCHED_CAUSE cause)
 	int preempt = preempt_off;
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* ccb = &CURCORE;
 
-	Mutex_Lock(&sched_spinlock);
+	/* The timer is off now */
+	ccb->quantum_off = 0;
 
-	//increase the counter of yield calls
-	yield_calls ++ ;
-	
-	//periodically boost all threads
-	if (yield_calls == N){
-		boost_threads();
-		yield_calls = 0; //resets the yield calls counter
-	}
+	TimerDuration curtime = bios_clock();
+
+	//periodically age all threads of this core
+	sched_age(ccb, curtime);
 	
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
+	/* Update CURTHREAD state. 
+	   Other cores do not touch the state of a RUNNING thread, hence no locking is
+	   needed (but see the priority adjustment below). 
+	   A thread that goes to sleep has been accounted for by sleep_releasing(). */
+	if (current->state == RUNNING) {
 		current->state = READY;
+		current->run_time += curtime - current->state_time;
+		fair_charge(current, curtime - current->state_time);
+		current->state_time = curtime;
+	}
+
+	/* Charge a real-time thread for its time in the real-time class.
+	   Its timer was armed with its time-slice in gain(). */
+	int rt_slice = (current->rt_left > 0);
+	if (rt_slice) {
+		TimerDuration used = (remaining < current->its) ? current->its - remaining : 0;
+		current->rt_left = (used < current->rt_left) ? current->rt_left - used : 0;
+	}
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-	//adjusting priority
-  switch(cause) {
+	//adjusting priority, except after time in the real-time class.
+	//An inherited priority is not adjusted, but the thread's own is.
+	//Other cores may lend a priority to the thread meanwhile, under its sched_lock.
+  Mutex_Lock(&current->sched_lock);
+  int* level = (current->pi_base >= 0) ? &current->pi_base : &current->priority;
+  switch(rt_slice ? SCHED_USER : cause) {
     case SCHED_QUANTUM:
-    	if(current->priority > 0)
-      	current->priority--;        
-    	break;
+      if(*level > 0)
+        (*level)--;
+      break;
     case SCHED_IO:
-      if(current->priority < (PRIORITY_QUEUES-1))
-        current->priority++;
+      if(*level < (sched_levels-1))
+        (*level)++;
       break;       
     case SCHED_MUTEX:
-      if(current->curr_cause == current->last_cause && current->priority > 0)
-        current->priority--;
+      if(current->curr_cause == current->last_cause && *level > 0)
+        (*level)--;
       break;
     default:
         break;
   }
+  Mutex_Unlock(&current->sched_lock);
 
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
@@ -519,13 +1689,22 @@ void yield(enum SCHED_CAUSE cause)
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
+	ccb->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		if (current->type != IDLE_THREAD) {
+			if (cause == SCHED_QUANTUM || cause == SCHED_PREEMPT)
+				current->invol_switches++;
+			else
+				current->vol_switches++;
+		}
+		if (next->type != IDLE_THREAD) {
+			next->ready_time += curtime - next->state_time;
+			next->state_time = curtime;
+		}
+
+		set_current_thread(ccb, next);
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -551,11 +1730,11 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
-	/* Mark current state */
+	/* Mark current state. The current thread was READY and is not 
+	   in any queue, so no other core will touch it. */
+	current->last_core = cpu_core_id;
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
@@ -563,30 +1742,36 @@ void gain(int preempt)
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		Mutex_Lock(&prev->sched_lock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, 0);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Mutex_Unlock(&prev->sched_lock);
+
+		if (prev_state == EXITED)
+			release_TCB(prev);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Set a 1-quantum alarm, or program the timer for tickless mode.
+	   This is done before preemption is restored, since it touches the CCB. */
+	if (sched_tickless)
+		sched_set_tickless_timer(current);
+	else
+		bios_set_timer(current->rts);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -596,7 +1781,12 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* Do not halt if some thread was queued here while we were yielding. 
+		   The fence orders the check after setting quantum_off, as the one 
+		   in sched_queue_add() orders the check of quantum_off after the push. */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (CURCORE.ready_count == 0)
+			cpu_core_halt();
 		yield(SCHED_IDLE);
 	}
 
@@ -606,15 +1796,76 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
-void initialize_scheduler()
+void initialize_scheduler(const boot_options* options)
 {
-	yield_calls = 0 ;
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	/* Set the scheduler parameters */
+	sched_levels = options->sched_levels;
+	if(sched_levels == 0)
+		sched_levels = DEFAULT_SCHED_LEVELS;
+	if(sched_levels > PRIORITY_QUEUES)
+		sched_levels = PRIORITY_QUEUES;
+
+	for(uint i=0; i<sched_levels; i++) {
+		sched_quantum[i] = options->sched_quantum[i];
+		if(sched_quantum[i] == 0)
+			sched_quantum[i] = QUANTUM << ((sched_levels-1-i)/4);
+	}
+
+	sched_aging = options->sched_aging;
+	if(sched_aging == 0)
+		sched_aging = DEFAULT_SCHED_AGING;
+
+	sched_tickless = options->tickless;
+
+	if (options->thread_cache < 0)
+		thread_cache_limit = 0;
+	else if (options->thread_cache == 0)
+		thread_cache_limit = DEFAULT_THREAD_CACHE;
+	else
+		thread_cache_limit = options->thread_cache;
+
+	sched_fair = options->fair_share;
+	sched_wakeup_preempt = ! options->no_wakeup_preempt;
+	sched_pi = ! options->no_priority_inheritance;
+
+	rt_bandwidth = options->rt_bandwidth;
+	if(rt_bandwidth == 0)
+		rt_bandwidth = DEFAULT_RT_BANDWIDTH;
+	if(rt_bandwidth > 100)
+		rt_bandwidth = 100;
+	rt_bandwidth *= 10;	/* to permille */
+	rt_load = 0;
+
+	/* Initialize the run queues */
+	TimerDuration curtime = bios_clock();
+	for(int c=0; c<MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->rq_lock = MUTEX_INIT;
+		rlnode_init(&ccb->rt_queue, NULL);
+		mlfq_init(&ccb->ready_queue);
+		rlnode_init(&ccb->groups, NULL);
+		rlnode_init(&ccb->free_groups, NULL);
+		ccb->min_vruntime = 0;
+		ccb->ready_count = 0;
+		ccb->last_aging = curtime;
+		ccb->quantum_off = 0;
+		ccb->preempt_pending = 0;
+		rlnode_init(&ccb->thread_cache, NULL);
+		ccb->thread_cache_size = 0;
+	}
+	/* Initialize the timer wheel */
+	for(int l=0; l<TIMER_LEVELS; l++) {
+		for(int i=0; i<TIMER_SLOTS; i++)
+			rlnode_init(&TW.slot[l][i], NULL);
+		TW.occupied[l] = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	rlnode_init(&TW.expired, NULL);
+	TW.now = curtime / TIMER_TICK;
+	TW.count = 0;
+	TW.stats = (timer_stats){ 0 };
 }
 
 void run_scheduler()
@@ -624,13 +1875,15 @@ void run_scheduler()
 	/* Initialize current CCB */
 	curcore->id = cpu_core_id;
 
-	curcore->current_thread = &curcore->idle_thread;
-
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
+	set_current_thread(curcore, &curcore->idle_thread);
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.pi_base = -1;
+	curcore->idle_thread.pi_gen = 0;
+	curcore->idle_thread.sched_lock = MUTEX_INIT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -649,6 +1902,8 @@ void run_scheduler()
 
 	/* Finished scheduling */
 	assert(CURTHREAD == &CURCORE.idle_thread);
+	thread_cache_drain();
+	fair_groups_drain();
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
\ No newline at end of file
@@ -83,6 +83,7 @@ typedef enum {
  */
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
+	SCHED_PREEMPT, /**< @brief A thread of higher priority was woken up */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
 	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
@@ -91,6 +92,9 @@ enum SCHED_CAUSE {
 	SCHED_USER /**< @brief User-space code called yield */
 };
 
+/** @brief The number of different values of @c enum SCHED_CAUSE */
+#define SCHED_CAUSES (SCHED_USER+1)
+
 /**
   @brief The thread control block
 
@@ -114,6 +118,24 @@ typedef struct thread_control_block {
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
+	Mutex sched_lock; /**< @brief Spinlock protecting @c state, @c phase and @c wakeup_time */
+
+	size_t stack_size; /**< @brief The size of the thread's stack, which lies just below the TCB */
+
+	uint affinity; /**< @brief Bitmask of the cores this thread may run on */
+	uint last_core; /**< @brief The core this thread last ran on */
+	uint rq_core; /**< @brief The core at whose run queue the thread was last queued */
+	int rq_realtime; /**< @brief Set if the thread was last queued in the real-time queue of @c rq_core */
+
+	int pi_base; /**< @brief While the thread has inherited the priority of a mutex waiter, its own priority, else -1 */
+	uint pi_gen; /**< @brief Counts the priorities lent to the thread, see @ref sched_restore_priority */
+
+	/* Real-time class */
+	TimerDuration rt_budget; /**< @brief CPU time per period in the real-time class, or 0 for time-sharing */
+	TimerDuration rt_period; /**< @brief The real-time period */
+	TimerDuration rt_deadline; /**< @brief The end of the current real-time period */
+	TimerDuration rt_left; /**< @brief The budget left in the current period */
+
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
@@ -121,6 +143,15 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	/* Accounting */
+	TimerDuration state_time; /**< @brief When the thread last started running, waiting in a run queue, or blocking */
+	enum SCHED_CAUSE block_cause; /**< @brief The cause of the last sleep */
+	TimerDuration run_time; /**< @brief Total time spent running */
+	TimerDuration ready_time; /**< @brief Total time spent in run queues */
+	TimerDuration blocked_time[SCHED_CAUSES]; /**< @brief Total time spent blocked, per cause */
+	unsigned long vol_switches; /**< @brief Number of context switches caused by the thread */
+	unsigned long invol_switches; /**< @brief Number of context switches due to preemption */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -153,6 +184,8 @@ typedef struct process_thread_control_block {
 
   int ref_count; 
 
+  Tid_t tid;   /**< @brief The handle of the thread in its process' thread table */
+
   rlnode ptcb_list_node; 
 
 } PTCB;
@@ -165,23 +198,105 @@ typedef struct process_thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The minimum stack size of a thread. */
+#define MIN_THREAD_STACK_SIZE (16 * 1024)
+
+/** @brief The maximum stack size of a thread. */
+#define MAX_THREAD_STACK_SIZE (64 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The maximum number of priority levels of the scheduler. 
+
+  The number of levels actually used is set at boot time (see @c boot_options).
+  Level 0 is the lowest priority.
+ */
+#define PRIORITY_QUEUES MAX_SCHED_LEVELS
+
+/** @brief The default number of priority levels of the scheduler. */
+#define DEFAULT_SCHED_LEVELS 10
+
+/** @brief The default size of the per-core cache of free thread blocks. */
+#define DEFAULT_THREAD_CACHE 16
+
+/** @brief The default aging period of the scheduler, in usec. */
+#define DEFAULT_SCHED_AGING (200000L)
+
+/** @brief The default percentage of the CPU time that real-time threads may reserve. */
+#define DEFAULT_RT_BANDWIDTH 90
+
+/** @brief A multi-level run queue.
+
+  There is one list of ready threads per priority level, and a bitmap of 
+  the non-empty lists, so that the highest-priority thread is found in 
+  constant time.
+ */
+typedef struct mlfq {
+	rlnode list[PRIORITY_QUEUES]; /**< @brief One list per priority level */
+	uint32_t levels; /**< @brief Bit i is set iff @c list[i] is not empty */
+} mlfq;
+
+/** @brief The ready threads of one process at one core, in fair-share mode. 
+
+  @see boot_options
+ */
+typedef struct sched_group {
+	PCB* pcb; /**< @brief The process of the threads */
+	mlfq queue; /**< @brief The ready threads of the process at this core */
+	uint count; /**< @brief The number of threads in @c queue */
+	rlnode node; /**< @brief Node in the list of active or free groups of the core */
+} sched_group;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a multi-level run queue. Threads made ready are queued
+  at the core that made them ready, and a halted core is restarted. A core whose
+  run queue is empty will try to steal a thread from the run queue of some 
+  other core, before it goes idle.
+
+  A bitmap of the non-empty levels of the run queue allows the scheduler to 
+  select the next thread in constant time. Every aging period, all lists of 
+  the run queue are moved up by one level, in time proportional to the number 
+  of levels. The @c priority field of a thread in the run queue may therefore be 
+  stale; it is corrected when the thread is removed from the run queue.
+
+  In fair-share mode, the run queue of a core is split into groups, one for 
+  each process with ready threads at the core. The scheduler first selects
+  the group whose process has received the least weighted CPU time, and then
+  the thread with the highest priority in the group.
+
+  Real-time threads with budget left are kept in a separate list, ordered by 
+  deadline, which is served before the rest of the run queue.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
 
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
+	void* current_stack; /**< @brief The base of the stack of @c current_thread */
+	uint switch_seq; /**< @brief Odd while @c current_thread and @c current_stack are changed */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex rq_lock; /**< @brief Spinlock protecting the run queue of this core */
+	rlnode rt_queue; /**< @brief The real-time threads of the run queue, by deadline */
+	mlfq ready_queue; /**< @brief The run queue (not used in fair-share mode) */
+	rlnode groups; /**< @brief The groups with ready threads (fair-share mode) */
+	rlnode free_groups; /**< @brief Empty groups, kept for reuse (fair-share mode) */
+	TimerDuration min_vruntime; /**< @brief The virtual runtime of the last group selected (fair-share mode) */
+	volatile uint ready_count; /**< @brief Number of threads in the run queue */
+	TimerDuration last_aging; /**< @brief The time the run queue was last aged */
+	int quantum_off; /**< @brief Flag that the current thread, or the idle thread, runs without a quantum timer (tickless mode) */
+	int preempt_pending; /**< @brief Flag that a thread of higher priority was queued here by another core */
+
+	rlnode thread_cache; /**< @brief Free thread blocks, kept for reuse by @c spawn_thread */
+	uint thread_cache_size; /**< @brief Number of blocks in @c thread_cache */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -194,7 +309,10 @@ extern CCB cctx[MAX_CORES];
   This function returns the TCB of the calling thread. Via this function,
   a system call can identify the process executing it, and all other information.
 
-  For performance reasons, it is advised to call this function
+  This does not disable preemption; on a thread's own stack, it reads the 
+  current thread of its core without locks, and checks that the stack 
+  pointer is within the thread's stack, in case the thread has migrated
+  in the meantime. Still, it is advised to call this function
   only once in each system call.
 
   @returns a pointer to the TCB of the caller.
@@ -229,9 +347,11 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread's stack, or 0 for @c THREAD_STACK_SIZE.
+                It is rounded up to a multiple of the page size.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 
 ////
@@ -248,13 +368,60 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread's stack, or 0 for @c THREAD_STACK_SIZE.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-PTCB* spawn_process_thread(PCB* pcb, void (*func)());
+PTCB* spawn_process_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 PTCB* acquire_PTCB();
 
+/** @brief Free a PTCB allocated by @c acquire_PTCB */
+void release_PTCB(PTCB* ptcb);
+
+
+
+/**
+  @brief Set the CPU affinity of a thread.
+
+  The thread will only run on cores whose bit is set in @c mask. 
+  Bits of non-existent cores are ignored. If the current thread excludes 
+  its current core, it yields, so that it moves to an allowed core. Another
+  thread queued at an excluded core is queued again at an allowed one, and
+  an excluded core running it is sent an ICI, so that it reschedules.
+
+  @param tcb the thread
+  @param mask the new affinity mask
+  @returns 0 on success, or -1 if @c mask does not contain any existing core
+ */
+int set_thread_affinity(TCB* tcb, uint mask);
 
+/**
+  @brief Move a thread into, or out of, the real-time class.
+
+  A real-time thread may run ahead of all time-sharing threads for 
+  @c budget usec in every @c period usec. Its first period starts
+  when it is next queued; if it is the current thread, it yields.
+
+  @param tcb the thread
+  @param budget the budget per period, in usec, or 0 to return to time-sharing
+  @param period the period, in usec
+  @returns 0 on success, or -1 if the parameters are invalid, or 
+     the reservation would exceed the real-time bandwidth
+  @see SetRealTime
+ */
+int set_thread_realtime(TCB* tcb, TimerDuration budget, TimerDuration period);
+
+/**
+  @brief Take a snapshot of the scheduler accounting of a thread.
+
+  The time spent in the current state of the thread, up to now,
+  is included in the snapshot. The @c pid and @c tid fields of @c info
+  are not touched.
+
+  @param tcb the thread
+  @param info the snapshot is stored here
+ */
+void get_thread_info(TCB* tcb, threadinfo* info);
 
 /**
   @brief Wakeup a blocked thread.
@@ -300,6 +467,40 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Lend the priority of a thread to the owner of a mutex it waits for.
+
+  The priority of @c owner is raised to that of @c waiter, if it is lower,
+  and a queued @c owner is moved to its new level. A real-time @c waiter
+  lends the top level. The owner keeps the raised priority until it calls
+  @ref sched_restore_priority.
+
+  This is called by @c Mutex_Lock, before the waiter sleeps. It does nothing,
+  if priority inheritance is disabled in the @c boot_options.
+*/
+void sched_inherit_priority(TCB* owner, TCB* waiter);
+
+/**
+  @brief The priority that a thread lends to the owner of a mutex it waits for.
+*/
+int sched_lent_priority(TCB* waiter);
+
+/**
+  @brief Drop a priority inherited by @ref sched_inherit_priority.
+
+  This is called by @c Mutex_Unlock, when the owner releases a mutex that
+  other threads wait for. The priority of @c tcb becomes the higher of its 
+  own and @c lent, the highest priority lent by the waiters of the mutexes 
+  that it still holds (or -1). 
+
+  The caller finds @c lent without locking @c tcb, so a priority may be lent
+  meanwhile. Therefore, it reads @c tcb->pi_gen before it looks, and passes
+  it as @c gen. If a priority has been lent since, nothing is changed.
+
+  @returns 0 if the caller must look for @c lent again, else 1.
+*/
+int sched_restore_priority(TCB* tcb, int lent, uint gen);
+
 /**
   @brief Give up the CPU.
 
@@ -322,13 +523,35 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param options the boot options, used to set the scheduler's parameters
+ */
+void initialize_scheduler(const boot_options* options);
+
+/**
+  @brief Counters of the scheduler's timer wheel.
+
+  @see get_timer_stats
+ */
+typedef struct timer_stats {
+	unsigned long inserts;	/**< @brief Number of timeouts registered */
+	unsigned long cancels;	/**< @brief Number of timeouts cancelled by a wakeup */
+	unsigned long expires;	/**< @brief Number of timeouts that expired */
+	unsigned long cascades;	/**< @brief Number of moves of a timeout to a lower level */
+} timer_stats;
+
+/**
+  @brief Get the counters of the scheduler's timer wheel.
+
+  The timeouts of sleeping threads (see @c sleep_releasing) are kept in
+  a hierarchical timer wheel, with O(1) insertion and cancellation.
  */
-void initialize_scheduler(void);
+void get_timer_stats(timer_stats* stats);
 
 /**
   @brief Quantum (in microseconds) 
 
-  This is the default quantum for each thread, in microseconds.
+  This is the default quantum for the highest priority levels, in microseconds.
   */
 #define QUANTUM (10000L)
 
@@ -2,12 +2,22 @@
 #include "kernel_socket.h"
 #include "kernel_pipe.h"
 #include "kernel_cc.h"
+#include "kernel_mem.h"
 
 
+/* Protects port_map. A listener is installed and removed holding both
+   this (for writing) and its own lock, so either one is enough to read 
+   its entry. */
+RWLock port_lock = RWLOCK_INIT;
+
+
+static kmem_cache socket_cache = KMEM_CACHE_INIT("socket_cb", socket_cb);
+static kmem_cache request_cache = KMEM_CACHE_INIT("connection_request", connection_request);
+
 /*the following function is used to allocate memory 
   for a socket_cb structure */
 socket_cb* acquire_socket_cb(){
-	return (socket_cb*)xmalloc(sizeof(socket_cb));
+	return (socket_cb*)kmem_alloc(&socket_cache);
 }
 
 
@@ -15,29 +25,62 @@ socket_cb* acquire_socket_cb(){
 /*the following function is used to allocate memory 
   for a connection_request structure */
 connection_request* acquire_request(){
-	return (connection_request*)xmalloc(sizeof(connection_request));
+	return (connection_request*)kmem_alloc(&request_cache);
 }
 
 
-/*function to decrease refcount of the given @socket_CB socket. 
+/*function to decrease refcount of the given @socket_CB socket, whose
+  lock must be held, and unlock it.
   if refcount drops below 0 the socket "is not usefull" anymore, 
   so we free the socket.*/
-void decref(socket_cb* socket_CB){
-    socket_CB->refcount--;
-    if(socket_CB->refcount < 0)
-        free(socket_CB);
+void decref_unlock(socket_cb* socket_CB){
+    int unused = (--socket_CB->refcount < 0);
+    Mutex_Unlock(&socket_CB->lock);
+    if(unused)
+        kmem_free(&socket_cache, socket_CB);
+}
+
+
+/*drop a reference returned by get_socketcb()*/
+static void socket_put(socket_cb* socket_CB){
+    Mutex_Lock(&socket_CB->lock);
+    decref_unlock(socket_CB);
 }
 
 
+static file_ops socket_file_ops;
 
-/*using @fid we find the corresponding FCB and return its stream socket.
-  This function basically returns a reference to the desired socket_cb*/
+/*using @fid we find the corresponding FCB and return its stream socket,
+  or NULL if @fid is not a socket.
+  This function basically returns a reference to the desired socket_cb,
+  which keeps it alive after a concurrent Close(); drop it with socket_put().*/
 socket_cb* get_socketcb(Fid_t fid) {
 	FCB* fcb = get_fcb(fid); 
 	if(fcb == NULL) {
 		return NULL;
 	}
-	return fcb->streamobj;
+
+	socket_cb* socket_t = NULL;
+	if(fcb->streamfunc == &socket_file_ops) {
+		socket_t = fcb->streamobj;
+		Mutex_Lock(&socket_t->lock);
+		socket_t->refcount++;
+		Mutex_Unlock(&socket_t->lock);
+	}
+	FCB_decref(fcb);
+	return socket_t;
+}
+
+
+/*the pipe used by a peer socket in one direction, or NULL */
+static pipe_cb* socket_pipe(socket_cb* socket_t, int write)
+{
+    pipe_cb* pipe = NULL;
+    Mutex_Lock(&socket_t->lock);
+    if(socket_t->type == SOCKET_PEER)
+        pipe = write ? socket_t->peer_s.write_pipe : socket_t->peer_s.read_pipe;
+    Mutex_Unlock(&socket_t->lock);
+    return pipe;
 }
 
 
@@ -52,11 +95,9 @@ int socket_read(void* sock, char *buf, unsigned int size) {
     
     if (sock == NULL){return -1;} 
     
-    if(socket->type != SOCKET_PEER){return -1;} 
-    
-    if(socket->peer_s.read_pipe == NULL){return -1;}
-  
-    pipe_cb* pipe_cb = socket->peer_s.read_pipe;
+    pipe_cb* pipe_cb = socket_pipe(socket, 0);
+
+    if(pipe_cb == NULL){return -1;}
 
     return pipe_read(pipe_cb, buf, size);
 }
@@ -72,11 +113,9 @@ int socket_write(void* socket_t, const char *buf, unsigned int size) {
     
     if (socket_t == NULL){return -1;}
 
-    if( scb->type != SOCKET_PEER) {return -1;}
-
-    if(scb->peer_s.write_pipe == NULL){return -1;}
+    pipe_cb* pipe_cb = socket_pipe(scb, 1);
 
-    pipe_cb* pipe_cb = scb->peer_s.write_pipe;
+    if(pipe_cb == NULL){return -1;}
 
     return pipe_write(pipe_cb, buf, size);
 }
@@ -90,24 +129,46 @@ int socket_close(void* socket){
 
     //doing the needed casting to get a pointer to socket_cb struct
     socket_cb* socket_t = (socket_cb *) socket;
+    pipe_cb* write_pipe = NULL;
+    pipe_cb* read_pipe = NULL;
+
+    /* Only a listener, or an unbound socket that may become one, is in 
+       port_map; peers do not need port_lock */
+    int port_locked = 0;
+    Mutex_Lock(&socket_t->lock);
+    if(socket_t->type != SOCKET_PEER) {
+        Mutex_Unlock(&socket_t->lock);
+        RWLock_WriteLock(&port_lock);
+        port_locked = 1;
+        Mutex_Lock(&socket_t->lock);
+    }
 
     switch (socket_t->type){
         case SOCKET_PEER:
-            pipe_writer_close(socket_t->peer_s.write_pipe);
-            pipe_reader_close(socket_t->peer_s.read_pipe);
+            write_pipe = socket_t->peer_s.write_pipe;
+            read_pipe = socket_t->peer_s.read_pipe;
+            socket_t->peer_s.write_pipe = NULL;
+            socket_t->peer_s.read_pipe = NULL;
             break;
         case SOCKET_LISTENER:
+            port_map[socket_t->port] = NULL;
+            /* Fail the pending requests; each connector frees its own */
             while(!is_rlist_empty(&(socket_t->listener_s.queue))){
-                rlnode_ptr node = rlist_pop_front(&(socket_t->listener_s.queue));
-                free(node);
+                connection_request* req = rlist_pop_front(&(socket_t->listener_s.queue))->cr;
+                kernel_signal(&req->connected_cv);
             }
-            kernel_signal(&(socket_t->listener_s.req_available));//could be signal
-            port_map[socket_t->port] = NULL;
+            kernel_broadcast(&(socket_t->listener_s.req_available));
             break;
         case SOCKET_UNBOUND:
             break;  
     }
-	decref(socket_t);
+    if(port_locked)
+        RWLock_WriteUnlock(&port_lock);
+    decref_unlock(socket_t);
+
+    /* The pipes lock themselves */
+    if(write_pipe) pipe_writer_close(write_pipe);
+    if(read_pipe) pipe_reader_close(read_pipe);
     
     return 0;
 }
@@ -124,14 +185,10 @@ static file_ops socket_file_ops={
 
 
 /*
-This function returns a file descriptor for a new
-socket object bound on a port, or NOFILE on error.*/
-Fid_t sys_Socket(port_t port)
+Reserve a fid and a new unbound socket on @port for it. The socket is
+returned in @socket, and becomes visible once passed to FCB_open(). */
+static Fid_t socket_reserve(port_t port, socket_cb** socket)
 {
-	//Checks if the port number is valid 
-	if(port > MAX_PORT || port < 0)
-		return NOFILE;
-
 	Fid_t fd;            
 	FCB* fcb;
 
@@ -141,13 +198,32 @@ Fid_t sys_Socket(port_t port)
 	socket_cb* socket_t = acquire_socket_cb(); 
 
 	//Initializes the socket control block attributes
-	fcb->streamobj = socket_t;
-	fcb->streamfunc = &socket_file_ops;
+	socket_t->lock = MUTEX_INIT;
 	socket_t->fcb = fcb;
 	socket_t->type = SOCKET_UNBOUND;
 	socket_t->port = port; 
 	socket_t->refcount = 0;
 
+	*socket = socket_t;
+	return fd; 
+}
+
+
+/*
+This function returns a file descriptor for a new
+socket object bound on a port, or NOFILE on error.*/
+Fid_t sys_Socket(port_t port)
+{
+	//Checks if the port number is valid 
+	if(port > MAX_PORT || port < 0)
+		return NOFILE;
+
+	socket_cb* socket_t;
+	Fid_t fd = socket_reserve(port, &socket_t);
+
+	if(fd != NOFILE)
+		FCB_open(socket_t->fcb, socket_t, &socket_file_ops);
+
 	return fd; 
 }
 
@@ -161,32 +237,39 @@ int sys_Listen(Fid_t sock)
 	if(socketcb_t == NULL)
 		return -1; 
 
+	int retval = -1;
+
+	RWLock_WriteLock(&port_lock);
+	Mutex_Lock(&socketcb_t->lock);
+
 	//getting sockets port and checking if its bound to a port.
 	port_t port = socketcb_t->port;
 
 	if(port == NOPORT)
-		return -1;
-
+		goto finish;
 
 	if(port_map[port] != NULL)
-		return -1; 
+		goto finish;
 
 	//check if its peer or listener 
 	//(only an unbound socket can be marked as listener later on)
 	if(socketcb_t->type != SOCKET_UNBOUND)
-		return -1;
-
-
-	//installing the socket to the port_map 
-	port_map[port] = socketcb_t;
+		goto finish;
 
 	//marking it as SOCKET_LISTENER 
 	socketcb_t->type = SOCKET_LISTENER;
 	socketcb_t->listener_s.req_available = COND_INIT;
 
   	rlnode_init(&socketcb_t->listener_s.queue, NULL);
-	
-	return 0;
+
+	//installing the socket to the port_map 
+	port_map[port] = socketcb_t;
+	retval = 0;
+
+finish:
+	RWLock_WriteUnlock(&port_lock);
+	decref_unlock(socketcb_t);
+	return retval;
 }
 
 
@@ -200,20 +283,23 @@ Fid_t sys_Accept(Fid_t lsock)
 	//(see tinyos.h file)
 	if(listener_socket == NULL) {return NOFILE;}
 
-	if(listener_socket->type != SOCKET_LISTENER) {return NOFILE;}
-
-	if(port_map[listener_socket->port] == NULL) {return NOFILE;}
+	/* The listener lock is held throughout, except while waiting */
+	Mutex_Lock(&listener_socket->lock);
 
-	listener_socket->refcount++;
+	if(listener_socket->type != SOCKET_LISTENER
+		|| port_map[listener_socket->port] != listener_socket) {
+		decref_unlock(listener_socket);
+		return NOFILE;
+	}
 
 	while (is_rlist_empty(&listener_socket->listener_s.queue) 
-			&& port_map[listener_socket->port] != NULL)
+			&& port_map[listener_socket->port] == listener_socket)
 	{
-		kernel_wait(&listener_socket->listener_s.req_available, SCHED_IO);
+		kernel_wait(&listener_socket->lock, &listener_socket->listener_s.req_available, SCHED_IO);
 	}
 
-	if(port_map[listener_socket->port] == NULL) {
-		decref(listener_socket);
+	if(port_map[listener_socket->port] != listener_socket) {
+		decref_unlock(listener_socket);
 		return NOFILE;
 	}
 
@@ -224,37 +310,21 @@ Fid_t sys_Accept(Fid_t lsock)
 	//get the client_peer socket (exist in req)
     socket_cb* client_peer = req->peer;
 
-    //server socket's Fid_t (this server socket is peer to the client socket)
-	Fid_t server_fid = sys_Socket(listener_socket->port);
+    //server socket's Fid_t (this server socket is peer to the client socket).
+    //It stays invisible to other threads until it is fully set up.
+    socket_cb* server_peer;
+	Fid_t server_fid = socket_reserve(listener_socket->port, &server_peer);
 
 	if(server_fid == NOFILE) {		
-		listener_socket->refcount--; 
 		kernel_signal(&(req->connected_cv));
-		if (listener_socket->refcount < 0) {
-        	free(listener_socket);
-		}
+		decref_unlock(listener_socket);
 		return NOFILE;
 	}
 
-    socket_cb* server_peer = get_socketcb(server_fid); 
-
     //constructing the pipes used for communication
 	pipe_cb* pipe1 = acquire_pipe_cb();
 	pipe_cb* pipe2 = acquire_pipe_cb(); 
 
-	//needed initializations for the pipes: 	
-    pipe1->w_position = 0;
-	pipe1->r_position = 0;
-
-	pipe1->has_space = COND_INIT;
-	pipe1->has_data = COND_INIT;
-
-	pipe2->w_position = 0;
-	pipe2->r_position = 0;
-	
-	pipe2->has_space = COND_INIT;
-	pipe2->has_data = COND_INIT;
-
 	//mark pipe1's reader and writer FCBs 
 	pipe1->reader = client_peer->fcb; //pipe1 reads from client's fcb
 	pipe1->writer = server_peer->fcb; //pipe1 writes to server's fcb
@@ -269,17 +339,22 @@ Fid_t sys_Accept(Fid_t lsock)
 	server_peer->peer_s.read_pipe = pipe2;
 	server_peer->peer_s.peer = client_peer;
 	
+	Mutex_Lock(&client_peer->lock);
 	client_peer->type = SOCKET_PEER;
 	client_peer->peer_s.write_pipe = pipe2;
 	client_peer->peer_s.read_pipe = pipe1;
 	client_peer->peer_s.peer = server_peer;
+	Mutex_Unlock(&client_peer->lock);
+
+	FCB_open(server_peer->fcb, server_peer, &socket_file_ops);
 	
-	//mark req as admitted (set admitted "flag" equal to 1)
+	//mark req as admitted (set admitted "flag" equal to 1).
+	//The connector frees req as soon as it wakes up, so signal it under the lock.
 	req->admitted = 1; 
-
-	decref(listener_socket);
 	kernel_signal(&req->connected_cv);
 
+	decref_unlock(listener_socket);
+
 	return server_fid;
 }
 
@@ -294,22 +369,27 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	if(socketcb_t == NULL) 
 		return -1;
 
-   	if(socketcb_t->type != SOCKET_UNBOUND)
-  		return -1;
+	Mutex_Lock(&socketcb_t->lock);
+	int unbound = (socketcb_t->type == SOCKET_UNBOUND);
+	Mutex_Unlock(&socketcb_t->lock);
 
-	if(port > MAX_PORT || port < 1)
-		return -1; 
-
-	if(socketcb_t == NULL)
+	if(!unbound || port > MAX_PORT || port < 1) {
+		socket_put(socketcb_t);
 		return -1; 
+	}
 
+	//a socket in port_map is always a listener
+	RWLock_ReadLock(&port_lock);
    	socket_cb* server_sock = port_map[port];
 
-	if(server_sock == NULL)
+	if(server_sock == NULL) {
+		RWLock_ReadUnlock(&port_lock);
+		socket_put(socketcb_t);
 		return -1; 
+	}
 
-	if(server_sock->type != SOCKET_LISTENER)
-		return -1; 
+	Mutex_Lock(&server_sock->lock);
+	RWLock_ReadUnlock(&port_lock);
 
 	connection_request* request = acquire_request();
 
@@ -327,17 +407,17 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	server_sock->refcount++;
     
     //while request is not admitted block the connect call 
-	kernel_timedwait(&(request->connected_cv), SCHED_IO, timeout);    
- 	
- 	decref(server_sock);
+	kernel_timedwait(&server_sock->lock, &(request->connected_cv), SCHED_IO, timeout);    
 
  	//return -1 (error) if request is not admitted (=0)
  	//return 0 if request is admitted (=1)
     int retval = request->admitted - 1; 	
 
     rlist_remove(&(request->queue_node));
-    free(request);
+ 	decref_unlock(server_sock);
+    kmem_free(&request_cache, request);
 
+    socket_put(socketcb_t);
     return retval;
 }
 
@@ -350,27 +430,35 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how) {
 	if(socket == NULL)
 		return -1; 
 
-	if(socket->type != SOCKET_PEER)
+	if(how != SHUTDOWN_READ && how != SHUTDOWN_WRITE && how != SHUTDOWN_BOTH) {
+		socket_put(socket);
+		return -1;
+	}
+
+	Mutex_Lock(&socket->lock);
+
+	if(socket->type != SOCKET_PEER) {
+		decref_unlock(socket);
 		return -1;
+	}
+
+	//detach the pipes under the lock, and close them after releasing it
+	pipe_cb* read_pipe = NULL;
+	pipe_cb* write_pipe = NULL;
 
-	switch(how) {
-			case SHUTDOWN_READ:
-			pipe_reader_close(socket->peer_s.read_pipe);
-			socket->peer_s.read_pipe = NULL;
-			break;
-		case SHUTDOWN_WRITE:
-	    	pipe_writer_close(socket->peer_s.write_pipe);
-	    	socket->peer_s.write_pipe = NULL;
-			break;
-		case SHUTDOWN_BOTH:
-			pipe_reader_close(socket->peer_s.read_pipe);
-			pipe_writer_close(socket->peer_s.write_pipe);
-			socket->peer_s.read_pipe = NULL;
-	    	socket->peer_s.write_pipe = NULL;		
-			break;
-		default:
-			return -1;
+	if(how != SHUTDOWN_WRITE) {
+		read_pipe = socket->peer_s.read_pipe;
+		socket->peer_s.read_pipe = NULL;
+	}
+	if(how != SHUTDOWN_READ) {
+		write_pipe = socket->peer_s.write_pipe;
+		socket->peer_s.write_pipe = NULL;
 	}
 
+	decref_unlock(socket);
+
+	if(read_pipe) pipe_reader_close(read_pipe);
+	if(write_pipe) pipe_writer_close(write_pipe);
+
 	return 0; 
 }
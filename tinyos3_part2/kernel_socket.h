@@ -13,6 +13,13 @@ typedef enum socket_type_enum{
 
 socket_cb* port_map[MAX_PORT + 1]; //MAX_PORT is the maximum legal port
 
+/* Locking: port_map is protected by port_lock, and each socket by its own lock.
+   They are taken in the order  port_lock < listener lock < peer socket lock < PCB lock.
+   Pipe locks are never taken while holding a socket lock. 
+   Connect only reads port_map, so it locks port_lock for reading; Listen and
+   the closing of a listener lock it for writing. */
+extern RWLock port_lock;
+
 typedef struct unbound_socket_s {
 
     rlnode unbound_s;
@@ -39,7 +46,8 @@ typedef struct peer_socket_s {
 
 typedef struct socket_control_block
 {
-    uint refcount;
+    Mutex lock;
+    int refcount;
     FCB* fcb;
     socket_type type;
     port_t port;
@@ -10,6 +10,7 @@
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+static Mutex FT_lock = MUTEX_INIT;	/* protects FCB_freelist */
 
 
 void initialize_files()
@@ -26,32 +27,41 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  FCB* fcb = NULL;
+  Mutex_Lock(&FT_lock);
+  if(! is_rlist_empty(& FCB_freelist))
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  Mutex_Unlock(&FT_lock);
+
+  if(fcb) {
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamfunc = NULL;   /* not open yet, see get_fcb() */
   }
-  else
-    return NULL;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&FT_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&FT_lock);
 }
 
 
+/* 
+  FCBs are shared by the processes that inherit them, so the reference 
+  counts are updated atomically.
+ */
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -68,6 +78,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&cur->lock);
+    int ok = 0;
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +88,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +99,17 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
-    return 1;
+    ok = 1;
+finish:
+    Mutex_Unlock(&cur->lock);
+    return ok;
 }
 
 
@@ -101,11 +117,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
 }
 
 
@@ -124,7 +142,23 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fid];
+  /* A reserved FCB is not visible before its stream is set up */
+  if(fcb && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) != NULL)
+    FCB_incref(fcb);
+  else
+    fcb = NULL;
+  Mutex_Unlock(&cur->lock);
+  return fcb;
+}
+
+
+void FCB_open(FCB* fcb, void* streamobj, file_ops* streamfunc)
+{
+  fcb->streamobj = streamobj;
+  __atomic_store_n(&fcb->streamfunc, streamfunc, __ATOMIC_RELEASE);
 }
 
 
@@ -135,16 +169,14 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream. The reference taken by get_fcb() makes 
+     sure that the stream will not be closed (by another thread) while we 
+     are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,9 +184,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -167,7 +196,7 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream, with a reference (see sys_Read) */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
@@ -175,11 +204,6 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -195,14 +219,22 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 
 int sys_Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
-
-  FCB* fcb = get_fcb(fd);
-
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fd<0 || fd>=MAX_FILEID)
+    return -1;
+  int retcode = 0;  /* Closing a closed fd is legal! */
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fd];
+  if(fcb && fcb->streamfunc == NULL)
+    fcb = NULL;   /* still being opened by another thread */
+  if(fcb)
+    cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  /* The stream may be closed now, so the PCB is not locked */
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,18 +253,26 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
-  if(old==NULL) {
+  if(old==NULL || old->streamfunc==NULL || (new!=NULL && new->streamfunc==NULL)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  /* Close the stream previously at newfd, if any, with the PCB unlocked */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -257,10 +297,13 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  void* obj;
+  file_ops* ops;
+  if(device_open(major, minor, &obj, &ops)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_open(fcb, obj, ops);
   
   goto finok;
 finerr:
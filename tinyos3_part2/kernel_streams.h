@@ -1,7 +1,5 @@
 #ifndef __KERNEL_STREAMS_H
 #define __KERNEL_STREAMS_H
-#define PIPE_BUFFER_SIZE 4000
-
 
 #include "tinyos.h"
 #include "kernel_dev.h"
@@ -22,8 +20,12 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve,
+	@ref FCB_open and @ref FCB_unreserve.
+
+	The file table of a process is protected by the lock of its PCB,
+	and the free FCBs by a lock of their own. The reference count of 
+	an FCB is updated atomically, since FCBs are shared among processes.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -49,13 +51,36 @@ typedef struct file_control_block
 } FCB;
 
 
+/* The state of one end of a pipe, used to batch wakeups (see kernel_pipe.c) */
+typedef struct pipe_end_state
+{
+	unsigned int sleepers; /*threads blocked at this end*/
+	unsigned int wanted; /*the fewest bytes that a blocked thread waits for*/
+	void* last_thread; /*the thread that used this end last; only compared*/
+	unsigned long last_switches; /*its voluntary context switches when it left*/
+	int streaming; /*set if it had not blocked between its last two calls*/
+} pipe_end_state;
+
 typedef struct pipe_control_block
 {
+	Mutex lock; /*protects the pipe*/
 	FCB *reader, *writer;
 	CondVar has_space; /*For blocking writer if no space is available*/
 	CondVar has_data; /*For blocking reader until data are available*/
-	int w_position, r_position; /*write, read position in buffer*/
-	char BUFFER[PIPE_BUFFER_SIZE]; /*bounded (cyclic) byte buffer*/
+	/* Bytes written and read so far. They wrap around, and w_position - r_position
+	   is the number of bytes in the buffer; their positions in it are masked. */
+	unsigned int w_position, r_position;
+	/* The buffer is allocated separately, and it grows up to the capacity of 
+	   the pipe. Both are powers of two, so that ring positions are masked. */
+	char* BUFFER; /*bounded (cyclic) byte buffer, of size bytes*/
+	unsigned int size; /*the size of BUFFER*/
+	unsigned int capacity; /*the size BUFFER may grow to*/
+	unsigned int peak; /*the max. number of bytes the buffer has held*/
+	pipe_end_state rd, wr; /*the reading and writing ends*/
+	/* The buffer is charged to the process that created the pipe, if any
+	   (see kernel_pipe.c). Both fields are protected by the account lock. */
+	PCB* account; /*the process charged for BUFFER, or NULL*/
+	rlnode account_node; /*intrusive node for the pipe_list of the account*/
 
 }pipe_cb;
 
@@ -98,6 +123,9 @@ int FCB_decref(FCB* fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
+   The reserved FCBs are not visible through @ref get_fcb, until
+   their stream is set up by @ref FCB_open.
+
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
@@ -129,9 +157,24 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Set up the stream of a reserved FCB.
+
+   After this call, the FCB is visible to other threads of the 
+   process through its fid.
+
+   @param fcb an FCB returned by @ref FCB_reserve
+   @param streamobj the stream object
+   @param streamfunc the stream implementation methods
+*/
+void FCB_open(FCB* fcb, void* streamobj, file_ops* streamfunc);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Else, the reference count of the FCB is increased, so that 
+	it is not closed by another thread while it is used; the 
+	caller must release it by @ref FCB_decref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -9,12 +9,17 @@ SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(SetProcessWeight, int, (Pid_t pid, unsigned int weight), (pid, weight))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadWithStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, unsigned int mask), (tid, mask))\
+SYSCALL(GetAffinity, int, (Tid_t tid, unsigned int* mask), (tid, mask))\
+SYSCALL(SetRealTime, int, (Tid_t tid, timeout_t budget, timeout_t period), (tid, budget, period))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -23,12 +28,18 @@ SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeWithCapacity, int, (pipe_t* pipe, unsigned int capacity), (pipe, capacity))\
+SYSCALL(SetPipeCapacity, int, (Fid_t fd, unsigned int capacity), (fd, capacity))\
+SYSCALL(GetPipeInfo, int, (Fid_t fd, pipeinfo* info), (fd, info))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenThreadInfo, Fid_t, (), ())\
+SYSCALL(OpenLockInfo, Fid_t, (), ())\
+SYSCALL(OpenMemInfo, Fid_t, (), ())\
 
 
 
@@ -4,19 +4,33 @@
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_pipe.h"
 
 /** 
   @brief Create a new thread in the current process. Also returns its Tid_t 
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{ 
+  return sys_CreateThreadWithStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size. 
+  */
+Tid_t sys_CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size)
 { 
   if (task == NULL){
       return NOTHREAD;
   }
 
+  //a stack size of 0 means the default size
+  if (stack_size != 0 && (stack_size < MIN_THREAD_STACK_SIZE || stack_size > MAX_THREAD_STACK_SIZE)){
+      return NOTHREAD;
+  }
+
   PCB* curproc = CURPROC; 
  
-  PTCB* newptcb =spawn_process_thread(curproc, start_process_thread);  
+  PTCB* newptcb =spawn_process_thread(curproc, start_process_thread, stack_size);  
 
   /*passing arguments*/
   newptcb->task = task; 
@@ -27,7 +41,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   wakeup(newptcb->tcb);
 
-  return (Tid_t) newptcb;
+  return newptcb->tid;
 }
 
 /**
@@ -35,7 +49,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) cur_thread()->ptcb;
+	return cur_thread()->ptcb->tid;
 }
 
 /**
@@ -44,28 +58,27 @@ Tid_t sys_ThreadSelf()
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
   PCB* curproc = CURPROC; 
-  PTCB* ptcb = (PTCB*)tid; 
+  int ret = -1;
 
-  if(ptcb==NULL){
-    return -1;
-  }
+  //the thread table and the ptcbs are protected by the process lock
+  Mutex_Lock(&curproc->lock);
 
-  //check if the ptcb of the wanted thread exists in the ptcb list of the CURRENT process.
+  //find the ptcb of the wanted thread in the thread table of the CURRENT process.
   //2 threads that belong in a different processes can't be joined! 
-  rlnode* result_node = rlist_find(&curproc->ptcb_list, ptcb , NULL); 
+  PTCB* ptcb = lookup_tid(curproc, tid);
 
-  if(result_node == NULL){
-    return -1;
+  if(ptcb == NULL){
+    goto finish;
   }
 
   //check if the ptcb (of the tid thread) is detached.
   if(ptcb->detached==1){
-    return -1;
+    goto finish;
   }
  
   //check if the thread is trying to join itself (curthread).
   if(tid == sys_ThreadSelf()){
-    return -1;
+    goto finish;
   }
 
   //in any other case, threads can be joined, so we increase ref_count by 1
@@ -73,7 +86,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 
  //wait while it's not exited, or detached 
   while(!ptcb->exited && !ptcb->detached){
-    kernel_wait(& ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, & ptcb->exit_cv, SCHED_USER);
  }
   //else we are not waiting now, so the refcount is decreased by 1
   ptcb->ref_count --;
@@ -81,7 +94,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   //there is a chance we stopped waiting because the thread became detached
   //in this case we must return -1 (error)
   if (ptcb->detached){
-    return -1;
+    goto finish;
   }
 
   //set exitval
@@ -92,10 +105,14 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   //if we dont need the ptcb (ref_count==0), clear it from the memory.
   if(ptcb->ref_count == 0){
     rlist_remove(& ptcb->ptcb_list_node);
-     free(ptcb);
+    release_tid(curproc, ptcb);
+    release_PTCB(ptcb);
   }
- 
- return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
 
 }
 
@@ -109,26 +126,24 @@ int sys_ThreadDetach(Tid_t tid)
 {
   //"ptcb" is the corresponding ptcb
   PCB* curproc = CURPROC;
-  PTCB* ptcb = (PTCB*)tid; 
-
-  //check if the ptcb of the wanted thread exists in the ptcb list of the CURRENT process.
-  rlnode* result_node = rlist_find(&curproc->ptcb_list, ptcb , NULL); 
+  int ret = -1;
 
-  //failure because the wanted thread does not exist in a ptcb of the CURRENT process
-  if(result_node == NULL){
-    return -1; 
-  }
-  //failure because the wanted thread exists in list but it's exited.
-  if(ptcb->exited ==1){
-    return -1; 
-  }
+  Mutex_Lock(&curproc->lock);
 
-  //else , thread can be detached (it exists AND its not exited)
-  ptcb->detached=1; 
+  //find the ptcb of the wanted thread in the thread table of the CURRENT process.
+  PTCB* ptcb = lookup_tid(curproc, tid);
 
-  kernel_broadcast(&ptcb->exit_cv);
+  //failure because the wanted thread is not a thread of the CURRENT process,
+  //or because the wanted thread exists but it's exited.
+  if(ptcb != NULL && ptcb->exited != 1){
+    //else , thread can be detached (it exists AND its not exited)
+    ptcb->detached=1; 
+    kernel_broadcast(&ptcb->exit_cv);
+    ret = 0;
+  }
 
-  return 0; 
+  Mutex_Unlock(&curproc->lock);
+  return ret; 
 }
 
 
@@ -137,19 +152,40 @@ int sys_ThreadDetach(Tid_t tid)
 */
 void sys_ThreadExit(int exitval)
 {
-  PTCB* curptcb = (PTCB*) sys_ThreadSelf(); 
+  PTCB* curptcb = cur_thread()->ptcb; 
+  PCB* curproc = CURPROC; 
+
+  Mutex_Lock(&curproc->lock);
   curptcb->exitval = exitval;  //stores exit val in the ptcb 
   curptcb->exited = 1;         //sets exited flag 
  
-  PCB* curproc = CURPROC; 
   curproc->thread_count --;
 
   //All threads are informed of the exit
-  //Wakes up the threads that have joined the exiting (current) thread .
+  //Wakes up the threads that have joined the exiting (current) thread.
+  //A joiner may free our ptcb, so this must be done under the lock.
   kernel_broadcast(&curptcb->exit_cv);
 
-  //if its the last thread in the current process 
-  if(curproc->thread_count == 0){
+  //if its not the last thread in the current process, we are done
+  if(curproc->thread_count != 0){
+    //Bye-bye cruel world 
+    kernel_sleep(&curproc->lock, EXITED, SCHED_USER); 
+    return;
+  }
+  Mutex_Unlock(&curproc->lock);
+
+  //close the files before we become a zombie, with no lock held
+  CleanUp(curproc);
+
+  /* Release the args data, once no procinfo_read can be looking at it */
+  void* args = __atomic_exchange_n(&curproc->args, NULL, __ATOMIC_RELAXED);
+  if(args) {
+    synchronize_rcu();
+    free(args);
+  }
+
+  Mutex_Lock(&proc_lock);
+  {
     //if it's not the init process, we have to reparent the children    
     if (get_pid(curproc) != 1) {
 
@@ -159,7 +195,7 @@ void sys_ThreadExit(int exitval)
         //remove the head of the list and return the head of the list in "child" variable
         rlnode* child = rlist_pop_front(& curproc->children_list);
         
-        child->pcb->parent = initpcb;
+        __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELAXED);
         
         rlist_push_front(& initpcb->children_list, child);
       }
@@ -178,39 +214,123 @@ void sys_ThreadExit(int exitval)
     assert(is_rlist_empty(& curproc->children_list));
     assert(is_rlist_empty(& curproc->exited_list));
 
-    CleanUp(curproc);
+ 
+    //mark the process as exited.
+    __atomic_store_n(&curproc->pstate, ZOMBIE, __ATOMIC_RELAXED);
   }
-  //Bye-bye cruel world 
-  kernel_sleep(EXITED, SCHED_USER); 
+  //Bye-bye cruel world; our parent may release the PCB once proc_lock is dropped
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER); 
 }
 
  /*
      Do all the other cleanup we want here, close files etc    */
 void CleanUp(PCB* curproc)
 {
-/* Release the args data */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
-  }
-
-  /* Clean up FIDT */
+  /* Clean up FIDT. This is the last thread of the process, so no one else uses it */
   for(int i=0;i<MAX_FILEID;i++) {
     if(curproc->FIDT[i] != NULL) { 
       FCB_decref(curproc->FIDT[i]);     
       curproc->FIDT[i] = NULL;
     }
   }
+
+  //pipes still open in other processes are no longer charged to us
+  pipe_release_account(curproc);
   
   //free the ptcbs from the memory
-  while(!is_rlist_empty(&CURPROC->ptcb_list)) {
+  Mutex_Lock(&curproc->lock);
+  while(!is_rlist_empty(&curproc->ptcb_list)) {
     PTCB* ptcb = rlist_pop_front(&curproc->ptcb_list)->ptcb;
-    free(ptcb);
+    release_PTCB(ptcb);
   }
+  free(curproc->thread_table);
+  curproc->thread_table = NULL;
+  curproc->thread_table_size = 0;
+  curproc->thread_free = 0;
    //disconnect main_thread 
   curproc->main_thread = NULL;
+  Mutex_Unlock(&curproc->lock);
+}
+
 
-  //mark the process as exited.
-  curproc->pstate = ZOMBIE;
+/*
+  Return the PTCB of a live thread of the current process, or NULL.
+  On success, the process lock is held, so that the thread cannot exit.
+*/
+static PTCB* lock_live_ptcb(Tid_t tid)
+{
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(&curproc->lock);
+
+  //find the ptcb of the wanted thread in the thread table of the CURRENT process.
+  //an exited thread has no TCB any more
+  PTCB* ptcb = lookup_tid(curproc, tid);
+  if(ptcb == NULL || ptcb->exited) {
+    Mutex_Unlock(&curproc->lock);
+    return NULL;
+  }
+
+  return ptcb;
+}
+
+/**
+  @brief Set the CPU affinity of a thread.
+  */
+int sys_SetAffinity(Tid_t tid, unsigned int mask)
+{
+  PTCB* ptcb = lock_live_ptcb(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  /* The current thread may have to migrate; it is alive anyway */
+  TCB* tcb = ptcb->tcb;
+  if(tcb == cur_thread()) {
+    Mutex_Unlock(&CURPROC->lock);
+    return set_thread_affinity(tcb, mask);
+  }
+
+  int ret = set_thread_affinity(tcb, mask);
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
 }
 
+/**
+  @brief Get the CPU affinity of a thread.
+  */
+int sys_GetAffinity(Tid_t tid, unsigned int* mask)
+{
+  PTCB* ptcb = lock_live_ptcb(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  int ret = -1;
+  if(mask != NULL) {
+    *mask = ptcb->tcb->affinity;
+    ret = 0;
+  }
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
+}
+
+/**
+  @brief Move a thread into, or out of, the real-time class.
+  */
+int sys_SetRealTime(Tid_t tid, timeout_t budget, timeout_t period)
+{
+  PTCB* ptcb = lock_live_ptcb(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  /* Translate from msec to usec. The current thread may yield to
+     a more urgent one; it is alive anyway */
+  TCB* tcb = ptcb->tcb;
+  if(tcb == cur_thread()) {
+    Mutex_Unlock(&CURPROC->lock);
+    return set_thread_realtime(tcb, budget*1000ul, period*1000ul);
+  }
+
+  int ret = set_thread_realtime(tcb, budget*1000ul, period*1000ul);
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
+}
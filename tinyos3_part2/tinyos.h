@@ -72,11 +72,14 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex records the thread that owns it, so that the threads waiting 
+    for it can lend their priority to the owner.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +95,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will sleep until the mutex is unlocked, 
+  after spinning for a while on a multicore.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -103,7 +107,7 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If threads sleep on the mutex, one of them is woken up.
     @see Mutex
     @see Mutex_Lock
 */
@@ -123,6 +127,7 @@ void Mutex_Unlock(Mutex*);
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
   Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  unsigned int waiters; /**< The number of threads in `waitset` */
 } CondVar;
 
 
@@ -133,7 +138,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, MUTEX_INIT, 0 })
 
 
 /** @brief Wait on a condition variable. 
@@ -185,7 +190,9 @@ int Cond_TimedWait(Mutex* mx, CondVar* cv, timeout_t timeout);
    
    This call wakes up exactly one thread sleeping on this condition
    variable (if any). Note that the woken thread does not preempt the
-   calling thread; i.e., this is a Mesa-style implementation.
+   calling thread; i.e., this is a Mesa-style implementation. If the 
+   mutex of the woken thread is locked, the thread stays asleep until
+   the mutex is unlocked.
    @see Cond_Wait
    @see Cond_Broadcast
    */
@@ -194,12 +201,139 @@ void Cond_Signal(CondVar*);
 /** @brief Notify all threads waiting at a condition variable.
 
   Broadcast wakes up all threads sleeping on this condition variable.
-  The calling thread is not preempted by the awoken threads.
+  The calling thread is not preempted by the awoken threads. While their 
+  mutex is locked, the threads are moved to its queue, and they are woken 
+  up one at a time, as the mutex is unlocked.
 
   @see Cond_Wait
   @see Cond_Signal
 */
-void Cond_Broadcast(CondVar*); 
+void Cond_Broadcast(CondVar*);
+
+
+/** @brief Reader-writer locks.
+
+  Any number of readers, or one writer, may hold a reader-writer lock. 
+  A waiting writer keeps new readers out, so that writers are not starved.
+  Like mutexes, reader-writer locks are used both in user space and in the
+  kernel, but only in the preemptive domain, since their waiters sleep.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  Mutex state;          /**< The reader count and flags */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks. */
+#define RWLOCK_INIT ((RWLock){ MUTEX_INIT })
+
+/** @brief Lock a reader-writer lock for reading, waiting as long as it takes. */
+void RWLock_ReadLock(RWLock*);
+
+/** @brief Release a lock taken by @c RWLock_ReadLock. */
+void RWLock_ReadUnlock(RWLock*);
+
+/** @brief Lock a reader-writer lock for writing, waiting as long as it takes. */
+void RWLock_WriteLock(RWLock*);
+
+/** @brief Release a lock taken by @c RWLock_WriteLock. */
+void RWLock_WriteUnlock(RWLock*);
+
+
+/** @brief Counting semaphores.
+
+  A semaphore holds a number of tokens. @c Sem_Wait takes a token, 
+  sleeping while there are none, and @c Sem_Post puts one back, waking
+  up at most one sleeper. When a semaphore is not contended, neither call
+  takes a lock.
+
+  @see Sem_Wait
+  @see Sem_Post
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  Mutex value;          /**< The number of tokens */
+  unsigned int waiters; /**< The number of threads in @c Sem_Wait */
+} Semaphore;
+
+/** @brief This macro is used to initialize a semaphore with @c n tokens. 
+
+  @code
+  Semaphore slots = SEMAPHORE_INIT(10);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), 0 })
+
+/** @brief Take a token from a semaphore, sleeping until one is available. */
+void Sem_Wait(Semaphore*);
+
+/** @brief Add a token to a semaphore, waking up one thread sleeping in @c Sem_Wait. */
+void Sem_Post(Semaphore*);
+
+
+/** @brief Barriers.
+
+  A barrier blocks the threads that reach it, until @c n threads have
+  reached it; then they all continue, and the barrier can be used again.
+  Each arrival is a single atomic update, and the last arrival wakes up 
+  all the waiting threads in one pass, without making them contend for 
+  a mutex, as a barrier made of a @c Mutex and a @c CondVar would.
+
+  @see Barrier_Sync
+  @see BARRIER_OBJ_INIT
+ */
+typedef struct {
+  Mutex count;          /**< The number of arrivals in the current phase */
+  Mutex epoch;          /**< The number of completed phases */
+} Barrier;
+
+/** @brief This macro is used to initialize barriers. */
+#define BARRIER_OBJ_INIT ((Barrier){ 0, 0 })
+
+/** @brief Wait at a barrier until @c n threads have reached it.
+
+  All the threads that use a barrier in the same phase must pass the 
+  same @c n.
+  */
+void Barrier_Sync(Barrier* bar, unsigned int n);
+
+
+#if defined(LOCK_STATISTICS)
+
+/** @brief The contention statistics of a lock site.
+
+  In a kernel built with @c LOCK_STATISTICS, every call of @c Mutex_Lock,
+  @c Cond_Wait and @c Cond_TimedWait in the source code has a static
+  lock site, which accumulates the statistics reported by @ref OpenLockInfo.
+  This is not meant to be used directly.
+  */
+typedef struct lock_site {
+  int kind;             /**< @brief A @c lockinfo_kind */
+  const char* file;     /**< @brief The source file of the call */
+  int line;             /**< @brief The source line of the call */
+  const char* expr;     /**< @brief The mutex or condition variable, as written in the call */
+
+  struct lock_site* next; /**< @brief The next site in the kernel's list of sites */
+  int registered;       /**< @brief Set when the site is added to the list */
+
+  unsigned long acquisitions, contended, spins, yields, sleeps, max_hold;
+} lock_site;
+
+#define LOCK_SITE(kind, expr) \
+  ({ static lock_site __lock_site = { (kind), __FILE__, __LINE__, #expr }; &__lock_site; })
+
+void Mutex_Lock_at(Mutex*, lock_site*);
+int Cond_Wait_at(Mutex*, CondVar*, lock_site*);
+int Cond_TimedWait_at(Mutex*, CondVar*, timeout_t, lock_site*);
+
+#define Mutex_Lock(mx) Mutex_Lock_at((mx), LOCK_SITE(LOCKINFO_MUTEX, mx))
+#define Cond_Wait(mx, cv) Cond_Wait_at((mx), (cv), LOCK_SITE(LOCKINFO_COND, cv))
+#define Cond_TimedWait(mx, cv, timeout) \
+  Cond_TimedWait_at((mx), (cv), (timeout), LOCK_SITE(LOCKINFO_COND, cv))
+
+#endif
 
 
 /*******************************************
@@ -291,6 +425,33 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+
+/** @brief The default weight of a process. @see SetProcessWeight */
+#define DEFAULT_PROCESS_WEIGHT (100)
+
+/** @brief The maximum weight of a process. @see SetProcessWeight */
+#define MAX_PROCESS_WEIGHT (10000)
+
+/**
+  @brief Set the scheduling weight of a process.
+
+  When the kernel is booted in fair-share mode, CPU time is divided among 
+  processes in proportion to their weights, regardless of the number of 
+  threads of each process. In other modes, weights are ignored.
+
+  A new process inherits the weight of its parent. The weight of the
+  init process is @c DEFAULT_PROCESS_WEIGHT.
+
+  @param pid the pid of a live process
+  @param weight the new weight, from 1 to @c MAX_PROCESS_WEIGHT
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no live process with the given pid.
+    - the weight is out of range.
+  @see boot_options
+  */
+int SetProcessWeight(Pid_t pid, unsigned int weight);
+
+
 /*******************************************
  *
  * Threads
@@ -318,6 +479,26 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is the same as @c CreateThread, except that the size of the new thread's
+  stack is given. The default stack size is 128 kbytes. Threads that need 
+  little stack can use a smaller stack, and threads with deep recursion can 
+  use a larger one. 
+
+  Stack memory is only committed when it is first touched, and a stack overflow 
+  causes a segmentation fault.
+
+  @param task a function to execute
+  @param stack_size the stack size in bytes, between 16 kbytes and 64 Mbytes,
+     or 0 for the default size. It is rounded up to a multiple of the page size.
+  @returns the Tid of the new thread, or NOTHREAD on error. Possible errors are:
+    - @c task is NULL
+    - @c stack_size is out of range
+  */
+Tid_t CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -373,6 +554,65 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the CPU affinity of a thread.
+
+  The thread will only run on the cores whose bit is set in @c mask,
+  i.e., on core @c c iff  <tt>mask & (1<<c)</tt> is non-zero. Bits of 
+  cores that do not exist are ignored. By default, a thread may run on 
+  all cores.
+
+  If the calling thread excludes its current core, it will move to 
+  an allowed core before this call returns.
+
+  @param tid the tid of a thread of the current process
+  @param mask the new affinity mask
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the mask does not contain any existing core.
+  */
+int SetAffinity(Tid_t tid, unsigned int mask);
+
+/**
+  @brief Get the CPU affinity of a thread.
+
+  @param tid the tid of a thread of the current process
+  @param mask a location where the affinity mask is stored
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  @see SetAffinity
+  */
+int GetAffinity(Tid_t tid, unsigned int* mask);
+
+/**
+  @brief Move a thread into, or out of, the real-time scheduling class.
+
+  A real-time thread runs ahead of all other threads for up to @c budget msec 
+  in every @c period msec, and is never demoted by the scheduler. Among 
+  real-time threads, the one whose current period ends first runs first.
+  A period starts when the thread becomes ready after the previous period 
+  has ended. Once the budget of the current period is used up, the thread
+  runs as an ordinary thread, until its next period starts.
+
+  So that ordinary threads are not starved, the sum of budget/period over all 
+  real-time threads may not exceed a fraction of the total CPU time of the 
+  cores, and neither may budget/period of any one thread (see 
+  @c boot_options). A request beyond this limit is refused.
+
+  @param tid the tid of a thread of the current process
+  @param budget the CPU time of each period, in msec, or 0 to make the
+     thread an ordinary thread again
+  @param period the period, in msec
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the budget is non-zero, and larger than the period.
+    - the real-time bandwidth would be exceeded.
+  */
+int SetRealTime(Tid_t tid, timeout_t budget, timeout_t period);
+
 
 
 /*******************************************
@@ -514,9 +754,9 @@ typedef struct pipe_s {
 	@brief Construct and return a pipe.
 
 	A pipe is a one-directional buffer accessed via two file ids,
-	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	one for each end of the buffer. The pipe holds up to 
+	@c PIPE_DEFAULT_CAPACITY bytes; a larger capacity can be given by
+	@c PipeWithCapacity or @c SetPipeCapacity.
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -527,9 +767,88 @@ typedef struct pipe_s {
 	@param pipe a pointer to a pipe_t structure for storing the file ids.
 	@returns 0 on success, or -1 on error. Possible reasons for error:
 		- the available file ids for the process are exhausted.
+	@see PipeWithCapacity
 */
 int Pipe(pipe_t* pipe);
 
+
+/** @brief The capacity of a pipe created by @c Pipe, in bytes. */
+#define PIPE_DEFAULT_CAPACITY 4096
+
+/** @brief The largest capacity that a process may give to a pipe, in bytes. */
+#define PIPE_MAX_CAPACITY (1u<<20)
+
+/** @brief The default number of bytes of pipe buffers that a process may hold. 
+	@see boot_options */
+#define PIPE_DEFAULT_BUDGET (4u<<20)
+
+/**
+	@brief Construct a pipe with a given capacity.
+
+	This is like @c Pipe, but the pipe can hold up to @c capacity bytes,
+	so that a writer can run ahead of the reader by that much before it
+	blocks. The capacity is rounded up to a power of two, which is at least
+	@c PIPE_DEFAULT_CAPACITY. A capacity of 0 selects the default.
+
+	The memory of the pipe is not allocated up front: the buffer starts 
+	at @c PIPE_DEFAULT_CAPACITY bytes and grows, by doubling, when a 
+	write does not fit in it, until it reaches the capacity of the pipe.
+
+	The buffers of the pipes that a process creates are charged to it,
+	up to a budget set by @c boot_options. A buffer that the budget does 
+	not cover does not grow, and writers wait for the reader instead. 
+	Once the process exits, its pipes that remain open in other processes
+	are no longer charged, and their buffers no longer grow.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the capacity of the pipe in bytes, or 0.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+		- the capacity is larger than @c PIPE_MAX_CAPACITY.
+		- the budget of the process does not cover the initial buffer.
+	@see SetPipeCapacity
+*/
+int PipeWithCapacity(pipe_t* pipe, unsigned int capacity);
+
+
+/**
+	@brief Change the capacity of a pipe.
+
+	The capacity is changed as with @c PipeWithCapacity. Either end of 
+	the pipe can be given. If the capacity grows, writers blocked on 
+	the pipe resume. If it shrinks, the buffer is shrunk accordingly, and
+	the memory released is returned to the budget the pipe is charged to.
+
+	@param fd a file id of either end of the pipe.
+	@param capacity the new capacity of the pipe in bytes, or 0.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the file id is not an end of a pipe.
+		- the capacity is larger than @c PIPE_MAX_CAPACITY.
+		- the pipe holds more bytes than the new capacity.
+*/
+int SetPipeCapacity(Fid_t fd, unsigned int capacity);
+
+
+/**
+	@brief The state of a pipe, returned by @c GetPipeInfo.
+*/
+typedef struct pipeinfo {
+	unsigned int capacity;		/**< @brief The max. number of bytes the pipe can hold. */
+	unsigned int buffer_size;	/**< @brief The size of the buffer allocated so far. */
+	unsigned int used;			/**< @brief The number of bytes in the pipe. */
+	unsigned int peak;			/**< @brief The max. number of bytes the pipe has held. */
+} pipeinfo;
+
+
+/**
+	@brief Return the capacity and occupancy of a pipe.
+
+	@param fd a file id of either end of the pipe.
+	@param info a pointer to a @c pipeinfo structure to fill.
+	@returns 0 on success, or -1 if the file id is not an end of a pipe.
+*/
+int GetPipeInfo(Fid_t fd, pipeinfo* info);
+
 /*******************************************
  *
  * Sockets (local)
@@ -760,6 +1079,168 @@ Fid_t OpenInfo();
 
 
 
+/**
+  @brief The number of different causes a thread may block for.
+
+  These index the @c blocked_time array of @c threadinfo. In order, they are:
+  quantum expiry, preemption, I/O, mutex contention, pipe or socket, 
+  device polling, idling and user yield.
+  */
+#define THREADINFO_CAUSES (8)
+
+/** @brief The scheduling state of a thread, as returned in a @c threadinfo. */
+typedef enum {
+  THREADINFO_READY,   /**< @brief The thread waits to run in a run queue */
+  THREADINFO_RUNNING, /**< @brief The thread is running on some core */
+  THREADINFO_BLOCKED  /**< @brief The thread is blocked */
+} threadinfo_state;
+
+/**
+	@brief A struct containing scheduler accounting for a live thread.
+
+	All times are in microseconds, and include the time spent in
+	the current state up to the time of the snapshot.
+
+	This structure is returned by thread information streams.
+	@see OpenThreadInfo
+  */
+typedef struct threadinfo
+{
+  Pid_t pid;      /**< @brief The pid of the process of the thread. */
+  Tid_t tid;      /**< @brief The tid of the thread. */
+
+  threadinfo_state state; /**< @brief The current state of the thread. */
+  int level;      /**< @brief The current priority level of the thread in the scheduler. */
+  unsigned int last_core; /**< @brief The core the thread last ran on. */
+
+  unsigned long run_time;   /**< @brief Total time spent running. */
+  unsigned long ready_time; /**< @brief Total time spent waiting in run queues. */
+  unsigned long blocked_time[THREADINFO_CAUSES]; /**< @brief Total time spent blocked, per cause. */
+
+  unsigned long vol_switches;   /**< @brief Context switches because the thread blocked or yielded. */
+  unsigned long invol_switches; /**< @brief Context switches because the thread's quantum expired, or it was preempted. */
+} threadinfo;
+
+
+/**
+	@brief Open a thread information stream.
+
+	This is a read-only stream that returns a sequence of 
+	@c threadinfo structures, each packed into a block of size 
+	@c sizeof(threadinfo). There is one structure for each live thread 
+	of each process in the system.
+
+	The information is a snapshot taken when the stream is opened.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see OpenInfo
+ */
+Fid_t OpenThreadInfo();
+
+
+/** @brief The size of the @c name field of @c lockinfo. */
+#define LOCKINFO_NAME_SIZE 64
+
+/** @brief The kind of a lock site, as returned in a @c lockinfo. */
+typedef enum {
+  LOCKINFO_MUTEX,   /**< @brief A call of @c Mutex_Lock */
+  LOCKINFO_COND     /**< @brief A call of @c Cond_Wait or @c Cond_TimedWait */
+} lockinfo_kind;
+
+/**
+	@brief A struct containing the contention statistics of a lock site.
+
+	A lock site is a call of @c Mutex_Lock, @c Cond_Wait or @c Cond_TimedWait
+	in the source code. For a condition variable, the statistics are
+	those of locking the mutex again, after each wait.
+
+	Times are in microseconds. The statistics cover the time since the
+	last boot.
+
+	This structure is returned by lock information streams.
+	@see OpenLockInfo
+  */
+typedef struct lockinfo
+{
+  lockinfo_kind kind;   /**< @brief The kind of the site. */
+  char name[LOCKINFO_NAME_SIZE]; /**< @brief The site, as "file:line expression", possibly truncated. */
+
+  unsigned long acquisitions; /**< @brief Times the mutex was locked at this site. */
+  unsigned long contended;    /**< @brief Times the mutex was found locked. */
+  unsigned long spins;        /**< @brief Total spin iterations on a locked mutex. */
+  unsigned long yields;       /**< @brief Times the CPU was yielded while spinning. */
+  unsigned long sleeps;       /**< @brief Times the thread slept on the mutex. */
+  unsigned long max_hold;     /**< @brief The longest time the mutex was held, once locked here. */
+} lockinfo;
+
+
+/**
+	@brief Open a lock information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c lockinfo structures, each packed into a block of size
+	@c sizeof(lockinfo). There is one structure for each lock site
+	that has been used since boot.
+
+	Lock statistics are only kept by a kernel built with @c LOCK_STATISTICS
+	defined (e.g., with <tt>make LOCKSTAT=1</tt>). The information is a
+	snapshot taken when the stream is opened.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the kernel was not built with @c LOCK_STATISTICS.
+		- the available file ids for the process are exhausted.
+	@see OpenThreadInfo
+ */
+Fid_t OpenLockInfo();
+
+
+/** @brief The max. length of the name of a kernel object cache, in a @c meminfo. */
+#define MEMINFO_NAME_SIZE 32
+
+/**
+	@brief A struct containing the statistics of a kernel object cache.
+
+	The kernel allocates its frequently used objects (threads, pipes,
+	sockets, connection requests) from object caches, which keep freed 
+	objects for reuse. The statistics cover the lifetime of the program,
+	across boots.
+
+	This structure is returned by memory information streams.
+	@see OpenMemInfo
+  */
+typedef struct meminfo
+{
+  char name[MEMINFO_NAME_SIZE]; /**< @brief The name of the cache. */
+  unsigned long object_size;  /**< @brief The size of the objects of the cache. */
+  unsigned long allocs;       /**< @brief Objects allocated from the cache. */
+  unsigned long frees;        /**< @brief Objects returned to the cache. */
+  unsigned long host_allocs;  /**< @brief Allocations that had to get memory from the host. */
+  unsigned long magazines;    /**< @brief Magazines (arrays of cached objects) allocated. */
+  unsigned long depot_full;   /**< @brief Full magazines in the depot, shared by all cores. */
+} meminfo;
+
+
+/**
+	@brief Open a memory information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c meminfo structures, each packed into a block of size
+	@c sizeof(meminfo). There is one structure for each kernel
+	object cache that has been used. The information is a snapshot
+	taken when the stream is opened.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see OpenLockInfo
+ */
+Fid_t OpenMemInfo();
+
+
+
 
 /*******************************************
  *
@@ -780,6 +1261,84 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief The maximum number of priority levels of the scheduler. */
+#define MAX_SCHED_LEVELS 32
+
+/** @brief Tunable kernel parameters, passed to @c boot_with_options().
+
+   A zero value for any field selects the default value. 
+   It is therefore safe to initialize an object of this type with 
+   @c BOOT_OPTIONS_INIT and only set the fields of interest.
+  */
+typedef struct boot_options
+{
+	/** @brief Number of scheduler priority levels, from 1 to @c MAX_SCHED_LEVELS. 
+	   The default is 10. */
+	unsigned int sched_levels;
+
+	/** @brief The quantum of each priority level, in usec, where level 0 is the lowest priority. 
+	   By default, the quantum is 10 msec for the top four levels, and doubles every four 
+	   levels further down. */
+	unsigned long sched_quantum[MAX_SCHED_LEVELS];
+
+	/** @brief The aging period, in usec. Every aging period, the ready threads of each core
+	   move up by one priority level. The default is 200 msec. */
+	unsigned long sched_aging;
+
+	/** @brief If non-zero, the kernel runs in tickless mode. In tickless mode, idle cores 
+	   program their timer only for the next timeout of a sleeping thread, and a core 
+	   running the only runnable thread is not preempted at the end of its quantum. */
+	int tickless;
+
+	/** @brief The maximum number of free thread blocks (TCB and stack) cached by each core, 
+	   for reuse by new threads. The default is 16. A negative value disables the cache. */
+	int thread_cache;
+
+	/** @brief If non-zero, the scheduler runs in fair-share mode. In fair-share mode, CPU time
+	   is divided among processes in proportion to their weight, and then among the threads 
+	   of each process by priority. By default, threads are scheduled regardless of their process.
+	   @see SetProcessWeight */
+	int fair_share;
+
+	/** @brief If non-zero, a woken thread does not preempt a thread of lower priority. 
+	   By default, when no allowed core is idle, a woken thread is queued at the core 
+	   running the thread of lowest priority and, if that is lower than the woken 
+	   thread's, the core is interrupted to run the woken thread at once. */
+	int no_wakeup_preempt;
+
+	/** @brief If non-zero, the owner of a mutex does not inherit the priority of the threads
+	   that sleep on it. By default, a thread sleeping on a mutex raises the priority of the owner
+	   to its own, until the owner unlocks the mutex, so that a low-priority owner is not 
+	   starved while it holds a mutex needed by a high-priority thread. */
+	int no_priority_inheritance;
+
+	/** @brief The percentage of the CPU time of each core that real-time threads may 
+	   reserve, up to 100. The default is 90. 
+	   @see SetRealTime */
+	unsigned int rt_bandwidth;
+
+	/** @brief The number of bytes of pipe buffers that each process may hold.
+	   The default is @c PIPE_DEFAULT_BUDGET.
+	   @see PipeWithCapacity */
+	unsigned int pipe_budget;
+
+} boot_options;
+
+/** @brief Initializer for a @c boot_options object, selecting the default values. */
+#define BOOT_OPTIONS_INIT ((boot_options){ 0 })
+
+/** @brief Boot tinyos3, with non-default kernel parameters.
+
+   This is the same as @c boot(), except that some kernel parameters
+   are taken from @c options. Passing a @c NULL @c options is the same as 
+   calling @c boot().
+
+   @see boot_options
+ */
+void boot_with_options(unsigned int ncores, unsigned int terminals, const boot_options* options,
+	Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
@@ -197,6 +197,62 @@ int SystemInfo(size_t argc, const char** argv)
 				pname
 				);
 		}
+		Close(finfo);
+	}
+
+	Fid_t tinfo = OpenThreadInfo();
+	if(tinfo!=NOFILE) {
+		/* Print per-thread scheduler accounting (times in msec) */
+		threadinfo info;
+		static const char* states[] = { "READY", "RUN", "BLOCK" };
+		printf("\n%5s %16s %6s %5s %10s %10s %10s %8s %8s\n",
+			"PID", "TID", "State", "Level", "Run", "Ready", "Blocked", "Vol", "Invol"
+			);
+		while(Read(tinfo, (char*) &info, sizeof(info)) > 0) {
+			unsigned long blocked = 0;
+			for(int i=0; i<THREADINFO_CAUSES; i++)
+				blocked += info.blocked_time[i];
+			printf("%5d %16lx %6s %5d %10lu %10lu %10lu %8lu %8lu\n",
+				info.pid, (unsigned long) info.tid, states[info.state], info.level,
+				info.run_time/1000, info.ready_time/1000, blocked/1000,
+				info.vol_switches, info.invol_switches
+				);
+		}
+		Close(tinfo);
+	}
+
+	Fid_t linfo = OpenLockInfo();
+	if(linfo!=NOFILE) {
+		/* Print the contended lock sites (max hold in usec) */
+		lockinfo info;
+		printf("\n%-48s %10s %10s %8s %8s %10s\n",
+			"Lock site", "Acquired", "Contended", "Yields", "Sleeps", "Max hold"
+			);
+		while(Read(linfo, (char*) &info, sizeof(info)) > 0) {
+			if(info.contended == 0)
+				continue;
+			printf("%-48s %10lu %10lu %8lu %8lu %10lu\n",
+				info.name, info.acquisitions, info.contended,
+				info.yields, info.sleeps, info.max_hold
+				);
+		}
+		Close(linfo);
+	}
+
+	Fid_t minfo = OpenMemInfo();
+	if(minfo!=NOFILE) {
+		/* Print the kernel object caches */
+		meminfo info;
+		printf("\n%-20s %6s %10s %10s %10s %10s\n",
+			"Cache", "Size", "Allocs", "Frees", "Host", "Depot"
+			);
+		while(Read(minfo, (char*) &info, sizeof(info)) > 0) {
+			printf("%-20s %6lu %10lu %10lu %10lu %10lu\n",
+				info.name, info.object_size, info.allocs, info.frees,
+				info.host_allocs, info.depot_full
+				);
+		}
+		Close(minfo);
 	}
 	printf("\n");
 	return 0;
@@ -799,6 +855,9 @@ static inline Fid_t savefid(Fid_t fsaved)
 }
 
 
+/* The capacity of the pipes between the commands of a pipeline */
+#define SHELL_PIPE_CAPACITY (256 << 10)
+
 int process_line(int argc, const char** argv)
 {
 	/* Split up into pipeline fragments */
@@ -846,8 +905,8 @@ int process_line(int argc, const char** argv)
 	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
 		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Pipe(& pipe);
+			/* Not the last fragment, make a pipe; bulk pipelines run ahead with a large one */
+			PipeWithCapacity(& pipe, SHELL_PIPE_CAPACITY);
 			Dup2(pipe.write,1);
 			Close(pipe.write);
 		} else {
@@ -69,6 +69,118 @@ BARE_TEST(test_boot,
 }
 
 
+static int test_boot_with_options_child(int argl, void* args) {
+	return fibo(25) > 0 ? 42 : 0;
+}
+
+int test_boot_with_options_boot(int argl, void* args) {
+	for(int i=0; i<4; i++) 
+		Exec(test_boot_with_options_child, 0, NULL);
+	int exitval, sum = 0;
+	for(int i=0; i<4; i++) {
+		ASSERT(WaitChild(NOPROC, &exitval)!=NOPROC);
+		sum += exitval;
+	}
+	ASSERT(sum == 4*42);
+	return 0;
+}
+
+BARE_TEST(test_boot_with_options, 
+	"Test that the kernel boots and runs processes with non-default scheduler\n"
+	"parameters passed by boot_with_options(...).")
+{
+	boot_options opts = BOOT_OPTIONS_INIT;
+	opts.sched_levels = 3;
+	opts.sched_quantum[0] = 5000;
+	opts.sched_aging = 1000;
+	boot_with_options(2,0, &opts, test_boot_with_options_boot, 0, NULL);
+
+	/* An out-of-range number of levels is clamped */
+	opts = BOOT_OPTIONS_INIT;
+	opts.sched_levels = 1000;
+	boot_with_options(1,0, &opts, test_boot_with_options_boot, 0, NULL);
+}
+
+
+static int test_fair_share_thread(int argl, void* args) {
+	for(int i=0; i<10; i++) 
+		fibo(15);
+	return 0;
+}
+
+static int test_fair_share_child(int argl, void* args) {
+	Tid_t tids[8];
+	for(int i=0; i<argl; i++)
+		tids[i] = CreateThread(test_fair_share_thread, 0, NULL);
+	test_fair_share_thread(0, NULL);
+	for(int i=0; i<argl; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 42;
+}
+
+static int test_fair_share_init(int argl, void* args) {
+	/* A wide and a narrow process, with different weights */
+	Pid_t wide = Exec(test_fair_share_child, 8, NULL);
+	Pid_t narrow = Exec(test_fair_share_child, 0, NULL);
+	SetProcessWeight(wide, 50);
+	SetProcessWeight(narrow, 400);
+
+	int exitval;
+	ASSERT(WaitChild(wide, &exitval)==wide && exitval==42);
+	ASSERT(WaitChild(narrow, &exitval)==narrow && exitval==42);
+	return 0;
+}
+
+BARE_TEST(test_fair_share_boot, 
+	"Test that the kernel runs multi-threaded processes in fair-share mode.")
+{
+	boot_options opts = BOOT_OPTIONS_INIT;
+	opts.fair_share = 1;
+	boot_with_options(1,0, &opts, test_fair_share_init, 0, NULL);
+	boot_with_options(4,0, &opts, test_fair_share_init, 0, NULL);
+}
+
+
+struct tickless_pingpong {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+};
+
+static int test_tickless_pingpong_thread(int argl, void* args) {
+	struct tickless_pingpong* p = args;
+	ASSERT(SetAffinity(ThreadSelf(), 1u << (argl % cpu_cores()))==0);
+	for(int i=0; i<100; i++) {
+		Mutex_Lock(&p->mx);
+		while(p->turn != argl)
+			Cond_Wait(&p->mx, &p->cv);
+		p->turn = 1-argl;
+		Cond_Broadcast(&p->cv);
+		Mutex_Unlock(&p->mx);
+	}
+	return 0;
+}
+
+static int test_tickless_init(int argl, void* args) {
+	struct tickless_pingpong p = { MUTEX_INIT, COND_INIT, 0 };
+	Tid_t t0 = CreateThread(test_tickless_pingpong_thread, 0, &p);
+	Tid_t t1 = CreateThread(test_tickless_pingpong_thread, 1, &p);
+	ASSERT(ThreadJoin(t0, NULL)==0);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_tickless_boot, 
+	"Test that in tickless mode, threads woken up on idle cores run without waiting\n"
+	"for a timer event.")
+{
+	boot_options opts = BOOT_OPTIONS_INIT;
+	opts.tickless = 1;
+	boot_with_options(1,0, &opts, test_tickless_init, 0, NULL);
+	boot_with_options(2,0, &opts, test_tickless_init, 0, NULL);
+}
+
+
 
 
 /*********************************************
@@ -153,6 +265,21 @@ BOOT_TEST(test_waitchild_error_on_nonchild,
 }
 
 
+BOOT_TEST(test_set_process_weight_errors,
+	"Test that SetProcessWeight returns an error for illegal pids or weights."
+	)
+{
+	ASSERT(SetProcessWeight(NOPROC, DEFAULT_PROCESS_WEIGHT)==-1);
+	ASSERT(SetProcessWeight(MAX_PROC, DEFAULT_PROCESS_WEIGHT)==-1);
+	ASSERT(SetProcessWeight(GetPid()+1, DEFAULT_PROCESS_WEIGHT)==-1);
+	ASSERT(SetProcessWeight(GetPid(), 0)==-1);
+	ASSERT(SetProcessWeight(GetPid(), MAX_PROCESS_WEIGHT+1)==-1);
+	ASSERT(SetProcessWeight(GetPid(), MAX_PROCESS_WEIGHT)==0);
+	ASSERT(SetProcessWeight(GetPid(), 1)==0);
+	return 0;
+}
+
+
 /* used to pass information to parent */
 struct test_pid_rec {
 	Pid_t pid;
@@ -400,6 +527,40 @@ static int do_timeout(int argl, void* args) {
 	return 0;
 }
 
+#define TIMED_WAITERS 32
+
+static int timed_waiter(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+	Mutex_Lock(&mx);
+	ASSERT(Cond_TimedWait(&mx, &cv, argl)==0);
+	Mutex_Unlock(&mx);
+	clock_gettime(CLOCK_REALTIME, &t2);
+
+	/* The kernel clock is coarse, and may lag by a few msec */
+	long Dt = tspec2msec(t2)-tspec2msec(t1);
+	ASSERT(Dt >= argl-10);
+	ASSERT(Dt <= argl + argl/5 + 20);
+	return 0;
+}
+
+BOOT_TEST(test_timed_waits_expire_on_time,
+	"Test that concurrent timed waits of 64 msec or more, which are cascaded in the timer wheel, expire on time."
+	)
+{
+	Tid_t tids[TIMED_WAITERS];
+	for(int i=0; i<TIMED_WAITERS; i++)
+		tids[i] = CreateThread(timed_waiter, 64 + i*13, NULL);
+	for(int i=0; i<TIMED_WAITERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_cond_timedwait_timeout, 
 	"Test that timed waits on a condition variable terminate without blocking after the timeout."
 	)
@@ -509,6 +670,57 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+struct requeue_args {
+	Mutex m;
+	CondVar cv, pcv;
+	int waiting, go, signalled;
+};
+
+static int requeue_waiter(int argl, void* args)
+{
+	struct requeue_args* A = args;
+	Mutex_Lock(&A->m);
+	A->waiting++;
+	Cond_Signal(&A->pcv);
+	int sig = 0;
+	while(! A->go)
+		sig = Cond_Wait(&A->m, &A->cv);
+	A->signalled += sig;
+	Mutex_Unlock(&A->m);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_requeue,
+	"Test that a broadcast under the mutex lets every waiter through, one at a time."
+	)
+{
+	struct requeue_args A = { MUTEX_INIT, COND_INIT, COND_INIT, 0, 0, 0 };
+	const int N = 50;
+	Tid_t t[N];
+
+	for(int i=0; i<N; i++) 
+		t[i] = CreateThread(requeue_waiter, 0, &A);
+
+	Mutex_Lock(&A.m);
+	while(A.waiting != N) Cond_Wait(&A.m, &A.pcv);
+	ASSERT(A.cv.waiters == N);
+
+	A.go = 1;
+	Cond_Broadcast(&A.cv);
+	ASSERT(A.cv.waiters == 0);
+
+	/* These have no waiters to signal */
+	Cond_Signal(&A.cv);
+	Cond_Broadcast(&A.cv);
+	Mutex_Unlock(&A.m);
+
+	for(int i=0; i<N; i++) 
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(A.signalled == N);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -908,9 +1120,13 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_with_options,
+	&test_fair_share_boot,
+	&test_tickless_boot,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
+	&test_set_process_weight_errors,
 	&test_exec_getpid_wait,
 	&test_exec_copies_arguments,
 	&test_exit_returns_status,
@@ -918,8 +1134,10 @@ TEST_SUITE(basic_tests,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
 	&test_cond_timedwait_timeout,
+	&test_timed_waits_expire_on_time,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_requeue,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1008,6 +1226,30 @@ BOOT_TEST(test_join_illegal_tid_gives_error,
 }
 
 
+static int return_argl(int argl, void* args) { return argl; }
+
+BOOT_TEST(test_join_stale_tid_gives_error,
+	"Test that the Tid of a joined thread is not mistaken for a new thread that reuses its resources")
+{
+	Tid_t old = CreateThread(return_argl, 1, NULL);
+	ASSERT(old != NOTHREAD);
+	ASSERT(ThreadJoin(old, NULL)==0);
+
+	for(int i=0; i<20; i++) {
+		Tid_t t = CreateThread(return_argl, 2, NULL);
+		ASSERT(t != NOTHREAD && t != old);
+		ASSERT(ThreadJoin(old, NULL)==-1);
+		ASSERT(ThreadDetach(old)==-1);
+
+		int retval;
+		ASSERT(ThreadJoin(t, &retval)==0);
+		ASSERT(retval==2);
+		old = t;
+	}
+	return 0;
+}
+
+
 BOOT_TEST(test_detach_illegal_tid_gives_error,
 	"Test that ThreadDetach rejects an illegal Tid")
 {
@@ -1398,11 +1640,411 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/* Use about 'argl' kbytes of stack */
+static int deep_stack_thread(int argl, void* args)
+{
+	volatile char frame[1024];
+	frame[0] = frame[1023] = (char)argl;
+	if(argl > 1)
+		return deep_stack_thread(argl-1, args) + (frame[0]==frame[1023]);
+	return 1;
+}
+
+BOOT_TEST(test_create_thread_with_stack,
+	"Test that threads can be created with a given stack size, and that illegal sizes give an error")
+{
+	/* Illegal sizes */
+	ASSERT(CreateThreadWithStack(deep_stack_thread, 1, NULL, 1024)==NOTHREAD);
+	ASSERT(CreateThreadWithStack(deep_stack_thread, 1, NULL, 1u<<30)==NOTHREAD);
+
+	/* A small stack */
+	Tid_t t1 = CreateThreadWithStack(deep_stack_thread, 4, NULL, 16*1024);
+	ASSERT(t1!=NOTHREAD);
+
+	/* A stack much larger than the default */
+	Tid_t t2 = CreateThreadWithStack(deep_stack_thread, 1000, NULL, 2*1024*1024);
+	ASSERT(t2!=NOTHREAD);
+
+	/* The default stack, with an odd size rounded up */
+	Tid_t t3 = CreateThreadWithStack(deep_stack_thread, 10, NULL, 100000);
+	ASSERT(t3!=NOTHREAD);
+
+	int exitval;
+	ASSERT(ThreadJoin(t1, &exitval)==0 && exitval==4);
+	ASSERT(ThreadJoin(t2, &exitval)==0 && exitval==1000);
+	ASSERT(ThreadJoin(t3, &exitval)==0 && exitval==10);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity,
+	"Test that a thread pinned to a core runs on that core, and that illegal affinities give an error")
+{
+	unsigned int mask;
+	Tid_t self = ThreadSelf();
+
+	ASSERT(GetAffinity(self, &mask)==0);
+	ASSERT(mask == ~0u);
+
+	ASSERT(SetAffinity(self, 0)==-1);
+	ASSERT(SetAffinity(NOTHREAD, 1)==-1);
+	if(cpu_cores() < 32)
+		ASSERT(SetAffinity(self, 1u << cpu_cores())==-1);
+
+	for(unsigned int c=0; c<cpu_cores(); c++) {
+		ASSERT(SetAffinity(self, 1u << c)==0);
+		ASSERT(cpu_core_id == c);
+		fibo(20);
+		ASSERT(cpu_core_id == c);
+		ASSERT(GetAffinity(self, &mask)==0 && mask == (1u << c));
+	}
+	return 0;
+}
+
+
+struct affinity_spinner {
+	volatile int stop;
+	volatile int core;
+};
+
+static int affinity_spinner_task(int argl, void* args)
+{
+	struct affinity_spinner* s = args;
+	while(! s->stop)
+		s->core = cpu_core_id;
+	return 0;
+}
+
+BOOT_TEST(test_set_affinity_of_other_thread,
+	"Test that a thread running or queued at a core that its new affinity excludes moves to an allowed core")
+{
+	if(cpu_cores() < 2)
+		return 0;
+
+	/* A spinner and a hog share core 1, so the spinner is running or queued there */
+	struct affinity_spinner hog = { 0, -1 }, spinner = { 0, -1 };
+	Tid_t th = CreateThread(affinity_spinner_task, 0, &hog);
+	Tid_t ts = CreateThread(affinity_spinner_task, 0, &spinner);
+	ASSERT(SetAffinity(th, 2)==0);
+	ASSERT(SetAffinity(ts, 2)==0);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<100 && spinner.core != 1; i++)
+		Cond_TimedWait(&mx, &cv, 10);
+	ASSERT(spinner.core == 1);
+
+	/* Move the spinner to core 0, where we only sleep */
+	ASSERT(SetAffinity(ts, 1)==0);
+	for(int i=0; i<100 && spinner.core != 0; i++)
+		Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+	ASSERT(spinner.core == 0);
+
+	hog.stop = spinner.stop = 1;
+	ASSERT(ThreadJoin(th, NULL)==0);
+	ASSERT(ThreadJoin(ts, NULL)==0);
+	return 0;
+}
+
+
+struct info_sleeper {
+	Mutex mx;
+	CondVar cv;
+	int go;
+};
+
+static int info_sleeper_task(int argl, void* args)
+{
+	struct info_sleeper* s = args;
+	Mutex_Lock(&s->mx);
+	while(! s->go)
+		Cond_Wait(&s->mx, &s->cv);
+	Mutex_Unlock(&s->mx);
+	return 0;
+}
+
+BOOT_TEST(test_thread_info,
+	"Test that OpenThreadInfo returns the scheduler accounting of the live threads")
+{
+	struct info_sleeper s = { MUTEX_INIT, COND_INIT, 0 };
+	Tid_t t = CreateThread(info_sleeper_task, 0, &s);
+
+	/* Sleep for 50 msec, then compute for longer than a clock tick */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+	fibo(32);
+
+	Fid_t fid = OpenThreadInfo();
+	ASSERT(fid != NOFILE);
+
+	threadinfo info;
+	int count = 0;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+		count++;
+		ASSERT(info.pid == GetPid());
+		if(info.tid == ThreadSelf()) {
+			ASSERT(info.state == THREADINFO_RUNNING);
+			ASSERT(info.run_time > 0);
+			/* The last cause is a user-level wait */
+			ASSERT(info.blocked_time[THREADINFO_CAUSES-1] >= 40000);
+			ASSERT(info.vol_switches >= 1);
+		} else {
+			ASSERT(info.tid == t);
+			ASSERT(info.state == THREADINFO_BLOCKED);
+		}
+	}
+	ASSERT(count == 2);
+	ASSERT(Close(fid) == 0);
+
+	Mutex_Lock(&s.mx);
+	s.go = 1;
+	Cond_Broadcast(&s.cv);
+	Mutex_Unlock(&s.mx);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+
+#define SYNC_THREADS 20
+#define SYNC_ROUNDS 50
+
+static struct {
+	Barrier barrier;
+	Semaphore sem;
+	RWLock rw;
+	int phase[SYNC_THREADS];
+	int inside, max_inside, readers, writers;
+	int failed;
+} sync_test;
+
+static int barrier_thread(int argl, void* args)
+{
+	for(int r=0; r<SYNC_ROUNDS; r++) {
+		sync_test.phase[argl] = r;
+		Barrier_Sync(&sync_test.barrier, SYNC_THREADS);
+		/* Everyone has reached round r, and no one has gone past it */
+		for(int i=0; i<SYNC_THREADS; i++)
+			if(sync_test.phase[i] != r) sync_test.failed = 1;
+		Barrier_Sync(&sync_test.barrier, SYNC_THREADS);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_barrier_sync,
+	"Test that Barrier_Sync holds back all threads until the last one arrives, for many phases")
+{
+	sync_test.barrier = BARRIER_OBJ_INIT;
+	sync_test.failed = 0;
+
+	Tid_t tids[SYNC_THREADS];
+	for(int i=0; i<SYNC_THREADS; i++)
+		tids[i] = CreateThread(barrier_thread, i, NULL);
+	for(int i=0; i<SYNC_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(! sync_test.failed);
+	return 0;
+}
+
+
+static int semaphore_thread(int argl, void* args)
+{
+	for(int r=0; r<SYNC_ROUNDS; r++) {
+		Sem_Wait(&sync_test.sem);
+		int in = __atomic_add_fetch(&sync_test.inside, 1, __ATOMIC_RELAXED);
+		if(in > __atomic_load_n(&sync_test.max_inside, __ATOMIC_RELAXED))
+			__atomic_store_n(&sync_test.max_inside, in, __ATOMIC_RELAXED);
+		fibo(12);
+		__atomic_sub_fetch(&sync_test.inside, 1, __ATOMIC_RELAXED);
+		Sem_Post(&sync_test.sem);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_semaphore,
+	"Test that a semaphore admits as many threads as its tokens, and no more")
+{
+	sync_test.sem = SEMAPHORE_INIT(3);
+	sync_test.inside = sync_test.max_inside = 0;
+
+	Tid_t tids[SYNC_THREADS];
+	for(int i=0; i<SYNC_THREADS; i++)
+		tids[i] = CreateThread(semaphore_thread, i, NULL);
+	for(int i=0; i<SYNC_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(sync_test.max_inside <= 3);
+	ASSERT(sync_test.sem.value == 3);
+	ASSERT(sync_test.sem.waiters == 0);
+	return 0;
+}
+
+
+static int rwlock_thread(int argl, void* args)
+{
+	for(int r=0; r<SYNC_ROUNDS; r++) {
+		if((argl + r) % 4 == 0) {
+			RWLock_WriteLock(&sync_test.rw);
+			if(sync_test.readers != 0 || sync_test.writers != 0) sync_test.failed = 1;
+			sync_test.writers++;
+			fibo(10);
+			sync_test.writers--;
+			RWLock_WriteUnlock(&sync_test.rw);
+		} else {
+			RWLock_ReadLock(&sync_test.rw);
+			__atomic_add_fetch(&sync_test.readers, 1, __ATOMIC_RELAXED);
+			if(__atomic_load_n(&sync_test.writers, __ATOMIC_RELAXED) != 0) sync_test.failed = 1;
+			fibo(10);
+			__atomic_sub_fetch(&sync_test.readers, 1, __ATOMIC_RELAXED);
+			RWLock_ReadUnlock(&sync_test.rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock excludes writers from readers and from each other")
+{
+	sync_test.rw = RWLOCK_INIT;
+	sync_test.readers = sync_test.writers = 0;
+	sync_test.failed = 0;
+
+	Tid_t tids[SYNC_THREADS];
+	for(int i=0; i<SYNC_THREADS; i++)
+		tids[i] = CreateThread(rwlock_thread, i, NULL);
+	for(int i=0; i<SYNC_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(! sync_test.failed);
+	ASSERT(sync_test.rw.state == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_lock_info,
+	"Test that OpenLockInfo reports the lock sites, if the kernel keeps lock statistics")
+{
+	Mutex mx = MUTEX_INIT;
+	for(int i=0; i<10; i++) {
+		Mutex_Lock(&mx);
+		Mutex_Unlock(&mx);
+	}
+
+	Fid_t fid = OpenLockInfo();
+#if defined(LOCK_STATISTICS)
+	ASSERT(fid != NOFILE);
+
+	lockinfo info;
+	int found = 0;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.acquisitions > 0);
+		ASSERT(info.contended <= info.acquisitions);
+		ASSERT(memchr(info.name, 0, LOCKINFO_NAME_SIZE) != NULL);
+		if(info.kind == LOCKINFO_MUTEX && strstr(info.name, "validate_api.c") 
+			&& strstr(info.name, "&mx") && info.acquisitions == 10)
+			found = 1;
+	}
+	ASSERT(found);
+	ASSERT(Close(fid) == 0);
+#else
+	ASSERT(fid == NOFILE);
+#endif
+	return 0;
+}
+
+
+static int procinfo_child(int argl, void* args)
+{
+	return 0;
+}
+
+static int procinfo_spawner(int argl, void* args)
+{
+	char name[] = "procinfo_child";
+	for(int i=0; i<200; i++)
+		WaitChild(Exec(procinfo_child, sizeof(name), name), NULL);
+	return 0;
+}
+
+BOOT_TEST(test_procinfo_while_exiting,
+	"Test that the info stream can be read while processes come and go")
+{
+	Tid_t t = CreateThread(procinfo_spawner, 0, NULL);
+
+	for(int i=0; i<50; i++) {
+		Fid_t fid = OpenInfo();
+		ASSERT(fid != NOFILE);
+
+		procinfo info;
+		while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+			ASSERT(info.pid >= 0 && info.pid < MAX_PROC);
+			if(info.main_task == procinfo_child) {
+				ASSERT(info.ppid == GetPid());
+				ASSERT(info.argl == sizeof("procinfo_child"));
+			}
+		}
+		ASSERT(Close(fid) == 0);
+	}
+
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_realtime_admission,
+	"Test that SetRealTime checks its arguments and limits the real-time bandwidth")
+{
+	Tid_t self = ThreadSelf();
+	uint ncores = cpu_cores();
+
+	ASSERT(SetRealTime(NOTHREAD, 10, 100)==-1);
+	ASSERT(SetRealTime(self, 20, 10)==-1);
+	ASSERT(SetRealTime(self, 10, 0)==-1);
+	/* More than the bandwidth of one core (90% by default) */
+	ASSERT(SetRealTime(self, 95, 100)==-1);
+
+	ASSERT(SetRealTime(self, 90, 100)==0);
+	fibo(20);
+	ASSERT(SetRealTime(self, 0, 0)==0);
+
+	/* The reservations of ncores threads fill up the bandwidth of all cores */
+	struct info_sleeper s = { MUTEX_INIT, COND_INIT, 0 };
+	Tid_t t[ncores];
+	for(uint i=0; i<ncores; i++) {
+		t[i] = CreateThread(info_sleeper_task, 0, &s);
+		ASSERT(SetRealTime(t[i], 90, 100)==0);
+	}
+	ASSERT(SetRealTime(self, 1, 100)==-1);
+
+	/* Changing a reservation replaces it, and leaving the class returns it */
+	ASSERT(SetRealTime(t[0], 45, 100)==0);
+	ASSERT(SetRealTime(self, 45, 100)==0);
+	ASSERT(SetRealTime(self, 46, 100)==-1);
+	ASSERT(SetRealTime(self, 0, 0)==0);
+
+	/* The bandwidth of exited threads is returned */
+	Mutex_Lock(&s.mx);
+	s.go = 1;
+	Cond_Broadcast(&s.cv);
+	Mutex_Unlock(&s.mx);
+	for(uint i=0; i<ncores; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(SetRealTime(self, 90, 100)==0);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
 {
 	&test_join_illegal_tid_gives_error,
+	&test_join_stale_tid_gives_error,
 	&test_detach_illegal_tid_gives_error,
 	&test_detach_self,
 	&test_detach_other,
@@ -1416,6 +2058,16 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_with_stack,
+	&test_thread_affinity,
+	&test_set_affinity_of_other_thread,
+	&test_thread_info,
+	&test_barrier_sync,
+	&test_semaphore,
+	&test_rwlock,
+	&test_lock_info,
+	&test_procinfo_while_exiting,
+	&test_realtime_admission,
 	NULL
 };
 
@@ -1558,6 +2210,203 @@ int data_consumer(int argl, void* args)
 }
 
 
+BOOT_TEST(test_pipe_capacity,
+	"Test that a pipe can be given a larger capacity, at creation or later, and that its buffer grows up to it."
+	)
+{
+	pipe_t p;
+	pipeinfo info;
+	static char buf[40000];
+
+	ASSERT(PipeWithCapacity(&p, PIPE_MAX_CAPACITY+1)==-1);
+	ASSERT(PipeWithCapacity(&p, 20000)==0);
+
+	/* The capacity is rounded up, and the buffer is not allocated up front */
+	ASSERT(GetPipeInfo(p.read, &info)==0);
+	ASSERT(info.capacity == 32768);
+	ASSERT(info.buffer_size == PIPE_DEFAULT_CAPACITY);
+	ASSERT(info.used == 0 && info.peak == 0);
+
+	for(int i=0; i<40000; i++) buf[i] = (char) i;
+
+	/* A write beyond the default capacity grows the buffer */
+	ASSERT(Write(p.write, buf, 30000)==30000);
+	ASSERT(GetPipeInfo(p.write, &info)==0);
+	ASSERT(info.buffer_size == 32768);
+	ASSERT(info.used == 30000 && info.peak == 30000);
+
+	/* The pipe does not grow beyond its capacity */
+	ASSERT(Write(p.write, buf+30000, 5000)==2768);
+	ASSERT(SetPipeCapacity(p.read, 0)==-1);
+
+	ASSERT(SetPipeCapacity(p.read, 65536)==0);
+	ASSERT(Write(p.write, buf+32768, 7232)==7232);
+
+	static char rbuf[40000];
+	ASSERT(Read(p.read, rbuf, 40000)==40000);
+	ASSERT(memcmp(buf, rbuf, 40000)==0);
+
+	/* An empty pipe shrinks back to the default */
+	ASSERT(SetPipeCapacity(p.write, 0)==0);
+	ASSERT(GetPipeInfo(p.read, &info)==0);
+	ASSERT(info.capacity == PIPE_DEFAULT_CAPACITY);
+	ASSERT(info.buffer_size == PIPE_DEFAULT_CAPACITY);
+	ASSERT(info.used == 0 && info.peak == 40000);
+
+	/* Only pipes have a capacity */
+	Fid_t fnull = OpenNull();
+	ASSERT(GetPipeInfo(fnull, &info)==-1);
+	ASSERT(SetPipeCapacity(fnull, 0)==-1);
+	ASSERT(GetPipeInfo(NOFILE, &info)==-1);
+
+	Close(fnull);
+	Close(p.read);
+	Close(p.write);
+	return 0;
+}
+
+
+static int test_pipe_budget_boot(int argl, void* args)
+{
+	pipe_t p1, p2, p3;
+	pipeinfo info;
+	static char buf[65536];
+
+	/* Of the 64K budget, the first pipe takes 4K, and grows to 32K */
+	ASSERT(PipeWithCapacity(&p1, PIPE_MAX_CAPACITY)==0);
+	ASSERT(Write(p1.write, buf, 32768)==32768);
+
+	/* The second pipe starts with 4K, and the rest covers growing to 32K, not 64K */
+	ASSERT(PipeWithCapacity(&p2, PIPE_MAX_CAPACITY)==0);
+	ASSERT(Write(p2.write, buf, 65536)==32768);
+	ASSERT(GetPipeInfo(p2.read, &info)==0);
+	ASSERT(info.buffer_size == 32768 && info.capacity == PIPE_MAX_CAPACITY);
+
+	/* The budget is used up */
+	ASSERT(Pipe(&p3)==-1);
+
+	/* Shrinking a pipe refunds its buffer */
+	ASSERT(Read(p2.read, buf, 65536)==32768);
+	ASSERT(SetPipeCapacity(p2.read, 0)==0);
+	ASSERT(Pipe(&p3)==0);
+	Close(p3.read);
+	Close(p3.write);
+
+	/* So does freeing it */
+	Close(p1.read);
+	Close(p1.write);
+	ASSERT(PipeWithCapacity(&p1, PIPE_MAX_CAPACITY)==0);
+	ASSERT(Write(p1.write, buf, 65536)==32768);
+
+	Close(p1.read);
+	Close(p1.write);
+	Close(p2.read);
+	Close(p2.write);
+	return 0;
+}
+
+BARE_TEST(test_pipe_budget,
+	"Test that the pipe buffers of a process grow only as far as its budget covers, and are refunded when freed."
+	)
+{
+	boot_options opts = BOOT_OPTIONS_INIT;
+	opts.pipe_budget = 65536;
+	boot_with_options(1, 0, &opts, test_pipe_budget_boot, 0, NULL);
+}
+
+
+static int burst_writer(int argl, void* args)
+{
+	pipe_t* p = args;
+	char c;
+	for(int round=0; round<10; round++) {
+		/* A burst of small writes, then a wait for the reply */
+		for(int i=0; i<argl; i++)
+			ASSERT(Write(p[0].write, "x", 1)==1);
+		ASSERT(Read(p[1].read, &c, 1)==1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_burst_then_wait,
+	"Test that a reader gets the data of a writer that streams a few bytes and then waits, although wakeups are batched."
+	)
+{
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0);
+	ASSERT(Pipe(&p[1])==0);
+	Tid_t t = CreateThread(burst_writer, 7, p);
+
+	char buf[16];
+	for(int round=0; round<10; round++) {
+		int got = 0;
+		while(got < 7) {
+			int rc = Read(p[0].read, buf, sizeof(buf));
+			ASSERT(rc > 0);
+			got += rc;
+		}
+		ASSERT(got == 7);
+		ASSERT(Write(p[1].write, "y", 1)==1);
+	}
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	for(int i=0; i<2; i++) {
+		Close(p[i].read);
+		Close(p[i].write);
+	}
+	return 0;
+}
+
+
+#define ORDER_BYTES (1 << 20)
+
+static int ordered_writer(int argl, void* args)
+{
+	pipe_t* p = args;
+	static char buf[5000];
+	unsigned int sent = 0;
+	for(unsigned int chunk = 1; sent < ORDER_BYTES; chunk = (chunk * 7 + 3) % 5000 + 1) {
+		unsigned int n = (chunk < ORDER_BYTES - sent) ? chunk : ORDER_BYTES - sent;
+		for(unsigned int i=0; i<n; i++)
+			buf[i] = (char)((sent + i) % 251);
+		unsigned int done = 0;
+		while(done < n) {
+			int rc = Write(p->write, buf + done, n - done);
+			ASSERT(rc > 0);
+			done += rc;
+		}
+		sent += n;
+	}
+	Close(p->write);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_preserves_order,
+	"Test that a pipe delivers the bytes in order, for writes and reads of sizes that do not align with its buffer."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Tid_t t = CreateThread(ordered_writer, 0, &p);
+
+	static char buf[3000];
+	unsigned int received = 0;
+	for(unsigned int chunk = 1; ; chunk = (chunk * 5 + 1) % 3000 + 1) {
+		int rc = Read(p.read, buf, chunk);
+		ASSERT(rc >= 0);
+		if(rc == 0) break;
+		for(int i=0; i<rc; i++)
+			ASSERT(buf[i] == (char)((received + i) % 251));
+		received += rc;
+	}
+	ASSERT(received == ORDER_BYTES);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(p.read);
+	return 0;
+}
+
+
 BOOT_TEST(test_pipe_single_producer,
 	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
 	)
@@ -1642,6 +2491,10 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_preserves_order,
+	&test_pipe_capacity,
+	&test_pipe_budget,
+	&test_pipe_burst_then_wait,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
 	NULL
@@ -2005,6 +2858,55 @@ BOOT_TEST(test_connect_fails_on_timeout,
 
 
 
+/* Sum the host allocations of the object caches used for a connection */
+static unsigned long connection_host_allocs()
+{
+	Fid_t fid = OpenMemInfo();
+	ASSERT(fid != NOFILE);
+
+	unsigned long total = 0;
+	meminfo info;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.host_allocs <= info.allocs);
+		ASSERT(memchr(info.name, 0, MEMINFO_NAME_SIZE) != NULL);
+		if(strcmp(info.name, "pipe_cb")==0 || strcmp(info.name, "socket_cb")==0
+			|| strcmp(info.name, "connection_request")==0)
+			total += info.host_allocs;
+	}
+	ASSERT(Close(fid) == 0);
+	return total;
+}
+
+BOOT_TEST(test_socket_reuses_kernel_objects,
+	"Test that, in the steady state, connections are set up with kernel objects freed by earlier ones."
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	unsigned long before = 0;
+	for(int i=0; i<60; i++) {
+		if(i == 10) before = connection_host_allocs();
+
+		Fid_t sock[2];
+		sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+		connect_sockets(sock[0], lsock, sock+1, 100);
+		check_transfer(sock[0], sock[1]);
+		ASSERT(Close(sock[0])==0);
+		ASSERT(Close(sock[1])==0);
+	}
+	unsigned long after = connection_host_allocs();
+
+	/* With more cores, objects may be freed on one core and allocated 
+	   on another, until every core has stocked its magazines */
+	if(cpu_cores() == 1)
+		ASSERT(after == before);
+
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_small_transfer,
 	"Open a socket and put just a little data in it, in both directions, for many times."
 	)
@@ -2221,6 +3123,7 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_timeout,
 
 	&test_socket_small_transfer,
+	&test_socket_reuses_kernel_objects,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
 